@@ -16,15 +16,47 @@
 
 */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
+#include <ctype.h>
+#include <errno.h>
+#include <assert.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <netdb.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include <libusb.h>
 #include "config.h"
 
+/* Static tracepoints for perf or bpftrace, where sys/sdt.h is available;
+   until attached each is a single nop */
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+#define TRACE(name) DTRACE_PROBE(klg2, name)
+#define TRACE1(name, a) DTRACE_PROBE1(klg2, name, a)
+#define TRACE2(name, a, b) DTRACE_PROBE2(klg2, name, a, b)
+#else
+#define TRACE(name)
+#define TRACE1(name, a)
+#define TRACE2(name, a, b)
+#endif
+
 /* USB constants */
 const uint16_t KLG2_VID = 0x07CF;
 const uint16_t KLG2_PID = 0x4112;
@@ -86,6 +118,39 @@ enum OPERMODE_T  {
     OPERATION_CUT,
     OPERATION_HALFCUT
 } opt_operation = OPERATION_PRINT;
+const char *opt_device = NULL;
+_Bool opt_loop = false;
+unsigned opt_prewarm = 0;
+const char *opt_trigger = NULL;
+int opt_live = -1;
+const char *opt_tcp = NULL;
+const char *opt_unix = NULL;
+const char *opt_shm = NULL;
+
+/* Label settings; they can change per job in the long-running mode */
+struct settings_t {
+    enum TAPECODE_T tape;
+    enum MARGINCODE_T margin;
+    enum DENSITYCODE_T density;
+    enum CUTTERCODE_T cutter;
+};
+
+/* Transfer parameters, tuned for each printer with -u; the defaults are
+   those of the standard program */
+struct transfer_t {
+    unsigned block;             /* Raster bytes in a block, up to 60 */
+    unsigned page;              /* Raster bytes in a page, up to 8192 */
+    unsigned window;            /* Pages in flight, 0 to wait for each ACK */
+    unsigned stall;             /* ms a frame may be held back, overlapping */
+    unsigned timeout;           /* ms for any transfer, 0 forever */
+};
+
+#define TRANSFER_DEFAULT { 60, 8192, 0, 20, 0 }
+
+struct transfer_t xfer = TRANSFER_DEFAULT;
+unsigned opt_tune = 0;
+unsigned opt_probe = 0;
+unsigned opt_probe_load = 0;
 
 #define PRINTER_ACK 0x06
 #define PRINTER_NAK 0x1E
@@ -94,15 +159,140 @@ enum OPERMODE_T  {
 /* Printer handle */
 libusb_device_handle *devhnd;
 
+/* File descriptor behind devhnd when opened through the device node */
+int devfd = -1;
+
+/* Set on a USB failure in the long-running mode, where a lost printer
+   must not take the whole process down */
+_Bool usb_error = false;
+
+/* Direct open of a device node needs libusb_wrap_sys_device (1.0.23) */
+#if defined(LIBUSB_API_VERSION) && LIBUSB_API_VERSION >= 0x01000107
+#define HAVE_WRAP_SYS_DEVICE 1
+#endif
+
 /* Image buffer */
 #define IMAGE_ROWS 128
 unsigned image_w;
-uint8_t *image_stripes[IMAGE_ROWS];
 
 /* Print pattern */
 unsigned pattern_size;
 uint8_t *pattern;
 
+/* Compact pattern: runs of identical columns, blank runs without any
+   column stored, so that it takes memory for its content only */
+#define RLE_BLANK UINT32_MAX
+
+struct run_t {
+    uint32_t count;             /* Columns */
+    uint32_t col;               /* In cols, or RLE_BLANK */
+};
+
+struct rle_t {
+    unsigned width;
+    unsigned nruns;
+    unsigned ncols;
+    struct run_t *runs;
+    uint8_t *cols;              /* IMAGE_ROWS/8 bytes each */
+    unsigned runs_max;          /* Allocated, while appended to */
+    unsigned cols_max;
+};
+
+/* Sequential reader of a pattern, expanded or compact */
+struct raster_reader_t {
+    const uint8_t *raw;
+    unsigned left;              /* At raw, before the next refill */
+    int (*refill)(struct raster_reader_t *rd);
+    void *arg;
+    const struct rle_t *rle;
+    unsigned run;
+    unsigned col;               /* In the run */
+    unsigned byte;              /* In the column */
+};
+
+/*======================================================================
+  Memory a compact pattern takes
+*/
+size_t rle_bytes(const struct rle_t *r)
+{
+    return sizeof *r + r->nruns * sizeof *r->runs +
+        r->ncols * (size_t)(IMAGE_ROWS/8);
+}
+
+/*======================================================================
+  Release a compact pattern
+*/
+void rle_free(struct rle_t *r)
+{
+    if (r) {
+        free(r->runs);
+        free(r->cols);
+        free(r);
+    }
+}
+
+/*======================================================================
+  Start reading a compact pattern at a byte offset
+*/
+void raster_reader_rle(struct raster_reader_t *rd, const struct rle_t *r,
+        unsigned offset)
+{
+    unsigned col = offset / (IMAGE_ROWS/8);
+    memset(rd, 0, sizeof *rd);
+    rd->rle = r;
+    rd->byte = offset % (IMAGE_ROWS/8);
+    while (rd->run < r->nruns && col >= r->runs[rd->run].count)
+        col -= r->runs[rd->run++].count;
+    rd->col = col;
+}
+
+/*======================================================================
+  Read the next n bytes of a pattern, expanding the runs of a compact
+  one and refilling a tiled one as they are reached
+*/
+int raster_read(struct raster_reader_t *rd, uint8_t *dst, unsigned n)
+{
+    if (!rd->rle) {
+        while (n) {
+            unsigned k = n;
+            if (rd->refill) {
+                if (!rd->left && rd->refill(rd))
+                    return 1;
+                if (k > rd->left)
+                    k = rd->left;
+                rd->left -= k;
+            }
+            memcpy(dst, rd->raw, k);
+            rd->raw += k;
+            dst += k;
+            n -= k;
+        }
+        return 0;
+    }
+    while (n) {
+        const struct run_t *r = &rd->rle->runs[rd->run];
+        unsigned k = IMAGE_ROWS/8 - rd->byte;
+        if (k > n)
+            k = n;
+        if (r->col == RLE_BLANK)
+            memset(dst, 0, k);
+        else
+            memcpy(dst, rd->rle->cols + (size_t)r->col * (IMAGE_ROWS/8) +
+                    rd->byte, k);
+        dst += k;
+        n -= k;
+        rd->byte += k;
+        if (rd->byte == IMAGE_ROWS/8) {
+            rd->byte = 0;
+            if (++rd->col == r->count) {
+                rd->col = 0;
+                ++rd->run;
+            }
+        }
+    }
+    return 0;
+}
+
 /*======================================================================
   Debug dump
 */
@@ -127,12 +317,20 @@ int recv_from_printer(uint8_t *d)
     memset(in, 0, KLG2_EPSIZE);
     int rxcnt = 0;
 
+    if (usb_error)
+        return -1;
+
     /* Endpoint buffer is 64 bytes */
+    TRACE(usb__recv);
     int rc = libusb_bulk_transfer(devhnd, KLG2_EPIN, in, KLG2_EPSIZE,
-            &rxcnt, 0);
+            &rxcnt, xfer.timeout);
+    TRACE2(usb__received, rxcnt, rc);
     if (rc) {
         fprintf(stderr, "Error receiving frame (%d)\n", rc);
-        abort();
+        if (!opt_loop)
+            abort();
+        usb_error = true;
+        return -1;
     }
     memcpy(d, in, rxcnt);
     debug_dump('<', in, rxcnt);
@@ -140,9 +338,11 @@ int recv_from_printer(uint8_t *d)
 }
 
 /*======================================================================
-  Send a frame to the printer
+  Send a frame to the printer. With stall, the printer may hold it back
+  for that many ms, after which 0 is returned
 */
-int send_to_printer(const uint8_t *d, uint8_t cnt, enum EPSIZE_T epsize)
+static int send_to_printer_within(const uint8_t *d, uint8_t cnt,
+        enum EPSIZE_T epsize, unsigned stall)
 {
     uint8_t out[KLG2_EPSIZE];
 
@@ -160,21 +360,38 @@ int send_to_printer(const uint8_t *d, uint8_t cnt, enum EPSIZE_T epsize)
     }
     memcpy(out, d, cnt);
     int txcnt = 0;
+    if (usb_error)
+        return -1;
     debug_dump('>', out, cnt);
+    TRACE2(usb__send, cnt, epsize);
     int rc = libusb_bulk_transfer(devhnd, KLG2_EPOUT, out, epsize,
-            &txcnt, 0);
-    if (rc) {
+            &txcnt, stall ? stall : xfer.timeout);
+    TRACE2(usb__sent, txcnt, rc);
+    if (rc == LIBUSB_ERROR_TIMEOUT && !txcnt && stall)
+        return 0;
+    if (rc && txcnt != epsize) {
         fprintf(stderr, "Error sending frame (%d)\n", rc);
-        abort();
+        if (!opt_loop)
+            abort();
+        usb_error = true;
+        return -1;
     }
     if (txcnt != epsize) {
         fprintf(stderr, "Incomplete transfer (%d/%d)\n",
                 txcnt, epsize);
-        abort();
+        if (!opt_loop)
+            abort();
+        usb_error = true;
+        return -1;
     }
     return txcnt;
 }
 
+int send_to_printer(const uint8_t *d, uint8_t cnt, enum EPSIZE_T epsize)
+{
+    return send_to_printer_within(d, cnt, epsize, 0);
+}
+
 /*======================================================================
   Check printer readiness (can be slow)
 */
@@ -184,18 +401,21 @@ int printer_check_status(void)
     static const uint8_t idcheck[] = {
         PRINTER_STX, 0x1D
     };
+    TRACE(status__start);
     send_to_printer(idcheck, 2, EPSIZE_16);
     int rc = recv_from_printer(rsp);
     if (rc != 6) {
         fprintf(stderr, "Unexpected status response length (%d)\n", rc);
-        return 1;
-    }
-    if (rsp[0] != PRINTER_STX || rsp[1] != 0x80 || rsp[2] != 0x02 ||
+        rc = 1;
+    } else if (rsp[0] != PRINTER_STX || rsp[1] != 0x80 || rsp[2] != 0x02 ||
             rsp[3] != 0x00 || rsp[4] != 0x00 || rsp[5] != 0xa6) {
         fputs("Status response mismatch\n", stderr);
-        return 1;
+        rc = 1;
+    } else {
+        rc = 0;
     }
-    return 0;
+    TRACE1(status__done, rc);
+    return rc;
 }
 
 /*======================================================================
@@ -220,8 +440,11 @@ int printer_reset(void)
     static const uint8_t reset[] = {
         0x02, 0x01
     };
+    TRACE(reset__start);
     send_to_printer(reset, 2, EPSIZE_16);
-    return printer_recv_ack("Printer reset failed\n");
+    int rc = printer_recv_ack("Printer reset failed\n");
+    TRACE1(reset__done, rc);
+    return rc;
 }
 
 /*======================================================================
@@ -274,106 +497,6 @@ int printer_cancel_job(void)
     return 0;
 }
 
-/*======================================================================
-  Pre-print config (no idea of what it does)
-*/
-int printer_prejob(void)
-{
-    static const uint8_t cfg1[] = {
-        PRINTER_STX, 0x02, 0x04, 0x00, 0x00, 0x09, 0x09, 0x01
-    };
-    send_to_printer(cfg1, 8, EPSIZE_16);
-
-    if (printer_recv_ack("Prejob failed\n")) {
-        return 1;
-    }
-
-    static const uint8_t cfg2[] = {
-        PRINTER_STX, 0x82
-    };
-    send_to_printer(cfg2, 2, EPSIZE_16);
-    uint8_t rsp[KLG2_EPSIZE];
-    int rc = recv_from_printer(rsp);
-    if (rc != 5) {
-        fprintf(stderr, "Unexpected response length (%d)\n", rc);
-        return 1;
-    }
-    if (rsp[0] != PRINTER_STX || rsp[1] != 0x80 || rsp[2] != 0x01 ||
-            rsp[3] != 0x00 || rsp[4] != 0x01) {
-        fputs("Response mismatch\n", stderr);
-        return 1;
-    }
-    return 0;
-}
-
-/*======================================================================
-  Printer Speed Adjust
-*/
-int printer_set_speed(void)
-{
-    static const uint8_t psa[] = {
-        PRINTER_STX, 0x1C, 0x01, 0x00, 0x00
-    };
-    send_to_printer(psa, 5, EPSIZE_16);
-    return printer_recv_ack("Speed adjust failed\n");
-}
-
-/*======================================================================
-  Tape check
-*/
-int printer_check_tape(enum TAPECODE_T tapeid)
-{
-    /* For some reason there is an extra byte after the tape code proper
-       (either 0 or 3), no idea of what it means */
-    static uint8_t mtc[] = {
-        PRINTER_STX, 0x17, 0x02, 0x00, 0x00, 0x00
-    };
-    mtc[4] = tapeid >> 8;
-    mtc[5] = tapeid & 0xFF;
-    send_to_printer(mtc, 6, EPSIZE_16);
-    return printer_recv_ack("Tape check failed\n");
-}
-
-/*======================================================================
-  Margin select
-*/
-int printer_set_margin(enum MARGINCODE_T marginid)
-{
-    static uint8_t afs[] = {
-        PRINTER_STX, 0x0d, 0x01, 0x00, 0x00
-    };
-    afs[4] = marginid;
-    send_to_printer(afs, 5, EPSIZE_16);
-    return printer_recv_ack("Margin select failed\n");
-}
-
-/*======================================================================
-  Density select (deployment mode select)
-*/
-int printer_set_density(enum DENSITYCODE_T densityid)
-{
-    static uint8_t dms[] = {
-        PRINTER_STX, 0x09, 0x06, 0x00,
-        0x00, 0x00, 0x01, 0x00, 0x00, 0x00
-    };
-    dms[8] = densityid;
-    send_to_printer(dms, 10, EPSIZE_16);
-    return printer_recv_ack("Print density select failed\n");
-}
-
-/*======================================================================
-  Cutter mode
-*/
-int printer_set_cutter(enum CUTTERCODE_T cutterid)
-{
-    static uint8_t cms[] = {
-        PRINTER_STX, 0x19, 0x01, 0x00, 0x00
-    };
-    cms[4] = cutterid;
-    send_to_printer(cms, 5, EPSIZE_16);
-    return printer_recv_ack("Cutter mode select failed\n");
-}
-
 /*======================================================================
   Get the mounted tape
 */
@@ -431,8 +554,11 @@ int printer_raster_end(void)
     static const uint8_t raster_end[] = {
         PRINTER_STX, 0x04
     };
+    TRACE(raster_end__start);
     send_to_printer(raster_end, 2, EPSIZE_16);
-    return printer_recv_ack("Raster end failed\n");
+    int rc = printer_recv_ack("Raster end failed\n");
+    TRACE1(raster_end__done, rc);
+    return rc;
 }
 
 /*======================================================================
@@ -443,261 +569,7197 @@ int printer_print_page(void)
     static const uint8_t print_page[] = {
         0x0C
     };
+    TRACE(print_page__start);
     send_to_printer(print_page, 1, EPSIZE_1);
-    return printer_recv_ack("Print page failed\n");
+    int rc = printer_recv_ack("Print page failed\n");
+    TRACE1(print_page__done, rc);
+    return rc;
 }
 
 
 /*======================================================================
-  Send raster block
+  Milliseconds from an arbitrary origin
 */
-int printer_raster_block(uint8_t *blk, uint8_t blksize)
+double now_ms(void)
 {
-    blk[0] = PRINTER_STX;
-    blk[1] = 0xFE;
-    blk[2] = blksize;
-    blk[3] = 0;
-    send_to_printer(blk, blksize+4, EPSIZE_64);
-    return printer_recv_ack("Raster block failed\n");
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
 }
 
-
 /*======================================================================
-  Send raster data
-  The printhead on the KL-G2 gives 8 points/mm (standard thermal 200dpi)
+  Overlapped page submission: with -O the raster commands are sent
+  without waiting for their ACK, so that the next page is uploaded
+  while the printer prints the last one. The ACKs all look the same and
+  come back in order, so they are only counted. Two pages are in flight
+  unless tuned otherwise; a frame the printer holds back is tried again
+  after taking an ACK, in case it waits for the host to read it
 */
-int printer_send_raster(const uint8_t *raw, unsigned rawsize)
-{
-    unsigned sent_size = 0;
-    unsigned page_size = 0;
-    unsigned block_size = 0;
-    uint8_t block[64];
-    do {
-        block[4 + block_size] = raw[sent_size];
-        ++block_size;
-        ++sent_size;
-        ++page_size;
-        if (block_size == 60
-                || page_size == 8192
-                || sent_size == rawsize) {
-            if (printer_raster_block(block, block_size)) {
-                return 1;
-            }
-            block_size = 0;
-            if (sent_size == rawsize) {
-                if (printer_raster_end()) {
-                    return 1;
-                }
-            }
-            if (page_size == 8192 || sent_size == rawsize) {
-                if (printer_print_page()) {
-                    return 1;
-                }
-                page_size = 0;
-            }
-        }
-    } while (sent_size < rawsize);
-    return 0;
-}
+_Bool opt_overlap = false;
+
+#define PENDING_MAX 1024
+
+enum PENDING_T {
+    PENDING_BLOCK,
+    PENDING_RASTER_END,
+    PENDING_PRINT_PAGE
+};
+
+static const char *const pending_errors[] = {
+    "Raster block failed\n",
+    "Raster end failed\n",
+    "Print page failed\n"
+};
+
+/* Timing of a page, for the verbose output */
+struct page_clock_t {
+    double start;               /* First block sent */
+    double uploaded;            /* Print page sent */
+    unsigned blocks;
+    unsigned early;             /* Taken while the last page printed */
+};
+
+struct pending_t {
+    uint8_t kind[PENDING_MAX];  /* Commands waiting for their ACK */
+    unsigned head, count;
+    unsigned pages;             /* Print page commands among them */
+    unsigned uploading, printed;
+    struct page_clock_t clock[4];
+    unsigned held;              /* Frames held back */
+} pending;
 
 /*======================================================================
-  PBM Loader
+  Read the ACK of the oldest command waiting for it
 */
-int load_image(FILE *fin)
+static int pending_collect(void)
 {
-    /* Check signature */
-    if (getc(fin) != 'P' ||
-            getc(fin) != '4' ||
-            getc(fin) != '\n') {
-        fputs("Input is not a packed PBM\n", stderr);
-        return 1;
-    }
-    /* Check for comment */
-    uint8_t ch = getc(fin);
-    while (ch == '#') {
-        do {
-            ch = getc(fin);
-        } while (ch != '\n');
-        ch = getc(fin);
-    }
-    ungetc(ch, fin);
-    unsigned img_w, img_h, pad_h;
-    if (fscanf(fin, "%u %u\n", &img_w, &img_h) != 2) {
-        fputs("PBM image size error\n", stderr);
+    enum PENDING_T kind = pending.kind[pending.head];
+    pending.head = (pending.head + 1) % PENDING_MAX;
+    --pending.count;
+    if (printer_recv_ack(pending_errors[kind])) {
+        /* No more are coming */
+        pending.count = 0;
+        TRACE2(command__acked, kind, 1);
         return 1;
     }
-
-    if (img_h > IMAGE_ROWS) {
-        fputs("WARNING: Image truncated\n", stderr);
-        img_h = IMAGE_ROWS;
+    TRACE2(command__acked, kind, 0);
+    if (kind == PENDING_PRINT_PAGE) {
+        struct page_clock_t *c = &pending.clock[pending.printed++ % 4];
+        double wait = now_ms() - c->uploaded;
+        --pending.pages;
+        if (dump_comm)
+            fprintf(stderr, "Page %u: %u blocks in %.3f ms, %u while the "
+                    "last page printed; print page ACK after %.3f ms\n",
+                    pending.printed, c->blocks, c->uploaded - c->start,
+                    c->early, wait);
     }
-    pad_h = (IMAGE_ROWS - img_h) / 2;
-
-    image_w = img_w;
-    img_w = (image_w + 7)/8;
+    return 0;
+}
 
-    int i;
-    for (i = 0; i < IMAGE_ROWS; ++i) {
-        uint8_t *stripe = calloc(1, img_w);
-        if (!stripe) {
-            fputs("malloc failed\n", stderr);
-            return 1;
-        }
-        image_stripes[i] = stripe;
-    }
-    for (i = 0; i < img_h; ++i) {
-        if (fread(image_stripes[i+pad_h], img_w, 1, fin) != 1) {
-            fputs("PBM ended unexpectedly\n", stderr);
+static int pending_collect_all(void)
+{
+    while (pending.count) {
+        if (pending_collect())
             return 1;
-        }
     }
+    return 0;
+}
 
-    pattern_size = IMAGE_ROWS/8 * image_w;
-    pattern = calloc(1, pattern_size);
-    if (!pattern) {
-        fputs("malloc failed\n", stderr);
+/*======================================================================
+  Send a raster command; its ACK is read at once, or later if
+  overlapping
+*/
+static int pending_send(const uint8_t *d, uint8_t cnt, enum EPSIZE_T epsize,
+        enum PENDING_T kind)
+{
+    double t = now_ms();
+    /* Only with a profile the ring couldn't fit, but never overrun it */
+    if (pending.count == PENDING_MAX && pending_collect())
         return 1;
+    if (!xfer.window) {
+        send_to_printer(d, cnt, epsize);
+    } else {
+        for (;;) {
+            int rc = send_to_printer_within(d, cnt, epsize,
+                    pending.count ? xfer.stall : 0);
+            if (rc < 0)
+                return 1;
+            if (rc > 0)
+                break;
+            ++pending.held;
+            if (pending_collect())
+                return 1;
+        }
     }
 
-    /* Transpose to pattern */
-    for (i = 0; i < IMAGE_ROWS; ++i) {
-        unsigned x = 0;
-        int w, b;
-        for (w = 0; w < img_w; ++w) {
-            for (b = 0; b < 8; ++b) {
-                if ((image_stripes[i][w] << b) & 0x80) {
-                    pattern[x * (IMAGE_ROWS/8) + i/8] |=
-                        1 << (i%8);
-                }
-                ++x;
-            }
-        }
+    struct page_clock_t *c = &pending.clock[pending.uploading % 4];
+    if (kind == PENDING_BLOCK) {
+        if (!c->blocks++)
+            c->start = t;
+        if (pending.pages)
+            ++c->early;
+    } else if (kind == PENDING_PRINT_PAGE) {
+        c->uploaded = now_ms();
+        ++pending.pages;
+        memset(&pending.clock[++pending.uploading % 4], 0, sizeof *c);
     }
+    pending.kind[(pending.head + pending.count++) % PENDING_MAX] = kind;
+    TRACE2(command__sent, kind, cnt);
 
-    if (dump_comm) {
-        for (i = 0; i < image_w; ++i) {
-            fprintf(stderr, "%5d [", i);
-            int j;
-            for (j = 0; j < 16; ++j) {
-                fprintf(stderr, "%02X", pattern[i*IMAGE_ROWS/8+j]);
-            }
-            fputs("]\n", stderr);
-        }
+    if (!xfer.window)
+        return pending_collect_all();
+    /* Pages printing while the next is uploaded */
+    while (pending.pages >= xfer.window) {
+        if (pending_collect())
+            return 1;
     }
     return 0;
 }
 
+/* Called at each page boundary with the bytes sent so far; a non-zero
+   return ends the label there */
+int (*raster_page_hook)(unsigned sent);
+
 /*======================================================================
-  Option handling
+  Send raster data, expanded in blocks as they are sent
+  The printhead on the KL-G2 gives 8 points/mm (standard thermal 200dpi)
+  Without end, the data is one page, maybe short, of a label that goes
+  on: it is printed but the raster is not ended
+  Returns 2 if stopped early by the page hook
 */
-void handle_options(int argc, char **argv)
+static int printer_send_reader(struct raster_reader_t *rd, unsigned rawsize,
+        _Bool end)
 {
-    int opt, oval;
-    while ((opt = getopt(argc, argv, "hvFCHm:t:c:d:")) != -1) {
-        switch (opt) {
-        case 'v':
-            dump_comm = true;
-            break;
-        case 'F':
-            opt_operation = OPERATION_FEED;
-            break;
-        case 'C':
-            opt_operation = OPERATION_CUT;
-            break;
-        case 'H':
-            opt_operation = OPERATION_HALFCUT;
-            break;
-        case 'm':
-            oval = atoi(optarg);
-            switch (oval) {
-            case 0: opt_margin = MARGINCODE_NOFEED; break;
-            case 1: opt_margin = MARGINCODE_SMALL; break;
-            case 2: opt_margin = MARGINCODE_MEDIUM; break;
-            case 3: opt_margin = MARGINCODE_LARGE; break;
-            default:
-                fputs("Invalid margin setting\n", stderr);
-                exit(1);
-            }
+    static const uint8_t raster_end[] = {
+        PRINTER_STX, 0x04
+    };
+    static const uint8_t print_page[] = {
+        0x0C
+    };
+    unsigned sent_size = 0;
+    unsigned page_size = 0;
+    uint8_t block[64];
+    int rc = 0;
+    double start = now_ms();
+    memset(&pending, 0, sizeof pending);
+    do {
+        unsigned block_size = rawsize - sent_size;
+        if (block_size > xfer.block)
+            block_size = xfer.block;
+        if (block_size > xfer.page - page_size)
+            block_size = xfer.page - page_size;
+        if (raster_read(rd, block + 4, block_size)) {
+            rc = 1;
             break;
-        case 'c':
-            oval = atoi(optarg);
-            switch (oval) {
-            case 0: opt_cutter = CUTTERCODE_NOCUT; break;
-            case 1: opt_cutter = CUTTERCODE_HALFCUT; break;
-            case 2: opt_cutter = CUTTERCODE_FULLCUT; break;
-            default:
-                fputs("Invalid cutter setting\n", stderr);
-                exit(1);
-            }
+        }
+        block[0] = PRINTER_STX;
+        block[1] = 0xFE;
+        block[2] = block_size;
+        block[3] = 0;
+        sent_size += block_size;
+        page_size += block_size;
+        if (pending_send(block, block_size + 4, EPSIZE_64, PENDING_BLOCK)) {
+            rc = 1;
             break;
-        case 'd':
-            oval = atoi(optarg);
-            switch (oval) {
-            case 1: opt_density = DENSITYCODE_1; break;
-            case 2: opt_density = DENSITYCODE_2; break;
-            case 3: opt_density = DENSITYCODE_3; break;
-            case 4: opt_density = DENSITYCODE_4; break;
-            case 5: opt_density = DENSITYCODE_5; break;
-            default:
-                fputs("Invalid print density setting\n", stderr);
-                exit(1);
+        }
+        if (sent_size == rawsize && end) {
+            if (pending_send(raster_end, 2, EPSIZE_16, PENDING_RASTER_END)) {
+                rc = 1;
+                break;
             }
+        }
+        if (page_size == xfer.page && sent_size < rawsize &&
+                raster_page_hook && raster_page_hook(sent_size)) {
+            /* Finish the label as if this was the last page */
+            rc = pending_send(raster_end, 2, EPSIZE_16, PENDING_RASTER_END) ||
+                pending_send(print_page, 1, EPSIZE_1, PENDING_PRINT_PAGE) ?
+                1 : 2;
             break;
-        case 't':
-            oval = atoi(optarg);
-            switch (oval) {
-            case 6: opt_tape = TAPECODE_6MM; break;
-            case 9: opt_tape = TAPECODE_9MM; break;
-            case 12: opt_tape = TAPECODE_12MM; break;
-            case 18: opt_tape = TAPECODE_18MM; break;
-            case 24: opt_tape = TAPECODE_24MM; break;
-            default:
-                fputs("Invalid tape size\n", stderr);
-                exit(1);
+        }
+        if (page_size == xfer.page || sent_size == rawsize) {
+            if (pending_send(print_page, 1, EPSIZE_1, PENDING_PRINT_PAGE)) {
+                rc = 1;
+                break;
             }
-            break;
-
-        case 'h':
-        default:
-            fprintf(stderr, "Usage: %s [OPTION]...\n", argv[0]);
-            fputs("Prints the PBM on the standard input\n", stderr);
-            fputs("  -F          Feed the tape an exit\n", stderr);
-            fputs("  -C          Cut the tape an exit\n", stderr);
-            fputs("  -H          Half-cut the tape an exit\n", stderr);
-            fputs("  -m margin   Margin (0 none, *1 small, 2 medium, 3 large)\n", stderr);
-            fputs("  -t tapesize Tape width in mm (6, 9, *12, 18, 24)\n", stderr);
-            fputs("  -c cutmode  Cut more (0 no cut, *1 half-cut, 2 full-cut)\n", stderr);
-            fputs("  -d density  Set print density (1-5, default 3)\n", stderr);
-            fputs("  -v          Verbose (dump USB communications)\n", stderr);
-            fputs("  -h          Display this help and exit\n", stderr);
-            exit(1);
+            page_size = 0;
         }
-    }
+    } while (sent_size < rawsize);
+    if (pending_collect_all())
+        rc = 1;
+    if (dump_comm && pending.printed)
+        fprintf(stderr, "%u pages in %.3f ms\n", pending.printed,
+                now_ms() - start);
+    return rc;
 }
 
 /*======================================================================
-  Main
+  Send a whole label from its expanded pattern
 */
-int main(int argc, char **argv)
+int printer_send_raster(const uint8_t *raw, unsigned rawsize)
 {
-    handle_options(argc, argv);
-
-    _Bool need_cancel = false;
-    int rc = libusb_init(NULL);
-    if (rc < 0)
-        return rc;
+    struct raster_reader_t rd;
+    memset(&rd, 0, sizeof rd);
+    rd.raw = raw;
+    return printer_send_reader(&rd, rawsize, true);
+}
 
-    /* Apre la comunicazione usando VID e PID */
-    devhnd = libusb_open_device_with_vid_pid(NULL, KLG2_VID, KLG2_PID);
-    if (!devhnd) {
+/*======================================================================
+  Send a page of a label still being received: printed, but with the
+  raster left open for the pages that follow
+*/
+int printer_send_page(const uint8_t *raw, unsigned rawsize)
+{
+    struct raster_reader_t rd;
+    memset(&rd, 0, sizeof rd);
+    rd.raw = raw;
+    return printer_send_reader(&rd, rawsize, false);
+}
+
+/*======================================================================
+  Send a label from its compact pattern, from a byte offset
+*/
+int printer_send_rle(const struct rle_t *r, unsigned offset)
+{
+    struct raster_reader_t rd;
+    raster_reader_rle(&rd, r, offset);
+    return printer_send_reader(&rd, r->width * (IMAGE_ROWS/8) - offset,
+            true);
+}
+
+/*======================================================================
+  Compare settings
+*/
+static _Bool settings_equal(const struct settings_t *a,
+        const struct settings_t *b)
+{
+    return a->tape == b->tape && a->margin == b->margin &&
+        a->density == b->density && a->cutter == b->cutter;
+}
+
+/*======================================================================
+  Pre-raster handshake, as a program of commands built once for the
+  settings. The full profile is as done by the standard program; the
+  minimal one leaves out the reset and the status check already done
+  just before by every caller. With -O the commands are sent back to
+  back and the replies checked in order as they come
+*/
+enum SETUP_PROFILE_T {
+    SETUP_FULL,
+    SETUP_MINIMAL
+} opt_setup = SETUP_FULL;
+
+enum SETUP_ARG_T {
+    SETUP_ARG_NONE,
+    SETUP_ARG_TAPE,
+    SETUP_ARG_MARGIN,
+    SETUP_ARG_DENSITY,
+    SETUP_ARG_CUTTER
+};
+
+struct setup_cmd_t {
+    const char *name;
+    uint8_t frame[10];
+    uint8_t len;
+    enum EPSIZE_T epsize;
+    enum SETUP_ARG_T arg;       /* Patched in at the end of the frame */
+    uint8_t reply[6];
+    uint8_t reply_len;
+    const char *error;
+    _Bool full;                 /* Only in the full profile */
+};
+
+static const struct setup_cmd_t setup_cmds[] = {
+    /* Pre-print config (no idea of what it does) */
+    { "prejob", { PRINTER_STX, 0x02, 0x04, 0x00, 0x00, 0x09, 0x09, 0x01 },
+        8, EPSIZE_16, SETUP_ARG_NONE, { PRINTER_ACK }, 1,
+        "Prejob failed\n", false },
+    { "config", { PRINTER_STX, 0x82 }, 2, EPSIZE_16, SETUP_ARG_NONE,
+        { PRINTER_STX, 0x80, 0x01, 0x00, 0x01 }, 5,
+        "Prejob response mismatch\n", false },
+    /* For some reason there is an extra byte after the tape code proper
+       (either 0 or 3), no idea of what it means */
+    { "tape", { PRINTER_STX, 0x17, 0x02, 0x00 }, 6, EPSIZE_16,
+        SETUP_ARG_TAPE, { PRINTER_ACK }, 1, "Tape check failed\n", false },
+    { "reset", { PRINTER_STX, 0x01 }, 2, EPSIZE_16, SETUP_ARG_NONE,
+        { PRINTER_ACK }, 1, "Printer reset failed\n", true },
+    { "speed", { PRINTER_STX, 0x1C, 0x01, 0x00, 0x00 }, 5, EPSIZE_16,
+        SETUP_ARG_NONE, { PRINTER_ACK }, 1, "Speed adjust failed\n", false },
+    { "margin", { PRINTER_STX, 0x0D, 0x01, 0x00 }, 5, EPSIZE_16,
+        SETUP_ARG_MARGIN, { PRINTER_ACK }, 1, "Margin select failed\n",
+        false },
+    /* Deployment mode select */
+    { "density", { PRINTER_STX, 0x09, 0x06, 0x00, 0x00, 0x00, 0x01, 0x00 },
+        10, EPSIZE_16, SETUP_ARG_DENSITY, { PRINTER_ACK }, 1,
+        "Print density select failed\n", false },
+    { "cutter", { PRINTER_STX, 0x19, 0x01, 0x00 }, 5, EPSIZE_16,
+        SETUP_ARG_CUTTER, { PRINTER_ACK }, 1,
+        "Cutter mode select failed\n", false },
+    { "status", { PRINTER_STX, 0x1D }, 2, EPSIZE_16, SETUP_ARG_NONE,
+        { PRINTER_STX, 0x80, 0x02, 0x00, 0x00, 0xA6 }, 6,
+        "Status response mismatch\n", true }
+};
+
+#define SETUP_CMDS (sizeof setup_cmds / sizeof *setup_cmds)
+
+struct setup_program_t {
+    _Bool built;
+    enum SETUP_PROFILE_T profile;
+    struct settings_t set;
+    unsigned count;
+    struct {
+        const struct setup_cmd_t *cmd;
+        uint8_t frame[10];
+    } steps[SETUP_CMDS];
+} setup_program;
+
+/*======================================================================
+  Build the program for the settings, unless already done
+*/
+static void setup_build(const struct settings_t *set)
+{
+    struct setup_program_t *prog = &setup_program;
+    if (prog->built && prog->profile == opt_setup &&
+            settings_equal(&prog->set, set))
+        return;
+
+    unsigned i, n = 0;
+    for (i = 0; i < SETUP_CMDS; ++i) {
+        const struct setup_cmd_t *cmd = &setup_cmds[i];
+        if (cmd->full && opt_setup != SETUP_FULL)
+            continue;
+        uint8_t *f = prog->steps[n].frame;
+        memcpy(f, cmd->frame, cmd->len);
+        switch (cmd->arg) {
+        case SETUP_ARG_TAPE:
+            f[cmd->len - 2] = set->tape >> 8;
+            f[cmd->len - 1] = set->tape & 0xFF;
+            break;
+        case SETUP_ARG_MARGIN:
+            f[cmd->len - 1] = set->margin;
+            break;
+        case SETUP_ARG_DENSITY:
+            f[cmd->len - 2] = set->density;
+            break;
+        case SETUP_ARG_CUTTER:
+            f[cmd->len - 1] = set->cutter;
+            break;
+        default:
+            break;
+        }
+        prog->steps[n++].cmd = cmd;
+    }
+    prog->count = n;
+    prog->profile = opt_setup;
+    prog->set = *set;
+    prog->built = true;
+}
+
+/*======================================================================
+  Check the reply to a setup command
+*/
+static int setup_check(const struct setup_cmd_t *cmd)
+{
+    uint8_t rsp[KLG2_EPSIZE];
+    int rc = recv_from_printer(rsp);
+    if (rc != cmd->reply_len || memcmp(rsp, cmd->reply, rc)) {
+        fputs(cmd->error, stderr);
+        return 1;
+    }
+    return 0;
+}
+
+/*======================================================================
+  Pre-raster handshake
+*/
+int printer_setup(const struct settings_t *set)
+{
+    setup_build(set);
+    const struct setup_program_t *prog = &setup_program;
+    double sent_at[SETUP_CMDS], start = now_ms();
+    unsigned sent = 0, done = 0;
+    TRACE1(setup__start, prog->count);
+    while (done < prog->count) {
+        if (sent < prog->count && (sent == done || xfer.window)) {
+            const struct setup_cmd_t *cmd = prog->steps[sent].cmd;
+            sent_at[sent] = now_ms();
+            int rc = send_to_printer_within(prog->steps[sent].frame,
+                    cmd->len, cmd->epsize,
+                    sent > done ? xfer.stall : 0);
+            if (rc < 0) {
+                TRACE1(setup__done, 1);
+                return 1;
+            }
+            if (rc > 0) {
+                TRACE1(setup__sent, cmd->name);
+                ++sent;
+                continue;
+            }
+        }
+        /* Next reply, also when the printer holds a command back */
+        const struct setup_cmd_t *cmd = prog->steps[done].cmd;
+        int rc = setup_check(cmd);
+        TRACE2(setup__reply, cmd->name, rc);
+        if (rc) {
+            TRACE1(setup__done, 1);
+            return 1;
+        }
+        if (dump_comm)
+            fprintf(stderr, "Setup %s: %.3f ms\n", cmd->name,
+                    now_ms() - sent_at[done]);
+        ++done;
+    }
+    if (dump_comm)
+        fprintf(stderr, "Setup (%s%s): %u commands in %.3f ms\n",
+                opt_setup == SETUP_FULL ? "full" : "minimal",
+                xfer.window ? ", pipelined" : "", prog->count,
+                now_ms() - start);
+    TRACE1(setup__done, 0);
+    return 0;
+}
+
+/*======================================================================
+  Settings from the command line
+*/
+void settings_default(struct settings_t *set)
+{
+    set->tape = opt_tape;
+    set->margin = opt_margin;
+    set->density = opt_density;
+    set->cutter = opt_cutter;
+}
+
+/*======================================================================
+  Margin code of a value given on the command line
+*/
+int margin_code(int val, enum MARGINCODE_T *code)
+{
+    switch (val) {
+    case 0: *code = MARGINCODE_NOFEED; break;
+    case 1: *code = MARGINCODE_SMALL; break;
+    case 2: *code = MARGINCODE_MEDIUM; break;
+    case 3: *code = MARGINCODE_LARGE; break;
+    default: return 1;
+    }
+    return 0;
+}
+
+/*======================================================================
+  Cutter code of a value given on the command line
+*/
+int cutter_code(int val, enum CUTTERCODE_T *code)
+{
+    switch (val) {
+    case 0: *code = CUTTERCODE_NOCUT; break;
+    case 1: *code = CUTTERCODE_HALFCUT; break;
+    case 2: *code = CUTTERCODE_FULLCUT; break;
+    default: return 1;
+    }
+    return 0;
+}
+
+/*======================================================================
+  Density code of a value given on the command line
+*/
+int density_code(int val, enum DENSITYCODE_T *code)
+{
+    switch (val) {
+    case 1: *code = DENSITYCODE_1; break;
+    case 2: *code = DENSITYCODE_2; break;
+    case 3: *code = DENSITYCODE_3; break;
+    case 4: *code = DENSITYCODE_4; break;
+    case 5: *code = DENSITYCODE_5; break;
+    default: return 1;
+    }
+    return 0;
+}
+
+/*======================================================================
+  Tape code of a width in millimetres given on the command line
+*/
+int tape_code(int val, enum TAPECODE_T *code)
+{
+    switch (val) {
+    case 6: *code = TAPECODE_6MM; break;
+    case 9: *code = TAPECODE_9MM; break;
+    case 12: *code = TAPECODE_12MM; break;
+    case 18: *code = TAPECODE_18MM; break;
+    case 24: *code = TAPECODE_24MM; break;
+    default: return 1;
+    }
+    return 0;
+}
+
+/*======================================================================
+  Printable rows for a tape, centered on the printhead
+*/
+unsigned tape_rows(enum TAPECODE_T tape)
+{
+    switch (tape) {
+    case TAPECODE_6MM: return 40;
+    case TAPECODE_9MM: return 60;
+    case TAPECODE_12MM: return 80;
+    default: return IMAGE_ROWS;
+    }
+}
+
+/*======================================================================
+  Raster operations on column patterns. A column is IMAGE_ROWS bits,
+  row i in bit i%8 of byte i/8, that is a 128-bit little endian number:
+  with SSE2 each is done on a column in one register
+*/
+#define COLUMN(p, x) ((p) + (size_t)(x) * (IMAGE_ROWS/8))
+
+enum ROP_T {
+    ROP_COPY,
+    ROP_OR,
+    ROP_AND,
+    ROP_XOR
+};
+
+#ifndef __SSE2__
+/* A column as two 64-bit halves, low rows first */
+static void column_get(const uint8_t *col, uint64_t *lo, uint64_t *hi)
+{
+    unsigned i;
+    *lo = *hi = 0;
+    for (i = 0; i < 8; ++i) {
+        *lo |= (uint64_t)col[i] << (8 * i);
+        *hi |= (uint64_t)col[i + 8] << (8 * i);
+    }
+}
+
+static void column_put(uint8_t *col, uint64_t lo, uint64_t hi)
+{
+    unsigned i;
+    for (i = 0; i < 8; ++i) {
+        col[i] = lo >> (8 * i);
+        col[i + 8] = hi >> (8 * i);
+    }
+}
+#endif
+
+/*======================================================================
+  Combine len columns of src into a pattern of length columns, from
+  column x; what falls outside is clipped
+*/
+void rop_blit(uint8_t *dst, unsigned length, int x, const uint8_t *src,
+        unsigned len, enum ROP_T op)
+{
+    unsigned from = x < 0 ? -x : 0, i;
+    for (i = from; i < len && x + (int)i < (int)length; ++i) {
+        uint8_t *d = COLUMN(dst, x + (int)i);
+        const uint8_t *s = COLUMN(src, i);
+#ifdef __SSE2__
+        __m128i a = _mm_loadu_si128((const __m128i *)d);
+        __m128i b = _mm_loadu_si128((const __m128i *)s);
+        switch (op) {
+        case ROP_OR: b = _mm_or_si128(a, b); break;
+        case ROP_AND: b = _mm_and_si128(a, b); break;
+        case ROP_XOR: b = _mm_xor_si128(a, b); break;
+        default: break;
+        }
+        _mm_storeu_si128((__m128i *)d, b);
+#else
+        unsigned k;
+        for (k = 0; k < IMAGE_ROWS/8; ++k) {
+            switch (op) {
+            case ROP_OR: d[k] |= s[k]; break;
+            case ROP_AND: d[k] &= s[k]; break;
+            case ROP_XOR: d[k] ^= s[k]; break;
+            default: d[k] = s[k]; break;
+            }
+        }
+#endif
+    }
+}
+
+/* Reverse the order of the columns, as seen through the tape */
+void rop_mirror(uint8_t *pat, unsigned len)
+{
+    uint8_t tmp[IMAGE_ROWS/8];
+    unsigned x;
+    for (x = 0; x < len / 2; ++x) {
+        uint8_t *a = COLUMN(pat, x), *b = COLUMN(pat, len - 1 - x);
+        memcpy(tmp, a, sizeof tmp);
+        memcpy(a, b, sizeof tmp);
+        memcpy(b, tmp, sizeof tmp);
+    }
+}
+
+/* Reverse the order of the rows, upside down */
+void rop_flip(uint8_t *pat, unsigned len)
+{
+    unsigned x;
+    for (x = 0; x < len; ++x) {
+        uint8_t *c = COLUMN(pat, x);
+#ifdef __SSE2__
+        __m128i v = _mm_loadu_si128((const __m128i *)c);
+        /* Bytes reversed, then the bits of each byte */
+        v = _mm_shuffle_epi32(v, _MM_SHUFFLE(0, 1, 2, 3));
+        v = _mm_shufflelo_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));
+        v = _mm_shufflehi_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));
+        v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+        const __m128i m4 = _mm_set1_epi8(0x0F), m2 = _mm_set1_epi8(0x33),
+              m1 = _mm_set1_epi8(0x55);
+        v = _mm_or_si128(_mm_slli_epi16(_mm_and_si128(v, m4), 4),
+                _mm_and_si128(_mm_srli_epi16(v, 4), m4));
+        v = _mm_or_si128(_mm_slli_epi16(_mm_and_si128(v, m2), 2),
+                _mm_and_si128(_mm_srli_epi16(v, 2), m2));
+        v = _mm_or_si128(_mm_slli_epi16(_mm_and_si128(v, m1), 1),
+                _mm_and_si128(_mm_srli_epi16(v, 1), m1));
+        _mm_storeu_si128((__m128i *)c, v);
+#else
+        uint8_t tmp[IMAGE_ROWS/8];
+        unsigned k;
+        for (k = 0; k < IMAGE_ROWS/8; ++k) {
+            uint8_t b = c[IMAGE_ROWS/8 - 1 - k];
+            b = (b & 0x0F) << 4 | b >> 4;
+            b = (b & 0x33) << 2 | (b >> 2 & 0x33);
+            b = (b & 0x55) << 1 | (b >> 1 & 0x55);
+            tmp[k] = b;
+        }
+        memcpy(c, tmp, sizeof tmp);
+#endif
+    }
+}
+
+/* Move the rows down (to higher rows) by n, up if negative */
+void rop_shift(uint8_t *pat, unsigned len, int n)
+{
+    unsigned s = n < 0 ? -n : n, x;
+    for (x = 0; x < len; ++x) {
+        uint8_t *c = COLUMN(pat, x);
+        if (s >= IMAGE_ROWS) {
+            memset(c, 0, IMAGE_ROWS/8);
+            continue;
+        }
+#ifdef __SSE2__
+        __m128i v = _mm_loadu_si128((const __m128i *)c);
+        __m128i cnt = _mm_cvtsi32_si128(s < 64 ? s : s - 64);
+        __m128i carry = _mm_cvtsi32_si128(64 - s);
+        if (n > 0) {
+            __m128i t = _mm_slli_si128(v, 8);
+            v = s < 64 ? _mm_or_si128(_mm_sll_epi64(v, cnt),
+                    _mm_srl_epi64(t, carry)) : _mm_sll_epi64(t, cnt);
+        } else if (n < 0) {
+            __m128i t = _mm_srli_si128(v, 8);
+            v = s < 64 ? _mm_or_si128(_mm_srl_epi64(v, cnt),
+                    _mm_sll_epi64(t, carry)) : _mm_srl_epi64(t, cnt);
+        }
+        _mm_storeu_si128((__m128i *)c, v);
+#else
+        uint64_t lo, hi;
+        column_get(c, &lo, &hi);
+        if (n > 0) {
+            hi = s >= 64 ? lo << (s - 64) : s ? hi << s | lo >> (64 - s) : hi;
+            lo = s >= 64 ? 0 : lo << s;
+        } else if (n < 0) {
+            lo = s >= 64 ? hi >> (s - 64) : s ? lo >> s | hi << (64 - s) : lo;
+            hi = s >= 64 ? 0 : hi >> s;
+        }
+        column_put(c, lo, hi);
+#endif
+    }
+}
+
+static _Bool column_blank(const uint8_t *c)
+{
+#ifdef __SSE2__
+    __m128i v = _mm_loadu_si128((const __m128i *)c);
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_setzero_si128())) ==
+        0xFFFF;
+#else
+    uint64_t lo, hi;
+    column_get(c, &lo, &hi);
+    return !(lo | hi);
+#endif
+}
+
+/*======================================================================
+  The columns left once the blank ones on both ends are trimmed, from
+  *first; 0 if all are blank
+*/
+unsigned rop_trim(const uint8_t *pat, unsigned len, unsigned *first)
+{
+    unsigned a = 0, b = len;
+    while (a < b && column_blank(COLUMN(pat, a)))
+        ++a;
+    while (b > a && column_blank(COLUMN(pat, b - 1)))
+        --b;
+    *first = a;
+    return b - a;
+}
+
+/* Dots in each column */
+void rop_popcount(const uint8_t *pat, unsigned len, uint8_t *counts)
+{
+    unsigned x;
+    for (x = 0; x < len; ++x) {
+        const uint8_t *c = COLUMN(pat, x);
+#ifdef __SSE2__
+        __m128i v = _mm_loadu_si128((const __m128i *)c);
+        v = _mm_sub_epi8(v, _mm_and_si128(_mm_srli_epi16(v, 1),
+                    _mm_set1_epi8(0x55)));
+        v = _mm_add_epi8(_mm_and_si128(v, _mm_set1_epi8(0x33)),
+                _mm_and_si128(_mm_srli_epi16(v, 2), _mm_set1_epi8(0x33)));
+        v = _mm_and_si128(_mm_add_epi8(v, _mm_srli_epi16(v, 4)),
+                _mm_set1_epi8(0x0F));
+        v = _mm_sad_epu8(v, _mm_setzero_si128());
+        counts[x] = _mm_cvtsi128_si32(v) +
+            _mm_cvtsi128_si32(_mm_srli_si128(v, 8));
+#else
+        uint64_t h[2];
+        unsigned i, n = 0;
+        column_get(c, &h[0], &h[1]);
+        for (i = 0; i < 2; ++i) {
+            uint64_t v = h[i];
+            v -= (v >> 1) & 0x5555555555555555ULL;
+            v = (v & 0x3333333333333333ULL) + ((v >> 2) & 0x3333333333333333ULL);
+            v = (v + (v >> 4)) & 0x0F0F0F0F0F0F0F0FULL;
+            n += (v * 0x0101010101010101ULL) >> 56;
+        }
+        counts[x] = n;
+#endif
+    }
+}
+
+/*======================================================================
+  Append width columns to a compact pattern; 1 if out of memory
+*/
+int rle_append(struct rle_t *r, const uint8_t *pat, unsigned width)
+{
+    unsigned x;
+    for (x = 0; x < width; ++x) {
+        const uint8_t *c = COLUMN(pat, x);
+        struct run_t *last = r->nruns ? &r->runs[r->nruns - 1] : NULL;
+        _Bool blank = column_blank(c);
+        if (last && (blank ? last->col == RLE_BLANK :
+                    last->col != RLE_BLANK && memcmp(c,
+                        r->cols + (size_t)last->col * (IMAGE_ROWS/8),
+                        IMAGE_ROWS/8) == 0)) {
+            ++last->count;
+            continue;
+        }
+        if (r->nruns == r->runs_max) {
+            unsigned n = r->runs_max ? r->runs_max * 2 : 16;
+            struct run_t *p = realloc(r->runs, n * sizeof *p);
+            if (!p)
+                return 1;
+            r->runs = p;
+            r->runs_max = n;
+        }
+        struct run_t *run = &r->runs[r->nruns++];
+        run->count = 1;
+        run->col = RLE_BLANK;
+        if (blank)
+            continue;
+        if (r->ncols == r->cols_max) {
+            unsigned n = r->cols_max ? r->cols_max * 2 : 16;
+            uint8_t *p = realloc(r->cols, n * (size_t)(IMAGE_ROWS/8));
+            if (!p)
+                return 1;
+            r->cols = p;
+            r->cols_max = n;
+        }
+        memcpy(r->cols + (size_t)r->ncols * (IMAGE_ROWS/8), c, IMAGE_ROWS/8);
+        run->col = r->ncols++;
+    }
+    r->width += width;
+    return 0;
+}
+
+/*======================================================================
+  Give back what the doubling left over, once complete
+*/
+void rle_finish(struct rle_t *r)
+{
+    if (r->nruns) {
+        struct run_t *p = realloc(r->runs, r->nruns * sizeof *p);
+        if (p)
+            r->runs = p;
+    }
+    if (r->ncols) {
+        uint8_t *p = realloc(r->cols, r->ncols * (size_t)(IMAGE_ROWS/8));
+        if (p)
+            r->cols = p;
+    }
+    r->runs_max = r->nruns;
+    r->cols_max = r->ncols;
+}
+
+/*======================================================================
+  Compact a pattern of width columns; NULL if out of memory
+*/
+struct rle_t *rle_encode(const uint8_t *pat, unsigned width)
+{
+    struct rle_t *r = calloc(1, sizeof *r);
+    if (r && rle_append(r, pat, width)) {
+        rle_free(r);
+        return NULL;
+    }
+    if (r)
+        rle_finish(r);
+    return r;
+}
+
+/*======================================================================
+  Trim the blank columns on both ends of the current pattern
+*/
+_Bool opt_trim = false;
+
+void pattern_trim(void)
+{
+    unsigned first, len = rop_trim(pattern, image_w, &first);
+    if (len == image_w)
+        return;
+    memmove(pattern, COLUMN(pattern, first), len * (IMAGE_ROWS/8));
+    if (dump_comm)
+        fprintf(stderr, "Trimmed %u blank columns\n", image_w - len);
+    image_w = len;
+    pattern_size = len * (IMAGE_ROWS/8);
+}
+
+/*======================================================================
+  Dots of the current pattern, in verbose mode
+*/
+void pattern_report(void)
+{
+    uint8_t *counts = malloc(image_w + 1);
+    if (!counts)
+        return;
+    rop_popcount(pattern, image_w, counts);
+    unsigned long dots = 0;
+    unsigned x, max = 0, at = 0;
+    for (x = 0; x < image_w; ++x) {
+        dots += counts[x];
+        if (counts[x] > max) {
+            max = counts[x];
+            at = x;
+        }
+    }
+    fprintf(stderr, "%u columns, %lu dots, at most %u in column %u\n",
+            image_w, dots, max, at);
+    free(counts);
+}
+
+/*======================================================================
+  Netpbm input: packed (P4) and plain (P1) PBM, and PGM (P5) which is
+  dithered straight into the column pattern
+*/
+struct pnm_t {
+    char format;                /* '1', '4' or '5' */
+    unsigned width;
+    unsigned height;
+    unsigned maxval;
+    size_t offset;              /* Of the raster */
+};
+
+enum DITHER_T {
+    DITHER_THRESHOLD,
+    DITHER_ORDERED,
+    DITHER_FS
+};
+
+enum DITHER_T opt_dither = DITHER_FS;
+unsigned opt_threshold = 128;
+
+/* Skip whitespace and comments, as allowed between header fields */
+static size_t pnm_skip(const uint8_t *buf, size_t len, size_t p)
+{
+    while (p < len) {
+        if (buf[p] == '#') {
+            while (p < len && buf[p] != '\n')
+                ++p;
+        } else if (isspace(buf[p])) {
+            ++p;
+        } else {
+            break;
+        }
+    }
+    return p;
+}
+
+/*======================================================================
+  Parse the header of the image at the start of the buffer. Returns the
+  size of the whole image, complete or not, as soon as it is known: 0 if
+  still incomplete, -1 if not a PBM or PGM
+*/
+long pnm_parse(const uint8_t *buf, size_t len, struct pnm_t *h)
+{
+    if (len < 2)
+        return 0;
+    if (buf[0] != 'P' || (buf[1] != '1' && buf[1] != '4' && buf[1] != '5'))
+        return -1;
+    h->format = buf[1];
+    h->maxval = 1;
+
+    unsigned long val[3];
+    unsigned nval = h->format == '5' ? 3 : 2, i;
+    size_t p = 2;
+    for (i = 0; i < nval; ++i) {
+        p = pnm_skip(buf, len, p);
+        if (p < len && !isdigit(buf[p]))
+            return -1;
+        val[i] = 0;
+        while (p < len && isdigit(buf[p])) {
+            val[i] = val[i] * 10 + buf[p++] - '0';
+            if (val[i] > UINT_MAX)
+                return -1;
+        }
+        if (p >= len)
+            return 0;
+    }
+    h->width = val[0];
+    h->height = val[1];
+    if (nval == 3) {
+        h->maxval = val[2];
+        if (h->maxval < 1 || h->maxval > 65535)
+            return -1;
+    }
+    /* The single whitespace before the raster must be there too */
+    if (!isspace(buf[p]))
+        return -1;
+    h->offset = ++p;
+
+    unsigned long long size;
+    if (h->format == '4') {
+        size = p + (h->width + 7ULL) / 8 * h->height;
+    } else if (h->format == '5') {
+        size = p + (unsigned long long)h->width * h->height *
+            (h->maxval > 255 ? 2 : 1);
+    } else {
+        /* Plain: as far as the last pixel, which has to be there */
+        unsigned long long n = (unsigned long long)h->width * h->height;
+        for (--p; n; --n) {
+            p = pnm_skip(buf, len, p);
+            if (p >= len)
+                return 0;
+            if (buf[p] != '0' && buf[p] != '1')
+                return -1;
+            ++p;
+        }
+        size = p;
+    }
+    if (size > LONG_MAX)
+        return -1;
+    return size;
+}
+
+/*======================================================================
+  Transpose packed rows (PBM raster) to the column pattern, centered on
+  the print area. The pattern must be cleared and height at most
+  IMAGE_ROWS
+*/
+void transpose_rows(uint8_t *out, const uint8_t *rows, unsigned stride,
+        unsigned width, unsigned height)
+{
+    unsigned pad_h = (IMAGE_ROWS - height) / 2;
+    unsigned y, x;
+    TRACE2(transpose__start, width, height);
+    for (y = 0; y < height; ++y) {
+        const uint8_t *row = rows + (size_t)y * stride;
+        unsigned i = y + pad_h;
+        for (x = 0; x < width; ++x) {
+            if ((row[x/8] << (x%8)) & 0x80)
+                out[x * (IMAGE_ROWS/8) + i/8] |= 1 << (i%8);
+        }
+    }
+    TRACE(transpose__done);
+}
+
+/* Ordered dithering thresholds, 8x8 Bayer, each row twice */
+static uint8_t bayer[8][16];
+
+static void bayer_init(void)
+{
+    static const uint8_t m[8][8] = {
+        {  0, 32,  8, 40,  2, 34, 10, 42 },
+        { 48, 16, 56, 24, 50, 18, 58, 26 },
+        { 12, 44,  4, 36, 14, 46,  6, 38 },
+        { 60, 28, 52, 20, 62, 30, 54, 22 },
+        {  3, 35, 11, 43,  1, 33,  9, 41 },
+        { 51, 19, 59, 27, 49, 17, 57, 25 },
+        { 15, 47,  7, 39, 13, 45,  5, 37 },
+        { 63, 31, 55, 23, 61, 29, 53, 21 }
+    };
+    unsigned y, x;
+    for (y = 0; y < 8; ++y) {
+        for (x = 0; x < 16; ++x)
+            bayer[y][x] = m[y][x % 8] * 4 + 2;
+    }
+}
+
+/*======================================================================
+  Make one byte of each column (8 rows of the pattern) from 8 rows of
+  gray: a dot is printed where the gray is below the threshold. Rows
+  outside the image are NULL; thresholds repeat every 16 columns
+*/
+static void pack_band(uint8_t *out, const uint8_t *const rows[8],
+        const uint8_t *const thr[8], unsigned width)
+{
+    unsigned x = 0, k;
+#ifdef __SSE2__
+    for (; x + 16 <= width; x += 16) {
+        __m128i acc = _mm_setzero_si128(), zero = _mm_setzero_si128();
+        for (k = 0; k < 8; ++k) {
+            if (!rows[k])
+                continue;
+            __m128i p = _mm_loadu_si128((const __m128i *)(rows[k] + x));
+            __m128i t = _mm_loadu_si128((const __m128i *)thr[k]);
+            /* t - p saturates to 0 unless the pixel is darker */
+            __m128i white = _mm_cmpeq_epi8(_mm_subs_epu8(t, p), zero);
+            acc = _mm_or_si128(acc,
+                    _mm_andnot_si128(white, _mm_set1_epi8(1 << k)));
+        }
+        uint8_t col[16];
+        _mm_storeu_si128((__m128i *)col, acc);
+        for (k = 0; k < 16; ++k)
+            out[(x + k) * (IMAGE_ROWS/8)] = col[k];
+    }
+#endif
+    for (; x < width; ++x) {
+        uint8_t b = 0;
+        for (k = 0; k < 8; ++k) {
+            if (rows[k] && rows[k][x] < thr[k][x % 16])
+                b |= 1 << k;
+        }
+        out[x * (IMAGE_ROWS/8)] = b;
+    }
+}
+
+/*======================================================================
+  Resampling: the image, turned by quarter turns, is scaled by weights
+  computed once for each output column and row, vertically into a row
+  of sums and then horizontally. Nearest takes one pixel, box averages
+  the pixels starting in the output pixel, area weighs them by how much
+  of it they cover
+*/
+enum SCALE_T {
+    SCALE_NONE,
+    SCALE_NEAREST,
+    SCALE_BOX,
+    SCALE_AREA
+};
+
+enum SCALE_T opt_scale = SCALE_NONE;
+unsigned opt_rotate = 0;        /* Clockwise quarter turns */
+unsigned image_fit_rows = 0;    /* Scale to, else the rows of the tape */
+
+/* An image in memory: packed bits (dots set) or gray bytes */
+struct image_t {
+    const uint8_t *data;
+    unsigned stride;
+    unsigned width;
+    unsigned height;
+    _Bool bits;
+};
+
+/* Weights of an output pixel along one axis */
+struct taps_t {
+    unsigned first;
+    unsigned count;
+    unsigned weights;           /* Index of the first */
+};
+
+struct resample_t {
+    const struct image_t *img;
+    unsigned rw, rh;            /* Size once turned */
+    struct taps_t *xt, *yt;
+    float *wx, *wy;
+    uint8_t *line;
+    float *sums;
+};
+
+static int taps_build(unsigned in, unsigned out, enum SCALE_T filter,
+        struct taps_t **taps, float **weights)
+{
+    double scale = (double)in / out;
+    unsigned max = (unsigned)scale + 2, o, n = 0;
+    *taps = malloc(out * sizeof **taps);
+    *weights = malloc((size_t)out * max * sizeof **weights);
+    if (!*taps || !*weights)
+        return 1;
+    for (o = 0; o < out; ++o) {
+        struct taps_t *t = &(*taps)[o];
+        float *w = *weights + n;
+        double lo = o * scale, hi = (o + 1) * scale;
+        unsigned i;
+        t->weights = n;
+        if (filter == SCALE_AREA) {
+            t->first = lo;
+            unsigned end = hi;
+            if (end < hi)
+                ++end;
+            if (end > in)
+                end = in;
+            if (end <= t->first)
+                end = t->first + 1;
+            t->count = end - t->first;
+            for (i = 0; i < t->count; ++i) {
+                double a = t->first + i > lo ? t->first + i : lo;
+                double b = t->first + i + 1 < hi ? t->first + i + 1 : hi;
+                w[i] = (b - a) / scale;
+            }
+        } else if (filter == SCALE_BOX) {
+            t->first = lo;
+            unsigned end = hi < in ? (unsigned)hi : in;
+            if (end <= t->first)
+                end = t->first + 1;
+            t->count = end - t->first;
+            for (i = 0; i < t->count; ++i)
+                w[i] = 1.0f / t->count;
+        } else {
+            t->first = (o + 0.5) * scale;
+            if (t->first >= in)
+                t->first = in - 1;
+            t->count = 1;
+            w[0] = 1;
+        }
+        n += t->count;
+    }
+    return 0;
+}
+
+/* Row y of the image once turned, as gray */
+static void rotated_line(const struct resample_t *rs, unsigned y,
+        uint8_t *line)
+{
+    const struct image_t *img = rs->img;
+    unsigned x;
+    for (x = 0; x < rs->rw; ++x) {
+        unsigned sx, sy;
+        switch (opt_rotate) {
+        case 1: sx = y; sy = img->height - 1 - x; break;
+        case 2: sx = img->width - 1 - x; sy = img->height - 1 - y; break;
+        case 3: sx = img->width - 1 - y; sy = x; break;
+        default: sx = x; sy = y; break;
+        }
+        const uint8_t *row = img->data + (size_t)sy * img->stride;
+        line[x] = img->bits ? ((row[sx/8] << (sx%8)) & 0x80 ? 0 : 255) :
+            row[sx];
+    }
+}
+
+/* Output row y */
+static const uint8_t *resample_row(struct resample_t *rs, unsigned y,
+        uint8_t *out, unsigned width)
+{
+    const struct taps_t *t = &rs->yt[y];
+    unsigned i, x;
+    memset(rs->sums, 0, rs->rw * sizeof *rs->sums);
+    for (i = 0; i < t->count; ++i) {
+        float w = rs->wy[t->weights + i];
+        rotated_line(rs, t->first + i, rs->line);
+        for (x = 0; x < rs->rw; ++x)
+            rs->sums[x] += w * rs->line[x];
+    }
+    for (x = 0; x < width; ++x) {
+        const struct taps_t *tx = &rs->xt[x];
+        const float *s = rs->sums + tx->first, *w = rs->wx + tx->weights;
+        float v = 0.5f;
+        for (i = 0; i < tx->count; ++i)
+            v += w[i] * s[i];
+        out[x] = v > 255 ? 255 : v;
+    }
+    return out;
+}
+
+static void resample_free(struct resample_t *rs)
+{
+    free(rs->xt);
+    free(rs->yt);
+    free(rs->wx);
+    free(rs->wy);
+    free(rs->line);
+    free(rs->sums);
+}
+
+/*======================================================================
+  Set up the resampling of an image to width x height; not scaled, it
+  is only turned and cut to height. To be freed even if it fails
+*/
+int resample_init(struct resample_t *rs, const struct image_t *img,
+        unsigned width, unsigned height)
+{
+    memset(rs, 0, sizeof *rs);
+    rs->img = img;
+    rs->rw = opt_rotate & 1 ? img->height : img->width;
+    rs->rh = opt_rotate & 1 ? img->width : img->height;
+    enum SCALE_T f = opt_scale == SCALE_NONE ? SCALE_NEAREST : opt_scale;
+    unsigned rh = opt_scale == SCALE_NONE ? height : rs->rh;
+    if (taps_build(rs->rw, width, f, &rs->xt, &rs->wx) ||
+            taps_build(rh, height, f, &rs->yt, &rs->wy) ||
+            !(rs->line = malloc(rs->rw + 1)) ||
+            !(rs->sums = malloc((rs->rw + 1) * sizeof *rs->sums))) {
+        fputs("malloc failed\n", stderr);
+        return 1;
+    }
+    return 0;
+}
+
+/* Gray rows to be dithered, got in order: in memory or resampled */
+struct gray_t {
+    const uint8_t *data;
+    unsigned stride;
+    struct resample_t *rs;
+};
+
+/*======================================================================
+  Dither gray rows (one byte a pixel) to the column pattern, centered
+  as transpose_rows() does. Thresholding and ordered dithering compare
+  the rows as they are; Floyd-Steinberg diffuses the error along each
+  row, which can't be done in parallel, into black or white rows that
+  are then packed the same way
+*/
+int dither_rows(uint8_t *out, const struct gray_t *gray, unsigned width,
+        unsigned height)
+{
+    static const uint8_t mid[16] = {
+        128, 128, 128, 128, 128, 128, 128, 128,
+        128, 128, 128, 128, 128, 128, 128, 128
+    };
+    uint8_t level[16];
+    uint8_t *band = NULL, *lines = NULL;
+    int16_t *err = NULL;
+    unsigned pad_h = (IMAGE_ROWS - height) / 2, b, k;
+
+    memset(level, opt_threshold, sizeof level);
+    if (opt_dither == DITHER_ORDERED && !bayer[0][0])
+        bayer_init();
+    if (opt_dither == DITHER_FS) {
+        band = malloc((size_t)width * 8 + 16);
+        err = calloc(2 * (width + 2), sizeof *err);
+        if (!band || !err) {
+            fputs("malloc failed\n", stderr);
+            free(band);
+            free(err);
+            return 1;
+        }
+    }
+    if (gray->rs && !(lines = malloc((size_t)width * 8 + 16))) {
+        fputs("malloc failed\n", stderr);
+        free(band);
+        free(err);
+        return 1;
+    }
+
+    for (b = pad_h / 8; b * 8 < pad_h + height; ++b) {
+        const uint8_t *rows[8], *thr[8];
+        for (k = 0; k < 8; ++k) {
+            int y = (int)(b * 8 + k) - (int)pad_h;
+            if (y < 0 || y >= (int)height) {
+                rows[k] = NULL;
+                continue;
+            }
+            const uint8_t *src = gray->rs ?
+                resample_row(gray->rs, y, lines + (size_t)k * width, width) :
+                gray->data + (size_t)y * gray->stride;
+            if (opt_dither == DITHER_FS) {
+                int16_t *cur = err + (y & 1) * (width + 2);
+                int16_t *next = err + (~y & 1) * (width + 2);
+                uint8_t *dst = band + (size_t)k * width;
+                unsigned x;
+                memset(next, 0, (width + 2) * sizeof *next);
+                for (x = 0; x < width; ++x) {
+                    int v = src[x] + cur[x + 1];
+                    int e = v < 128 ? v : v - 255;
+                    dst[x] = v < 128 ? 0 : 255;
+                    cur[x + 2] += e * 7 / 16;
+                    next[x] += e * 3 / 16;
+                    next[x + 1] += e * 5 / 16;
+                    next[x + 2] += e / 16;
+                }
+                rows[k] = dst;
+                thr[k] = mid;
+            } else {
+                rows[k] = src;
+                thr[k] = opt_dither == DITHER_ORDERED ? bayer[y % 8] : level;
+            }
+        }
+        pack_band(out + b, rows, thr, width);
+    }
+    free(band);
+    free(err);
+    free(lines);
+    return 0;
+}
+
+/*======================================================================
+  Decode an image held in memory to the current pattern. Turned or
+  scaled, it is resampled row by row as it is dithered; a PBM turned
+  half a turn, and no taller than the head, is transposed as it is
+  and turned in columns
+*/
+int load_image(const uint8_t *buf, size_t len)
+{
+    struct pnm_t h;
+    TRACE1(image__parse, len);
+    long size = pnm_parse(buf, len, &h);
+    if (size < 0) {
+        fputs("Input is not a PBM or PGM\n", stderr);
+        return 1;
+    }
+    if (size == 0 || (size_t)size > len) {
+        fputs("Image ended unexpectedly\n", stderr);
+        return 1;
+    }
+    TRACE2(image__parsed, h.width, h.height);
+
+    /* Other depths, and plain PBM, are brought to 8 bits first */
+    struct image_t img = {
+        buf + h.offset, h.format == '4' ? (h.width + 7)/8 : h.width,
+        h.width, h.height, h.format == '4'
+    };
+    uint8_t *gray = NULL;
+    if (h.format == '1' || (h.format == '5' && h.maxval != 255)) {
+        size_t i, n = (size_t)h.width * h.height, p = h.offset;
+        const uint8_t *raster = buf + h.offset;
+        gray = malloc(n + 1);
+        if (!gray) {
+            fputs("malloc failed\n", stderr);
+            return 1;
+        }
+        for (i = 0; i < n; ++i) {
+            if (h.format == '1') {
+                p = pnm_skip(buf, len, p);
+                gray[i] = buf[p++] == '1' ? 0 : 255;
+            } else {
+                unsigned v = h.maxval > 255 ?
+                    raster[2*i] << 8 | raster[2*i + 1] : raster[i];
+                gray[i] = (v * 255 + h.maxval / 2) / h.maxval;
+            }
+        }
+        img.data = gray;
+    }
+
+    unsigned out_w = opt_rotate & 1 ? h.height : h.width;
+    unsigned out_h = opt_rotate & 1 ? h.width : h.height;
+    if (opt_scale != SCALE_NONE && out_w && out_h) {
+        unsigned rows = image_fit_rows ? image_fit_rows : tape_rows(opt_tape);
+        out_w = ((unsigned long long)out_w * rows + out_h / 2) / out_h;
+        if (!out_w)
+            out_w = 1;
+        out_h = rows;
+    } else if (out_h > IMAGE_ROWS) {
+        fputs("WARNING: Image truncated\n", stderr);
+        out_h = IMAGE_ROWS;
+    }
+    image_w = out_w;
+    pattern_size = IMAGE_ROWS/8 * image_w;
+    pattern = calloc(1, pattern_size + 1);
+    if (!pattern) {
+        fputs("malloc failed\n", stderr);
+        free(gray);
+        return 1;
+    }
+
+    int rc = 0;
+    _Bool half_turn = opt_scale == SCALE_NONE && opt_rotate == 2 &&
+        img.bits && h.height <= IMAGE_ROWS;
+    TRACE2(image__convert, out_w, out_h);
+    if ((opt_scale != SCALE_NONE || opt_rotate) && !half_turn &&
+            out_w && out_h) {
+        struct resample_t rs;
+        struct gray_t g = { NULL, 0, &rs };
+        rc = resample_init(&rs, &img, out_w, out_h) ||
+            dither_rows(pattern, &g, out_w, out_h);
+        resample_free(&rs);
+    } else if (img.bits) {
+        transpose_rows(pattern, img.data, img.stride, out_w, out_h);
+        /* Centred again when the rows left over are odd */
+        if (half_turn) {
+            rop_mirror(pattern, out_w);
+            rop_flip(pattern, out_w);
+            rop_shift(pattern, out_w, -(int)((IMAGE_ROWS - out_h) & 1));
+        }
+    } else {
+        struct gray_t g = { img.data, img.stride, NULL };
+        rc = dither_rows(pattern, &g, out_w, out_h);
+    }
+    free(gray);
+    TRACE1(image__converted, rc);
+    if (rc) {
+        free(pattern);
+        pattern = NULL;
+        return 1;
+    }
+
+    if (dump_comm) {
+        unsigned i;
+        for (i = 0; i < image_w; ++i) {
+            fprintf(stderr, "%5d [", i);
+            int j;
+            for (j = 0; j < 16; ++j) {
+                fprintf(stderr, "%02X", pattern[i*IMAGE_ROWS/8+j]);
+            }
+            fputs("]\n", stderr);
+        }
+    }
+    return 0;
+}
+
+/*======================================================================
+  Load an image file, for the layouts
+*/
+int load_image_file(const char *path)
+{
+    FILE *f = fopen(path, "rb");
+    if (!f)
+        return 1;
+    size_t len = 0, size = 0;
+    uint8_t *buf = NULL;
+    for (;;) {
+        if (len == size) {
+            size = size ? size * 2 : 65536;
+            uint8_t *p = realloc(buf, size);
+            if (!p) {
+                free(buf);
+                fclose(f);
+                return 1;
+            }
+            buf = p;
+        }
+        size_t n = fread(buf + len, 1, size - len, f);
+        if (!n)
+            break;
+        len += n;
+    }
+    fclose(f);
+    int rc = load_image(buf, len);
+    free(buf);
+    return rc;
+}
+
+/*======================================================================
+  Build a path in the user cache directory
+*/
+int user_cache_path(char *path, size_t len, const char *leaf)
+{
+    const char *dir = getenv("XDG_CACHE_HOME");
+    int n;
+    if (dir && *dir) {
+        n = snprintf(path, len, "%s/%s", dir, leaf);
+    } else if ((dir = getenv("HOME")) && *dir) {
+        n = snprintf(path, len, "%s/.cache/%s", dir, leaf);
+    } else {
+        return 1;
+    }
+    return n < 0 || n >= len;
+}
+
+/*======================================================================
+  Raster cache: the pattern of an image, keyed by a hash of its PBM,
+  kept in memory (least recently used first out) in the long-running
+  mode and on disk across runs, so that reprints skip the decoding
+*/
+struct raster_key_t {
+    uint64_t h[2];
+    uint64_t size;
+};
+
+struct raster_t {
+    struct raster_t *next;
+    struct raster_key_t key;
+    unsigned width;
+    uint8_t *pattern;
+};
+
+struct raster_t *raster_lru;
+size_t raster_lru_bytes;
+_Bool raster_memory = false;
+size_t opt_raster_cache = 16 << 20;
+unsigned raster_hits, raster_misses;
+
+#define RASTER_DIR "klg2.raster"
+/* The bytes the patterns take, kept along so as not to list them on
+   every store */
+#define RASTER_TOTAL "total"
+
+/* On disk, followed by the pattern */
+struct raster_file_t {
+    char magic[8];
+    struct raster_key_t key;
+    uint32_t width;
+    uint32_t pad;
+};
+
+static const char raster_magic[8] = "KLG2RST1";
+
+static uint64_t raster_mix(uint64_t h)
+{
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+/*======================================================================
+  Hash a PBM, a word at a time, two ways
+*/
+void raster_key(struct raster_key_t *key, const uint8_t *buf, size_t size)
+{
+    uint64_t a = 0xcbf29ce484222325ULL, b = 0x9e3779b97f4a7c15ULL, w;
+    size_t i;
+    for (i = 0; i + 8 <= size; i += 8) {
+        memcpy(&w, buf + i, 8);
+        a = (a ^ w) * 0x100000001b3ULL;
+        b = (b ^ w) * 0xc6a4a7935bd1e995ULL;
+        b ^= b >> 47;
+    }
+    w = 0;
+    memcpy(&w, buf + i, size - i);
+    key->h[0] = raster_mix(a ^ w ^ size);
+    key->h[1] = raster_mix(b ^ (w * 0xc6a4a7935bd1e995ULL) ^ size);
+    key->size = size;
+}
+
+static _Bool raster_key_equal(const struct raster_key_t *a,
+        const struct raster_key_t *b)
+{
+    return a->h[0] == b->h[0] && a->h[1] == b->h[1] && a->size == b->size;
+}
+
+/*======================================================================
+  Find a pattern in memory, making it the most recently used
+*/
+struct raster_t *raster_memory_find(const struct raster_key_t *key)
+{
+    struct raster_t **pp, *r;
+    for (pp = &raster_lru; (r = *pp); pp = &r->next) {
+        if (raster_key_equal(&r->key, key)) {
+            *pp = r->next;
+            r->next = raster_lru;
+            raster_lru = r;
+            return r;
+        }
+    }
+    return NULL;
+}
+
+/*======================================================================
+  Keep a copy of the current pattern in memory, dropping the least
+  recently used ones over the limit
+*/
+void raster_memory_add(const struct raster_key_t *key)
+{
+    if (pattern_size > opt_raster_cache)
+        return;
+    struct raster_t *r = calloc(1, sizeof *r);
+    if (!r || !(r->pattern = malloc(pattern_size + 1))) {
+        free(r);
+        return;
+    }
+    r->key = *key;
+    r->width = image_w;
+    memcpy(r->pattern, pattern, pattern_size);
+    r->next = raster_lru;
+    raster_lru = r;
+    raster_lru_bytes += pattern_size;
+
+    while (raster_lru_bytes > opt_raster_cache) {
+        struct raster_t **pp = &raster_lru;
+        while ((*pp)->next)
+            pp = &(*pp)->next;
+        raster_lru_bytes -= (*pp)->width * (IMAGE_ROWS/8);
+        free((*pp)->pattern);
+        free(*pp);
+        *pp = NULL;
+    }
+}
+
+/*======================================================================
+  Path of a pattern in the disk cache
+*/
+static int raster_disk_path(char *path, size_t len,
+        const struct raster_key_t *key)
+{
+    char leaf[80];
+    snprintf(leaf, sizeof leaf, RASTER_DIR "/%016llx%016llx",
+            (unsigned long long)key->h[0], (unsigned long long)key->h[1]);
+    return user_cache_path(path, len, leaf);
+}
+
+/*======================================================================
+  Load a pattern from the disk cache into the current one
+*/
+int raster_disk_load(const struct raster_key_t *key)
+{
+    char path[PATH_MAX];
+    if (raster_disk_path(path, sizeof path, key))
+        return 1;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return 1;
+
+    struct raster_file_t hdr;
+    int rc = 1;
+    if (read(fd, &hdr, sizeof hdr) == sizeof hdr &&
+            memcmp(hdr.magic, raster_magic, sizeof hdr.magic) == 0 &&
+            raster_key_equal(&hdr.key, key)) {
+        size_t size = (size_t)hdr.width * (IMAGE_ROWS/8);
+        uint8_t *p = malloc(size + 1);
+        if (p && read(fd, p, size) == size) {
+            pattern = p;
+            pattern_size = size;
+            image_w = hdr.width;
+            rc = 0;
+            /* The modification time orders the eviction */
+            futimens(fd, NULL);
+        } else {
+            free(p);
+        }
+    }
+    close(fd);
+    return rc;
+}
+
+struct raster_age_t {
+    time_t mtime;
+    char name[40];
+};
+
+static int raster_file_older(const void *a, const void *b)
+{
+    const struct raster_age_t *x = a, *y = b;
+    return x->mtime < y->mtime ? -1 : x->mtime > y->mtime;
+}
+
+/*======================================================================
+  The bytes of the disk cache as last recorded, 1 if unknown
+*/
+static int raster_disk_total(int dir, size_t *total)
+{
+    char buf[32];
+    int fd = openat(dir, RASTER_TOTAL, O_RDONLY);
+    if (fd < 0)
+        return 1;
+    ssize_t n = read(fd, buf, sizeof buf - 1);
+    close(fd);
+    if (n <= 0)
+        return 1;
+    buf[n] = '\0';
+    char *end;
+    unsigned long long v = strtoull(buf, &end, 10);
+    if (end == buf || *end != '\n')
+        return 1;
+    *total = v;
+    return 0;
+}
+
+/*======================================================================
+  Record the bytes of the disk cache
+*/
+static void raster_disk_set_total(int dir, size_t total)
+{
+    char buf[32];
+    int n = snprintf(buf, sizeof buf, "%zu\n", total);
+    int fd = openat(dir, RASTER_TOTAL, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0)
+        return;
+    if (write(fd, buf, n) != n) {
+        /* Unreadable: the next store lists the directory again */
+    }
+    close(fd);
+}
+
+/*======================================================================
+  Keep the disk cache under the limit, removing the least recently
+  used patterns, and record what it then takes
+*/
+void raster_disk_prune(const char *dir)
+{
+    struct raster_age_t *files = NULL;
+    size_t count = 0, alloc = 0, total = 0;
+
+    DIR *d = opendir(dir);
+    if (!d)
+        return;
+    struct dirent *de;
+    while ((de = readdir(d))) {
+        struct stat st;
+        if (strlen(de->d_name) != 32 ||
+                fstatat(dirfd(d), de->d_name, &st, 0) ||
+                !S_ISREG(st.st_mode))
+            continue;
+        if (count == alloc) {
+            alloc = alloc ? alloc * 2 : 64;
+            void *p = realloc(files, alloc * sizeof *files);
+            if (!p)
+                break;
+            files = p;
+        }
+        files[count].mtime = st.st_mtime;
+        strcpy(files[count++].name, de->d_name);
+        total += st.st_size;
+    }
+
+    if (total > opt_raster_cache) {
+        qsort(files, count, sizeof *files, raster_file_older);
+        size_t i;
+        for (i = 0; i < count && total > opt_raster_cache; ++i) {
+            struct stat st;
+            if (!fstatat(dirfd(d), files[i].name, &st, 0) &&
+                    !unlinkat(dirfd(d), files[i].name, 0))
+                total -= st.st_size;
+        }
+    }
+    raster_disk_set_total(dirfd(d), total);
+    closedir(d);
+    free(files);
+}
+
+/*======================================================================
+  Store the current pattern in the disk cache, atomically. The
+  directory is only listed when the recorded total crosses the limit
+  (or is missing): other runs storing at the same time can make it
+  wrong, and that listing sets it right
+*/
+void raster_disk_store(const struct raster_key_t *key)
+{
+    char dir[PATH_MAX], path[PATH_MAX], tmp[PATH_MAX + 16];
+    if (pattern_size > opt_raster_cache ||
+            user_cache_path(dir, sizeof dir, RASTER_DIR) ||
+            raster_disk_path(path, sizeof path, key))
+        return;
+    mkdir(dir, 0700);
+    snprintf(tmp, sizeof tmp, "%s.%ld", path, (long)getpid());
+
+    struct raster_file_t hdr = { .key = *key, .width = image_w };
+    memcpy(hdr.magic, raster_magic, sizeof hdr.magic);
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0)
+        return;
+    int rc = write(fd, &hdr, sizeof hdr) != sizeof hdr ||
+        write(fd, pattern, pattern_size) != pattern_size;
+    if (close(fd) || rc || rename(tmp, path)) {
+        unlink(tmp);
+        return;
+    }
+    size_t total;
+    int dfd = open(dir, O_RDONLY | O_DIRECTORY);
+    if (dfd >= 0 && !raster_disk_total(dfd, &total) &&
+            total + sizeof hdr + pattern_size <= opt_raster_cache)
+        raster_disk_set_total(dfd, total + sizeof hdr + pattern_size);
+    else
+        raster_disk_prune(dir);
+    if (dfd >= 0)
+        close(dfd);
+}
+
+/*======================================================================
+  Decode an image held in memory to the current pattern, through the
+  raster cache
+*/
+static int load_image_cached(const uint8_t *buf, size_t size)
+{
+    struct raster_key_t key;
+    if (opt_raster_cache) {
+        raster_key(&key, buf, size);
+        /* The pattern depends on how the image is turned, scaled and
+           dithered too */
+        if (opt_scale != SCALE_NONE || opt_rotate ||
+                (size > 1 && buf[1] != '4')) {
+            unsigned rows = image_fit_rows ? image_fit_rows :
+                tape_rows(opt_tape);
+            key.h[1] ^= raster_mix((uint64_t)opt_dither << 48 |
+                    (uint64_t)opt_threshold << 32 | opt_scale << 24 |
+                    opt_rotate << 16 | rows);
+        }
+        struct raster_t *r = raster_memory ? raster_memory_find(&key) : NULL;
+        if (r) {
+            pattern_size = r->width * (IMAGE_ROWS/8);
+            pattern = malloc(pattern_size + 1);
+            if (pattern) {
+                memcpy(pattern, r->pattern, pattern_size);
+                image_w = r->width;
+                ++raster_hits;
+                return 0;
+            }
+        }
+        if (!raster_disk_load(&key)) {
+            if (raster_memory)
+                raster_memory_add(&key);
+            ++raster_hits;
+            return 0;
+        }
+        ++raster_misses;
+    }
+
+    int rc = load_image(buf, size);
+    if (!rc && opt_raster_cache) {
+        if (raster_memory)
+            raster_memory_add(&key);
+        raster_disk_store(&key);
+    }
+    return rc;
+}
+
+/*======================================================================
+  Same, trimmed as asked for
+*/
+int load_image_mem(const uint8_t *buf, size_t size)
+{
+    int rc = load_image_cached(buf, size);
+    if (!rc && opt_trim)
+        pattern_trim();
+    return rc;
+}
+
+/*======================================================================
+  Clients of the long-running mode
+  Each has its own job queue and quotas on the jobs and bytes it can
+  have queued (images still being read included); clients are served
+  in proportion to their weight, and their jobs can't ask for more
+  than their highest priority
+*/
+struct client_t {
+    struct client_t *next;
+    char name[64];
+    unsigned weight;
+    int top_priority;
+    unsigned refs;              /* Sources and jobs */
+    double vtime;               /* Bytes printed / weight */
+    struct job_t *queue;
+    unsigned jobs;
+    size_t bytes;
+};
+
+struct client_t *clients;
+unsigned opt_quota_jobs = 64;
+size_t opt_quota_bytes = 32 << 20;
+int opt_quota_priority = INT_MAX;
+
+/*======================================================================
+  Input sources for the long-running mode
+  Data is read without blocking and an image is decoded only once it
+  is completely buffered, so a slow writer doesn't stall the printer
+*/
+struct source_t {
+    struct source_t *next;
+    int fd;
+    const char *name;
+    struct client_t *client;
+    uint8_t *buf;
+    size_t len;
+    size_t size;
+    size_t discard;             /* Still to be skipped of a refused image */
+    _Bool eof;
+};
+
+struct source_t *sources;
+
+/*======================================================================
+  Shared memory input for producers on the same host: a client of the
+  submission socket passes a memory file holding its images, laid out
+  as it likes (a ring, typically), then a descriptor for each image.
+  Images already in columns are printed straight from the shared
+  memory; packed rows are transposed from it. The descriptor id is sent
+  back when its memory can be reused
+*/
+enum SHMFORMAT_T {
+    SHM_ROWS = 0,               /* PBM raster, (width+7)/8 bytes a row */
+    SHM_COLUMNS = 1             /* 16 bytes a column, as printed */
+};
+
+struct shm_desc_t {
+    uint32_t id;
+    uint32_t format;
+    uint64_t offset;
+    uint32_t width;
+    uint32_t height;
+    /* Job options (key=value ...) can follow */
+};
+
+struct shm_reply_t {
+    uint32_t id;
+    int32_t status;             /* 0 released, -1 refused */
+};
+
+struct shm_map_t {
+    unsigned refs;
+    uint8_t *base;
+    size_t size;
+};
+
+struct shm_conn_t {
+    struct shm_conn_t *next;
+    int fd;                     /* -1 once the client has gone */
+    unsigned refs;
+    struct client_t *client;
+    struct shm_map_t *map;
+};
+
+struct shm_conn_t *shm_conns;
+
+/* Print job */
+struct job_t {
+    struct job_t *next;
+    struct client_t *client;
+    unsigned id;
+    unsigned attempts;
+    struct settings_t set;
+    int priority;
+    double arrived;
+    double started;
+    double deadline;            /* Absolute, 0 if none */
+    uint8_t *pattern;
+    unsigned pattern_size;
+    struct rle_t *rle;          /* Compact pattern, instead */
+    unsigned offset;            /* Already printed, when preempted */
+    struct shm_conn_t *shm;     /* Pattern in shared memory, if set */
+    struct shm_map_t *map;
+    uint32_t shm_id;
+};
+
+/*======================================================================
+  Find or create a client
+*/
+struct client_t *client_get(const char *name, unsigned weight,
+        int top_priority)
+{
+    struct client_t *c;
+    for (c = clients; c; c = c->next) {
+        if (strcmp(c->name, name) == 0)
+            return c;
+    }
+    c = calloc(1, sizeof *c);
+    if (!c) {
+        fputs("malloc failed\n", stderr);
+        return NULL;
+    }
+    snprintf(c->name, sizeof c->name, "%s", name);
+    c->weight = weight ? weight : 1;
+    c->top_priority = top_priority;
+    c->next = clients;
+    clients = c;
+    return c;
+}
+
+/*======================================================================
+  Drop a reference to a client, freeing it when unused
+*/
+void client_put(struct client_t *c)
+{
+    if (--c->refs)
+        return;
+    struct client_t **pp = &clients;
+    while (*pp != c)
+        pp = &(*pp)->next;
+    *pp = c->next;
+    free(c);
+}
+
+/*======================================================================
+  Is the client over its quota?
+*/
+_Bool client_full(const struct client_t *c)
+{
+    return c->jobs >= opt_quota_jobs || c->bytes >= opt_quota_bytes;
+}
+
+/*======================================================================
+  Add an input source for a client
+*/
+struct source_t *source_add(int fd, struct client_t *c)
+{
+    struct source_t *src = calloc(1, sizeof *src);
+    if (!src) {
+        fputs("malloc failed\n", stderr);
+        return NULL;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    src->fd = fd;
+    src->name = c->name;
+    src->client = c;
+    ++c->refs;
+    src->next = sources;
+    sources = src;
+    return src;
+}
+
+/*======================================================================
+  Remove an input source
+*/
+void source_remove(struct source_t *src)
+{
+    struct source_t **pp = &sources;
+    while (*pp != src)
+        pp = &(*pp)->next;
+    *pp = src->next;
+    src->client->bytes -= src->len;
+    client_put(src->client);
+    if (src->fd != STDIN_FILENO)
+        close(src->fd);
+    free(src->buf);
+    free(src);
+}
+
+/*======================================================================
+  Does the source want to be read? Over quota only if the client has
+  nothing queued, to complete the images partially read
+*/
+_Bool source_wants_input(const struct source_t *src)
+{
+    return !src->eof && (src->discard || !client_full(src->client) ||
+            !src->client->jobs);
+}
+
+/*======================================================================
+  Size of the first image in the buffer, complete or not, as soon as the
+  header is: 0 if still incomplete, -1 if not a PBM or PGM
+*/
+long pnm_frame_size(const uint8_t *buf, size_t len)
+{
+    struct pnm_t h;
+    return pnm_parse(buf, len, &h);
+}
+
+/*======================================================================
+  Read the image on the standard input, through the raster cache
+*/
+int load_image_stdin(void)
+{
+    size_t len = 0, size = 0;
+    uint8_t *buf = NULL;
+    for (;;) {
+        if (len == size) {
+            size = size ? size * 2 : 65536;
+            uint8_t *p = realloc(buf, size);
+            if (!p) {
+                fputs("malloc failed\n", stderr);
+                free(buf);
+                return 1;
+            }
+            buf = p;
+        }
+        ssize_t n = read(STDIN_FILENO, buf + len, size - len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        len += n;
+        /* Only the first image counts, the writer may keep going */
+        long frame = pnm_frame_size(buf, len);
+        if (frame < 0)
+            break;
+        if (frame > 0 && frame <= len) {
+            len = frame;
+            break;
+        }
+    }
+    int rc = load_image_mem(buf, len);
+    free(buf);
+    return rc;
+}
+
+/*======================================================================
+  Out-of-core banners: a long raw PBM on a seekable standard input is
+  read, transposed and sent one printer page of columns at a time, so
+  that memory stays the same whatever its length and printing starts
+  after the first tile
+*/
+#define TILE_COLS (8192 / (IMAGE_ROWS/8))
+
+struct tiles_t {
+    int fd;
+    off_t raster;               /* File offset of the first row */
+    size_t stride;
+    unsigned width;
+    unsigned rows;
+    unsigned x;                 /* Next column */
+    uint8_t band[IMAGE_ROWS][TILE_COLS/8];
+    uint8_t tile[TILE_COLS * (IMAGE_ROWS/8)];
+};
+
+struct tiles_t banner_tiles;
+
+/*======================================================================
+  Read exactly len bytes at a file offset
+*/
+static int pread_full(int fd, uint8_t *buf, size_t len, off_t offset)
+{
+    while (len) {
+        ssize_t n = pread(fd, buf, len, offset);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return 1;
+        buf += n;
+        len -= n;
+        offset += n;
+    }
+    return 0;
+}
+
+/*======================================================================
+  Whether the image on fd can be sent in tiles: a raw PBM, in a regular
+  file, wider than a tile and not to be turned, scaled or trimmed
+*/
+_Bool tiles_open(struct tiles_t *t, int fd)
+{
+    struct stat st;
+    if (opt_scale != SCALE_NONE || opt_rotate || opt_trim ||
+            fstat(fd, &st) || !S_ISREG(st.st_mode))
+        return false;
+    off_t start = lseek(fd, 0, SEEK_CUR);
+    if (start < 0)
+        return false;
+
+    uint8_t head[4096];
+    ssize_t n = pread(fd, head, sizeof head, start);
+    struct pnm_t h;
+    long size = n > 0 ? pnm_parse(head, n, &h) : -1;
+    if (size <= 0 || h.format != '4' || h.width <= TILE_COLS ||
+            start + size > st.st_size)
+        return false;
+
+    t->fd = fd;
+    t->raster = start + h.offset;
+    t->stride = (h.width + 7) / 8;
+    t->width = h.width;
+    t->rows = h.height;
+    if (t->rows > IMAGE_ROWS) {
+        fputs("WARNING: Image truncated\n", stderr);
+        t->rows = IMAGE_ROWS;
+    }
+    t->x = 0;
+    return true;
+}
+
+/*======================================================================
+  Raster reader refill: the next tile, transposed
+*/
+static int tiles_refill(struct raster_reader_t *rd)
+{
+    struct tiles_t *t = rd->arg;
+    unsigned cols = t->width - t->x;
+    if (cols > TILE_COLS)
+        cols = TILE_COLS;
+    unsigned y;
+    for (y = 0; y < t->rows; ++y) {
+        if (pread_full(t->fd, t->band[y], (cols + 7) / 8,
+                    t->raster + y * t->stride + t->x / 8)) {
+            fputs("Image read failed\n", stderr);
+            return 1;
+        }
+    }
+    memset(t->tile, 0, sizeof t->tile);
+    transpose_rows(t->tile, t->band[0], sizeof t->band[0], cols, t->rows);
+    t->x += cols;
+    rd->raw = t->tile;
+    rd->left = cols * (IMAGE_ROWS/8);
+    return 0;
+}
+
+/*======================================================================
+  Send the banner, reading each tile as the previous one is printed
+*/
+int printer_send_tiles(struct tiles_t *t)
+{
+    struct raster_reader_t rd;
+    memset(&rd, 0, sizeof rd);
+    rd.refill = tiles_refill;
+    rd.arg = t;
+    t->x = 0;
+    return printer_send_reader(&rd, t->width * (IMAGE_ROWS/8), true);
+}
+
+/*======================================================================
+  Compact a raw PBM held in memory a tile at a time as it is transposed,
+  so that its whole pattern is never expanded: for the banners queued in
+  the long-running mode. NULL if it is no such image (not wider than a
+  tile, or to be turned, scaled or trimmed) or out of memory
+*/
+struct rle_t *rle_encode_pbm(const uint8_t *buf, size_t len)
+{
+    struct pnm_t h;
+    long size = pnm_parse(buf, len, &h);
+    if (opt_scale != SCALE_NONE || opt_rotate || opt_trim || size <= 0 ||
+            (size_t)size > len || h.format != '4' || h.width <= TILE_COLS)
+        return NULL;
+    unsigned rows = h.height, x, cols;
+    if (rows > IMAGE_ROWS) {
+        fputs("WARNING: Image truncated\n", stderr);
+        rows = IMAGE_ROWS;
+    }
+
+    size_t stride = (h.width + 7) / 8;
+    struct rle_t *r = calloc(1, sizeof *r);
+    uint8_t *tile = malloc(TILE_COLS * (IMAGE_ROWS/8));
+    for (x = 0; r && tile && x < h.width; x += cols) {
+        cols = h.width - x < TILE_COLS ? h.width - x : TILE_COLS;
+        memset(tile, 0, TILE_COLS * (IMAGE_ROWS/8));
+        transpose_rows(tile, buf + h.offset + x / 8, stride, cols, rows);
+        if (rle_append(r, tile, cols))
+            break;
+    }
+    if (r && (!tile || x < h.width)) {
+        rle_free(r);
+        r = NULL;
+    }
+    free(tile);
+    if (r)
+        rle_finish(r);
+    return r;
+}
+
+/*======================================================================
+  Drop bytes from the start of the source buffer
+*/
+static void source_consume(struct source_t *src, size_t n)
+{
+    memmove(src->buf, src->buf + n, src->len - n);
+    src->len -= n;
+    src->client->bytes -= n;
+}
+
+/*======================================================================
+  Read what is available on a source
+*/
+int source_read(struct source_t *src)
+{
+    if (src->size - src->len < 65536) {
+        uint8_t *buf = realloc(src->buf, src->size + 65536);
+        if (!buf) {
+            fputs("malloc failed\n", stderr);
+            return 1;
+        }
+        src->buf = buf;
+        src->size += 65536;
+    }
+    ssize_t rc = read(src->fd, src->buf + src->len, src->size - src->len);
+    if (rc > 0) {
+        src->len += rc;
+        src->client->bytes += rc;
+    } else if (rc == 0) {
+        src->eof = true;
+    } else if (errno != EAGAIN && errno != EINTR) {
+        perror(src->name);
+        src->eof = true;
+    }
+    if (src->discard) {
+        size_t n = src->len < src->discard ? src->len : src->discard;
+        source_consume(src, n);
+        src->discard -= n;
+    }
+    return 0;
+}
+
+/*======================================================================
+  Release shared memory mappings and clients
+*/
+void shm_map_put(struct shm_map_t *map)
+{
+    if (map && !--map->refs) {
+        munmap(map->base, map->size);
+        free(map);
+    }
+}
+
+void shm_conn_put(struct shm_conn_t *conn)
+{
+    if (!--conn->refs) {
+        shm_map_put(conn->map);
+        client_put(conn->client);
+        free(conn);
+    }
+}
+
+/*======================================================================
+  Hand a descriptor back to its client, if still there
+*/
+void shm_reply(struct shm_conn_t *conn, uint32_t id, int32_t status)
+{
+    struct shm_reply_t r = { .id = id, .status = status };
+    if (conn->fd >= 0 &&
+            send(conn->fd, &r, sizeof r, MSG_DONTWAIT | MSG_NOSIGNAL) < 0)
+        perror("Shared memory");
+}
+
+/*======================================================================
+  Release a job
+*/
+void job_free(struct job_t *job)
+{
+    client_put(job->client);
+    if (job->shm) {
+        shm_reply(job->shm, job->shm_id, 0);
+        shm_map_put(job->map);
+        shm_conn_put(job->shm);
+    } else {
+        free(job->pattern);
+        rle_free(job->rle);
+    }
+    free(job);
+}
+
+/*======================================================================
+  Memory a queued job holds
+*/
+size_t job_bytes(const struct job_t *job)
+{
+    return job->rle ? rle_bytes(job->rle) : job->pattern_size;
+}
+
+/*======================================================================
+  New job of a client, with the default settings
+*/
+struct job_t *job_new(struct client_t *c)
+{
+    static unsigned last_id;
+
+    struct job_t *job = calloc(1, sizeof *job);
+    if (!job) {
+        fputs("malloc failed\n", stderr);
+        return NULL;
+    }
+    job->id = ++last_id;
+    job->client = c;
+    ++c->refs;
+    job->arrived = now_ms();
+    settings_default(&job->set);
+    return job;
+}
+
+/*======================================================================
+  Apply a job option (key=value)
+*/
+static int job_option(struct job_t *job, char *opt)
+{
+    char *val = strchr(opt, '=');
+    if (!val)
+        return 1;
+    *val++ = '\0';
+    int v = atoi(val);
+    if (strcmp(opt, "tape") == 0)
+        return tape_code(v, &job->set.tape);
+    if (strcmp(opt, "margin") == 0)
+        return margin_code(v, &job->set.margin);
+    if (strcmp(opt, "density") == 0)
+        return density_code(v, &job->set.density);
+    if (strcmp(opt, "cut") == 0)
+        return cutter_code(v, &job->set.cutter);
+    if (strcmp(opt, "priority") == 0) {
+        job->priority = v < job->client->top_priority ? v :
+            job->client->top_priority;
+        return 0;
+    }
+    if (strcmp(opt, "deadline") == 0) {
+        double d = atof(val);
+        if (d <= 0)
+            return 1;
+        job->deadline = job->arrived + d * 1000;
+        return 0;
+    }
+    return 1;
+}
+
+/*======================================================================
+  Job options from the comments ahead of the image size, in lines like
+  # klg2 tape=18 margin=2
+*/
+void job_parse_options(struct job_t *job, const uint8_t *buf, size_t size)
+{
+    size_t p = 2;
+    for (;;) {
+        while (p < size && isspace(buf[p]))
+            ++p;
+        if (p >= size || buf[p] != '#')
+            break;
+        size_t end = p;
+        while (end < size && buf[end] != '\n')
+            ++end;
+
+        char line[256];
+        size_t n = end - p - 1;
+        if (n >= sizeof line)
+            n = sizeof line - 1;
+        memcpy(line, buf + p + 1, n);
+        line[n] = '\0';
+
+        char *tok = strtok(line, " \t\r");
+        if (tok && strcmp(tok, "klg2") == 0) {
+            while ((tok = strtok(NULL, " \t\r"))) {
+                char opt[64];
+                snprintf(opt, sizeof opt, "%s", tok);
+                if (job_option(job, opt))
+                    fprintf(stderr, "Job %u: invalid option %s\n",
+                            job->id, tok);
+            }
+        }
+        p = end + 1;
+    }
+}
+
+/*======================================================================
+  Decode the next complete image of a source into a job
+  Returns NULL if there is none (yet); a malformed stream can't be
+  resynchronized so the source is dropped
+*/
+struct job_t *source_next_job(struct source_t *src)
+{
+    /* Whitespace between images is tolerated */
+    size_t skip = 0;
+    while (skip < src->len && isspace(src->buf[skip]))
+        ++skip;
+    if (skip)
+        source_consume(src, skip);
+
+    long size = pnm_frame_size(src->buf, src->len);
+    if (size < 0) {
+        fprintf(stderr, "%s: Input is not a PBM or PGM\n", src->name);
+        source_consume(src, src->len);
+        src->eof = true;
+        return NULL;
+    }
+    if (size > opt_quota_bytes) {
+        /* It would never fit, skip it as it arrives */
+        fprintf(stderr, "%s: image exceeds the quota, discarded\n",
+                src->name);
+        if (size <= src->len) {
+            source_consume(src, size);
+        } else {
+            src->discard = size - src->len;
+            source_consume(src, src->len);
+        }
+        return NULL;
+    }
+    if (size == 0 || size > src->len) {
+        if (src->eof && src->len) {
+            fprintf(stderr, "%s: Image ended unexpectedly\n", src->name);
+            source_consume(src, src->len);
+        }
+        return NULL;
+    }
+
+    /* Options first, an image is scaled to the tape of its job */
+    struct job_t *job = job_new(src->client);
+    if (job) {
+        job_parse_options(job, src->buf, size);
+        image_fit_rows = tape_rows(job->set.tape);
+        struct rle_t *r = rle_encode_pbm(src->buf, size);
+        if (r) {
+            job->rle = r;
+            job->pattern_size = r->width * (IMAGE_ROWS/8);
+        } else if (!load_image_mem(src->buf, size)) {
+            /* Kept compact while queued if that saves memory; decoded
+               whole first, though */
+            r = rle_encode(pattern, image_w);
+            job->pattern_size = pattern_size;
+            if (r && rle_bytes(r) < pattern_size) {
+                job->rle = r;
+                free(pattern);
+            } else {
+                rle_free(r);
+                job->pattern = pattern;
+            }
+            pattern = NULL;
+        } else {
+            job_free(job);
+            job = NULL;
+        }
+        image_fit_rows = 0;
+    }
+    if (!job) {
+        free(pattern);
+        pattern = NULL;
+        fprintf(stderr, "%s: image discarded\n", src->name);
+    }
+    source_consume(src, size);
+    return job;
+}
+
+/*======================================================================
+  Job queues: within a client jobs are ordered by priority, then by
+  earliest deadline (jobs without one come last), then by arrival.
+  Across clients the first jobs are compared the same way, so that the
+  job taken is the one that would preempt the others; among those that
+  are equal the client that got the least service for its weight goes
+  first (start-time fair queuing, on the bytes printed)
+*/
+unsigned job_queued;
+double sched_vtime;
+
+/*======================================================================
+  Is a more urgent than b? Arrival doesn't count
+*/
+_Bool job_outranks(const struct job_t *a, const struct job_t *b)
+{
+    if (a->priority != b->priority)
+        return a->priority > b->priority;
+    return a->deadline && (!b->deadline || a->deadline < b->deadline);
+}
+
+/*======================================================================
+  Queue a job
+*/
+void queue_push(struct job_t *job)
+{
+    struct client_t *c = job->client;
+
+    /* No credit for the time spent idle */
+    if (!c->queue && c->vtime < sched_vtime)
+        c->vtime = sched_vtime;
+
+    struct job_t **pp = &c->queue;
+    while (*pp && (!job_outranks(job, *pp) &&
+                (job_outranks(*pp, job) || (*pp)->id < job->id)))
+        pp = &(*pp)->next;
+    job->next = *pp;
+    *pp = job;
+    ++c->jobs;
+    c->bytes += job_bytes(job);
+    ++job_queued;
+}
+
+/*======================================================================
+  Queue again a job taken but not completely printed, giving back the
+  service charged for the unprinted part
+*/
+void queue_return(struct job_t *job)
+{
+    struct client_t *c = job->client;
+    c->vtime -= (double)(job->pattern_size - job->offset) / c->weight;
+    queue_push(job);
+}
+
+/*======================================================================
+  The job that would be taken next
+*/
+struct job_t *queue_peek(void)
+{
+    struct client_t *c, *best = NULL;
+    for (c = clients; c; c = c->next) {
+        const struct job_t *j = c->queue;
+        if (!j)
+            continue;
+        if (best) {
+            const struct job_t *b = best->queue;
+            if (job_outranks(b, j))
+                continue;
+            if (!job_outranks(j, b) && (c->vtime > best->vtime ||
+                        (c->vtime == best->vtime && j->id > b->id)))
+                continue;
+        }
+        best = c;
+    }
+    return best ? best->queue : NULL;
+}
+
+/*======================================================================
+  Take the next job, charging its client for it
+*/
+struct job_t *queue_pop(void)
+{
+    struct job_t *job = queue_peek();
+    if (job) {
+        struct client_t *c = job->client;
+        c->queue = job->next;
+        job->next = NULL;
+        --c->jobs;
+        c->bytes -= job_bytes(job);
+        --job_queued;
+        sched_vtime = c->vtime;
+        c->vtime += (double)(job->pattern_size - job->offset) / c->weight;
+    }
+    return job;
+}
+
+/*======================================================================
+  Pre-framed raster: the same sequence printer_send_raster() sends,
+  with the blocks already cut and formatted
+*/
+enum FRAMETYPE_T {
+    FRAME_BLOCK,
+    FRAME_RASTER_END,
+    FRAME_PRINT_PAGE
+};
+
+struct frame_t {
+    enum FRAMETYPE_T type;
+    uint8_t len;
+    uint8_t data[64];
+};
+
+/*======================================================================
+  Number of frames of a raster: the blocks, which never cross a page
+  boundary, plus a print page for each page and a raster end
+*/
+unsigned frames_count(unsigned rawsize)
+{
+    unsigned pages = rawsize / xfer.page, tail = rawsize % xfer.page;
+    unsigned per_page = (xfer.page + xfer.block - 1) / xfer.block;
+    if (!rawsize)
+        return 0;
+    return pages * (per_page + 1) +
+        (tail ? (tail + xfer.block - 1) / xfer.block + 1 : 0) + 1;
+}
+
+/*======================================================================
+  Cut the raster in frames
+*/
+int frames_build(const uint8_t *raw, unsigned rawsize,
+        struct frame_t **framesp, unsigned *countp)
+{
+    unsigned count = frames_count(rawsize);
+    struct frame_t *frames = calloc(count + 1, sizeof *frames);
+    if (!frames) {
+        fputs("malloc failed\n", stderr);
+        return 1;
+    }
+
+    unsigned sent_size = 0, page_size = 0, n = 0;
+    while (sent_size < rawsize) {
+        unsigned block_size = rawsize - sent_size;
+        if (block_size > xfer.block)
+            block_size = xfer.block;
+        if (block_size > xfer.page - page_size)
+            block_size = xfer.page - page_size;
+
+        struct frame_t *f = &frames[n++];
+        f->type = FRAME_BLOCK;
+        f->len = block_size + 4;
+        f->data[0] = PRINTER_STX;
+        f->data[1] = 0xFE;
+        f->data[2] = block_size;
+        memcpy(f->data + 4, raw + sent_size, block_size);
+        sent_size += block_size;
+        page_size += block_size;
+
+        if (sent_size == rawsize)
+            frames[n++].type = FRAME_RASTER_END;
+        if (page_size == xfer.page || sent_size == rawsize) {
+            frames[n++].type = FRAME_PRINT_PAGE;
+            page_size = 0;
+        }
+    }
+    assert(n <= count);
+    *framesp = frames;
+    *countp = n;
+    return 0;
+}
+
+/*======================================================================
+  Send pre-built frames; first is set to the time the first one was
+  handed to the printer
+*/
+int frames_send(const struct frame_t *frames, unsigned count, double *first)
+{
+    unsigned i;
+    for (i = 0; i < count; ++i) {
+        const struct frame_t *f = &frames[i];
+        int rc;
+        switch (f->type) {
+        case FRAME_BLOCK:
+            if (send_to_printer(f->data, f->len, EPSIZE_64) < 0)
+                return 1;
+            if (i == 0)
+                *first = now_ms();
+            rc = printer_recv_ack("Raster block failed\n");
+            break;
+        case FRAME_RASTER_END:
+            rc = printer_raster_end();
+            break;
+        default:
+            rc = printer_print_page();
+            break;
+        }
+        if (rc)
+            return 1;
+    }
+    return 0;
+}
+
+/*======================================================================
+  Read the cached bus/port path of the last printer seen
+*/
+int device_cache_load(char *spec, size_t len)
+{
+    char path[PATH_MAX];
+    if (user_cache_path(path, sizeof path, "klg2.device"))
+        return 1;
+    FILE *f = fopen(path, "r");
+    if (!f)
+        return 1;
+    int rc = fgets(spec, len, f) == NULL;
+    fclose(f);
+    if (!rc)
+        spec[strcspn(spec, "\n")] = '\0';
+    return rc || !*spec;
+}
+
+/*======================================================================
+  Format the bus/port path of a device (like 1-2.3, as in sysfs)
+*/
+int device_port_path(libusb_device *dev, char *spec, size_t len)
+{
+    uint8_t ports[8];
+    int nports = libusb_get_port_numbers(dev, ports, sizeof ports);
+    if (nports <= 0)
+        return 1;
+
+    int n = snprintf(spec, len, "%u-%u",
+            libusb_get_bus_number(dev), ports[0]);
+    int i;
+    for (i = 1; i < nports && n < len; ++i) {
+        n += snprintf(spec + n, len - n, ".%u", ports[i]);
+    }
+    return n >= len;
+}
+
+/*======================================================================
+  Remember the bus/port path of the printer just opened
+*/
+void device_cache_store(libusb_device *dev)
+{
+    char spec[64];
+    if (device_port_path(dev, spec, sizeof spec))
+        return;
+
+    char path[PATH_MAX];
+    if (user_cache_path(path, sizeof path, "klg2.device"))
+        return;
+    FILE *f = fopen(path, "w");
+    if (!f)
+        return;
+    fprintf(f, "%s\n", spec);
+    fclose(f);
+}
+
+/*======================================================================
+  Transfer profiles: the parameters found by the tuning mode for each
+  printer, by serial number, one per line of the cache file
+*/
+#define TRANSFER_FILE "klg2.transfer"
+
+/*======================================================================
+  Serial number of an open printer
+*/
+int device_serial(libusb_device_handle *hnd, char *serial, size_t len)
+{
+    struct libusb_device_descriptor desc;
+    if (libusb_get_device_descriptor(libusb_get_device(hnd), &desc) ||
+            !desc.iSerialNumber)
+        return 1;
+    int n = libusb_get_string_descriptor_ascii(hnd, desc.iSerialNumber,
+            (unsigned char *)serial, len);
+    if (n <= 0 || n >= len)
+        return 1;
+    serial[n] = '\0';
+    /* Used as a word in the file */
+    for (; *serial; ++serial) {
+        if (!isgraph((unsigned char)*serial))
+            *serial = '_';
+    }
+    return 0;
+}
+
+/*======================================================================
+  Whether the commands of the pages in flight, and of the one being
+  uploaded, fit in the pending ring
+*/
+static _Bool transfer_fits(const struct transfer_t *t)
+{
+    return !t->window ||
+        (t->window + 1) * (t->page / t->block + 2) <= PENDING_MAX;
+}
+
+/*======================================================================
+  The transfer parameters of an open printer: its profile if tuned,
+  else the defaults; -O asks for overlapping anyway
+*/
+void transfer_profile(libusb_device_handle *hnd, struct transfer_t *t)
+{
+    static const struct transfer_t defaults = TRANSFER_DEFAULT;
+    *t = defaults;
+
+    /* The serial number takes control transfers: only read when some
+       profile is stored */
+    char serial[128], path[PATH_MAX], line[256];
+    FILE *f = NULL;
+    struct stat st;
+    if (!user_cache_path(path, sizeof path, TRANSFER_FILE))
+        f = fopen(path, "r");
+    if (f && (fstat(fileno(f), &st) || !st.st_size ||
+                device_serial(hnd, serial, sizeof serial))) {
+        fclose(f);
+        f = NULL;
+    }
+    while (f && fgets(line, sizeof line, f)) {
+        char name[128];
+        struct transfer_t p;
+        if (sscanf(line, "%127s %u %u %u %u %u", name, &p.block, &p.page,
+                    &p.window, &p.stall, &p.timeout) == 6 &&
+                !strcmp(name, serial) && p.block >= 1 && p.block <= 60 &&
+                p.page >= IMAGE_ROWS/8 && p.page <= 8192 &&
+                p.page % (IMAGE_ROWS/8) == 0 && p.window <= 3 &&
+                transfer_fits(&p)) {
+            *t = p;
+            if (dump_comm)
+                fprintf(stderr, "Transfer profile of %s: block %u, page %u, "
+                        "window %u, stall %u ms, timeout %u ms\n", serial,
+                        t->block, t->page, t->window, t->stall, t->timeout);
+        }
+    }
+    if (f)
+        fclose(f);
+    if (opt_overlap && t->window < 2) {
+        t->window = 2;
+        if (!transfer_fits(t)) {
+            fprintf(stderr, "Pages of %u blocks are too many to overlap, "
+                    "using the default ones\n", t->page / t->block);
+            t->block = defaults.block;
+            t->page = defaults.page;
+        }
+    }
+}
+
+/*======================================================================
+  Store the profile of a printer, replacing its old one
+*/
+int transfer_store(const char *serial, const struct transfer_t *t)
+{
+    char path[PATH_MAX], tmp[PATH_MAX + 8], line[256];
+    if (user_cache_path(path, sizeof path, TRANSFER_FILE))
+        return 1;
+    snprintf(tmp, sizeof tmp, "%s.new", path);
+    FILE *out = fopen(tmp, "w");
+    if (!out) {
+        perror(tmp);
+        return 1;
+    }
+    FILE *in = fopen(path, "r");
+    size_t n = strlen(serial);
+    while (in && fgets(line, sizeof line, in)) {
+        if (strncmp(line, serial, n) || !isspace((unsigned char)line[n]))
+            fputs(line, out);
+    }
+    if (in)
+        fclose(in);
+    fprintf(out, "%s %u %u %u %u %u\n", serial, t->block, t->page,
+            t->window, t->stall, t->timeout);
+    if (fclose(out) || rename(tmp, path)) {
+        perror(path);
+        unlink(tmp);
+        return 1;
+    }
+    return 0;
+}
+
+/*======================================================================
+  Map a bus/port path (like 1-2.3, as in sysfs) to its device node
+*/
+int device_node_from_port(const char *spec, char *node, size_t len)
+{
+    if (strspn(spec, "0123456789-.") != strlen(spec) || !strchr(spec, '-'))
+        return 1;
+
+    unsigned busnum, devnum;
+    char path[PATH_MAX];
+    FILE *f;
+    snprintf(path, sizeof path, "/sys/bus/usb/devices/%s/busnum", spec);
+    f = fopen(path, "r");
+    if (!f)
+        return 1;
+    int rc = fscanf(f, "%u", &busnum) != 1;
+    fclose(f);
+    snprintf(path, sizeof path, "/sys/bus/usb/devices/%s/devnum", spec);
+    f = fopen(path, "r");
+    if (!f)
+        return 1;
+    rc |= fscanf(f, "%u", &devnum) != 1;
+    fclose(f);
+    if (rc)
+        return 1;
+    snprintf(node, len, "/dev/bus/usb/%03u/%03u", busnum, devnum);
+    return 0;
+}
+
+/*======================================================================
+  Check that an opened device is actually a KL-G2
+*/
+static int device_is_klg2(libusb_device *dev)
+{
+    struct libusb_device_descriptor desc;
+    if (libusb_get_device_descriptor(dev, &desc))
+        return 0;
+    return desc.idVendor == KLG2_VID && desc.idProduct == KLG2_PID;
+}
+
+/*======================================================================
+  Open the printer from an already open file descriptor (handed over
+  by udev or systemd, or opened from the device node)
+*/
+static libusb_device_handle *device_open_fd(int fd)
+{
+#ifdef HAVE_WRAP_SYS_DEVICE
+    libusb_device_handle *hnd;
+    if (libusb_wrap_sys_device(NULL, (intptr_t)fd, &hnd))
+        return NULL;
+    if (!device_is_klg2(libusb_get_device(hnd))) {
+        libusb_close(hnd);
+        return NULL;
+    }
+    return hnd;
+#else
+    return NULL;
+#endif
+}
+
+/*======================================================================
+  Open the printer at a device node or bus/port path, without
+  enumerating the bus
+*/
+static libusb_device_handle *device_open_path(const char *spec, int *fdp)
+{
+    char node[PATH_MAX];
+    if (spec[0] == '/') {
+        snprintf(node, sizeof node, "%s", spec);
+    } else if (device_node_from_port(spec, node, sizeof node)) {
+        return NULL;
+    }
+    int fd = open(node, O_RDWR);
+    if (fd < 0)
+        return NULL;
+    libusb_device_handle *hnd = device_open_fd(fd);
+    if (!hnd) {
+        close(fd);
+        return NULL;
+    }
+    *fdp = fd;
+    return hnd;
+}
+
+/*======================================================================
+  Open the printer given with -D
+  A file descriptor handed over is not owned, *fdp is only set when the
+  device node is opened here
+*/
+static libusb_device_handle *device_open_spec(const char *spec, int *fdp)
+{
+    if (strncmp(spec, "fd:", 3) == 0) {
+        char *end;
+        long fd = strtol(spec + 3, &end, 10);
+        if (*end || fd < 0 || fd > INT_MAX) {
+            fputs("Invalid device file descriptor\n", stderr);
+            return NULL;
+        }
+        return device_open_fd(fd);
+    }
+    return device_open_path(spec, fdp);
+}
+
+/*======================================================================
+  Open and claim the printer
+  An explicit device (-D) is opened directly, with no fallback. Otherwise
+  the cached path is tried first and enumeration is used only on a miss
+*/
+int printer_open(void)
+{
+    _Bool explicit = opt_device != NULL;
+
+#if defined(HAVE_WRAP_SYS_DEVICE) && LIBUSB_API_VERSION >= 0x01000109
+    /* No need to scan the bus when the device is given */
+    if (explicit)
+        libusb_set_option(NULL, LIBUSB_OPTION_NO_DEVICE_DISCOVERY);
+#endif
+    int rc = libusb_init(NULL);
+    if (rc < 0)
+        return rc;
+
+    char spec[PATH_MAX];
+    if (explicit) {
+        devhnd = device_open_spec(opt_device, &devfd);
+    } else if (!device_cache_load(spec, sizeof spec)) {
+        devhnd = device_open_path(spec, &devfd);
+    }
+
+    if (!devhnd && !explicit) {
+        /* Apre la comunicazione usando VID e PID */
+        devhnd = libusb_open_device_with_vid_pid(NULL, KLG2_VID, KLG2_PID);
+        if (devhnd)
+            device_cache_store(libusb_get_device(devhnd));
+    }
+    if (!devhnd) {
         fputs("Can't find or access printer\n", stderr);
         return 1;
     }
-    rc = libusb_claim_interface(devhnd, KLG2_IFACE);
-    if (rc) {
-        fputs("Can't claim printer interface\n", stderr);
+    rc = libusb_claim_interface(devhnd, KLG2_IFACE);
+    if (rc) {
+        fputs("Can't claim printer interface\n", stderr);
+        return 1;
+    }
+    transfer_profile(devhnd, &xfer);
+    return 0;
+}
+
+/*======================================================================
+  Release the printer and close the USB library
+*/
+void printer_close(void)
+{
+    libusb_release_interface(devhnd, KLG2_IFACE);
+    libusb_close(devhnd);
+    if (devfd >= 0) {
+        close(devfd);
+        devfd = -1;
+    }
+    libusb_exit(NULL);
+}
+
+/*======================================================================
+  Printer pool for the long-running mode
+  Printers are tracked through hotplug events (or by polling the bus
+  where hotplug is not supported) and kept claimed, checked and reset,
+  ready for the next job
+*/
+#define POOL_SIZE 8
+#define POOL_RETRIES 5
+
+enum PRINTER_STATE_T {
+    PRINTER_UNUSED,     /* Free slot */
+    PRINTER_ARRIVED,    /* Plugged in, still to be opened */
+    PRINTER_READY,      /* Claimed, checked and reset */
+    PRINTER_FAILED,     /* Unusable until plugged in again */
+    PRINTER_LEFT        /* Unplugged, still to be released */
+};
+
+struct printer_t {
+    enum PRINTER_STATE_T state;
+    libusb_device *dev;
+    libusb_device_handle *hnd;
+    int fd;
+    unsigned attempts;
+    double retry_at;
+    char name[64];
+    struct transfer_t xfer;
+    _Bool warm;                 /* Handshake already done for warm_set */
+    struct settings_t warm_set;
+    double warm_at;
+};
+
+struct printer_t pool[POOL_SIZE];
+_Bool pool_hotplug = false;
+libusb_hotplug_callback_handle pool_hotplug_handle;
+
+/*======================================================================
+  Add a newly seen printer to the pool
+*/
+static void pool_add(libusb_device *dev)
+{
+    int i;
+    for (i = 0; i < POOL_SIZE; ++i) {
+        if (pool[i].state != PRINTER_UNUSED && pool[i].dev == dev)
+            return;
+    }
+    for (i = 0; i < POOL_SIZE; ++i) {
+        struct printer_t *p = &pool[i];
+        if (p->state == PRINTER_UNUSED) {
+            memset(p, 0, sizeof *p);
+            p->state = PRINTER_ARRIVED;
+            p->fd = -1;
+            p->dev = dev ? libusb_ref_device(dev) : NULL;
+            if (!dev)
+                snprintf(p->name, sizeof p->name, "%s", opt_device);
+            else if (device_port_path(dev, p->name, sizeof p->name))
+                snprintf(p->name, sizeof p->name, "%u:%u",
+                        libusb_get_bus_number(dev),
+                        libusb_get_device_address(dev));
+            return;
+        }
+    }
+    fputs("Too many printers, ignoring one\n", stderr);
+}
+
+/*======================================================================
+  Mark a printer as unplugged; it is released out of the callback
+*/
+static void pool_remove(libusb_device *dev)
+{
+    int i;
+    for (i = 0; i < POOL_SIZE; ++i) {
+        if (pool[i].state != PRINTER_UNUSED && pool[i].dev == dev)
+            pool[i].state = PRINTER_LEFT;
+    }
+}
+
+/*======================================================================
+  Hotplug callback: no I/O is allowed here
+*/
+static int LIBUSB_CALL pool_hotplug_cb(libusb_context *ctx,
+        libusb_device *dev, libusb_hotplug_event event, void *user_data)
+{
+    if (event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED)
+        pool_add(dev);
+    else if (event == LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT)
+        pool_remove(dev);
+    return 0;
+}
+
+/*======================================================================
+  Look for arrived and departed printers without hotplug support
+*/
+static void pool_scan(void)
+{
+    libusb_device **list;
+    ssize_t n = libusb_get_device_list(NULL, &list);
+    if (n < 0)
+        return;
+
+    int i, j;
+    for (i = 0; i < POOL_SIZE; ++i) {
+        if (pool[i].state == PRINTER_UNUSED || !pool[i].dev)
+            continue;
+        for (j = 0; j < n && list[j] != pool[i].dev; ++j)
+            ;
+        if (j == n)
+            pool[i].state = PRINTER_LEFT;
+    }
+    for (j = 0; j < n; ++j) {
+        if (device_is_klg2(list[j]))
+            pool_add(list[j]);
+    }
+    libusb_free_device_list(list, 1);
+}
+
+/*======================================================================
+  Close a printer handle
+*/
+static void pool_close(struct printer_t *p)
+{
+    p->warm = false;
+    p->warm_at = 0;
+    if (p->hnd) {
+        libusb_release_interface(p->hnd, KLG2_IFACE);
+        libusb_close(p->hnd);
+        p->hnd = NULL;
+    }
+    if (p->fd >= 0) {
+        close(p->fd);
+        p->fd = -1;
+    }
+}
+
+/*======================================================================
+  Make a printer current for the protocol functions
+*/
+static void pool_select(struct printer_t *p)
+{
+    devhnd = p->hnd;
+    xfer = p->xfer;
+    usb_error = false;
+}
+
+/*======================================================================
+  Open, claim, check and reset an arrived printer
+*/
+static void pool_warm(struct printer_t *p)
+{
+    if (!p->hnd) {
+        if (p->dev) {
+            if (libusb_open(p->dev, &p->hnd))
+                p->hnd = NULL;
+        } else {
+            p->hnd = device_open_spec(opt_device, &p->fd);
+        }
+        if (p->hnd && libusb_claim_interface(p->hnd, KLG2_IFACE)) {
+            libusb_close(p->hnd);
+            p->hnd = NULL;
+        }
+        if (p->hnd)
+            transfer_profile(p->hnd, &p->xfer);
+    }
+    if (p->hnd) {
+        pool_select(p);
+        if (!printer_check_status() && !printer_reset()) {
+            p->state = PRINTER_READY;
+            p->attempts = 0;
+            fprintf(stderr, "Printer %s ready\n", p->name);
+            return;
+        }
+        pool_close(p);
+    }
+
+    /* It could still be starting up; the -D printer is waited forever */
+    if (++p->attempts < POOL_RETRIES || !p->dev) {
+        p->retry_at = now_ms() + 1000;
+    } else {
+        p->state = PRINTER_FAILED;
+        fprintf(stderr, "Can't access printer %s\n", p->name);
+    }
+}
+
+/*======================================================================
+  Bring the pool up to date
+*/
+void pool_service(void)
+{
+    static double next_scan;
+    if (!pool_hotplug && !opt_device && now_ms() >= next_scan) {
+        pool_scan();
+        next_scan = now_ms() + 1000;
+    }
+
+    int i;
+    for (i = 0; i < POOL_SIZE; ++i) {
+        struct printer_t *p = &pool[i];
+        switch (p->state) {
+        case PRINTER_LEFT:
+            pool_close(p);
+            if (p->dev)
+                libusb_unref_device(p->dev);
+            fprintf(stderr, "Printer %s removed\n", p->name);
+            p->state = PRINTER_UNUSED;
+            break;
+        case PRINTER_ARRIVED:
+            if (now_ms() >= p->retry_at)
+                pool_warm(p);
+            break;
+        default:
+            break;
+        }
+    }
+}
+
+/*======================================================================
+  Take a ready printer and make it current, preferring one already
+  handshaken for the job settings, otherwise round robin
+*/
+struct printer_t *pool_get(const struct settings_t *set)
+{
+    static int last;
+    int i;
+    for (i = 0; i < POOL_SIZE; ++i) {
+        struct printer_t *p = &pool[i];
+        if (p->state == PRINTER_READY && p->warm &&
+                settings_equal(&p->warm_set, set)) {
+            pool_select(p);
+            return p;
+        }
+    }
+    for (i = 1; i <= POOL_SIZE; ++i) {
+        struct printer_t *p = &pool[(last + i) % POOL_SIZE];
+        if (p->state == PRINTER_READY) {
+            last = p - pool;
+            pool_select(p);
+            return p;
+        }
+    }
+    return NULL;
+}
+
+/*======================================================================
+  Put a printer back after a job: reset it for the next one, or reopen
+  it if the communication broke down
+*/
+void pool_put(struct printer_t *p)
+{
+    if (!usb_error && !printer_check_status() && !printer_reset())
+        return;
+    fprintf(stderr, "Printer %s lost, reconnecting\n", p->name);
+    pool_close(p);
+    if (p->state == PRINTER_READY) {
+        p->state = PRINTER_ARRIVED;
+        p->retry_at = 0;
+    }
+}
+
+/*======================================================================
+  Pre-warming: while idle the handshake for the most likely settings of
+  the next job (the most frequent among the last ones) is done in
+  advance, so that a matching job goes straight to the raster. The
+  speculative state is refreshed after opt_prewarm seconds
+*/
+#define PREWARM_HISTORY 16
+
+struct settings_t prewarm_history[PREWARM_HISTORY];
+unsigned prewarm_jobs;
+unsigned prewarm_hits, prewarm_misses;
+
+/*======================================================================
+  Remember the settings of a job
+*/
+void prewarm_remember(const struct settings_t *set)
+{
+    prewarm_history[prewarm_jobs++ % PREWARM_HISTORY] = *set;
+}
+
+/*======================================================================
+  Most likely settings for the next job
+*/
+void prewarm_likely(struct settings_t *set)
+{
+    unsigned n = prewarm_jobs < PREWARM_HISTORY ?
+        prewarm_jobs : PREWARM_HISTORY;
+    unsigned i, j, best = 0;
+    settings_default(set);
+
+    /* Newest first, so ties go to the most recent */
+    for (i = 0; i < n; ++i) {
+        const struct settings_t *s =
+            &prewarm_history[(prewarm_jobs - 1 - i) % PREWARM_HISTORY];
+        unsigned count = 0;
+        for (j = 0; j < n; ++j) {
+            count += settings_equal(s, &prewarm_history[j]);
+        }
+        if (count > best) {
+            best = count;
+            *set = *s;
+        }
+    }
+}
+
+/*======================================================================
+  Is the speculative handshake still good?
+*/
+static _Bool prewarm_fresh(const struct printer_t *p)
+{
+    return now_ms() - p->warm_at < opt_prewarm * 1000.0;
+}
+
+/*======================================================================
+  Undo a speculative handshake
+*/
+static int prewarm_drop(struct printer_t *p)
+{
+    p->warm = false;
+    p->warm_at = 0;
+    printer_cancel_job();
+    return printer_check_status() || printer_reset();
+}
+
+/*======================================================================
+  Handshake the idle printers for the likely next job
+*/
+void pool_prewarm(void)
+{
+    struct settings_t set;
+    prewarm_likely(&set);
+
+    int i;
+    for (i = 0; i < POOL_SIZE; ++i) {
+        struct printer_t *p = &pool[i];
+        if (p->state != PRINTER_READY)
+            continue;
+        if (p->warm && prewarm_fresh(p) && settings_equal(&p->warm_set, &set))
+            continue;
+        /* Also keeps a failing one from being retried at once */
+        if (!p->warm && p->warm_at && prewarm_fresh(p))
+            continue;
+
+        pool_select(p);
+        if (p->warm && prewarm_drop(p)) {
+            pool_put(p);
+            continue;
+        }
+        p->warm_at = now_ms();
+        if (printer_setup(&set)) {
+            printer_cancel_job();
+            pool_put(p);
+            continue;
+        }
+        p->warm = true;
+        p->warm_set = set;
+    }
+}
+
+/*======================================================================
+  Time to the next pool retry, for poll(); -1 if none is due
+*/
+int pool_timeout(void)
+{
+    double next = -1, now = now_ms();
+    if (!pool_hotplug && !opt_device)
+        next = now + 1000;
+    int i;
+    for (i = 0; i < POOL_SIZE; ++i) {
+        if (pool[i].state == PRINTER_ARRIVED &&
+                (next < 0 || pool[i].retry_at < next))
+            next = pool[i].retry_at;
+        double stale = pool[i].warm_at + opt_prewarm * 1000.0;
+        if (pool[i].warm_at && pool[i].state == PRINTER_READY &&
+                (next < 0 || stale < next))
+            next = stale;
+    }
+    if (next < 0)
+        return -1;
+    return next > now ? (int)(next - now) + 1 : 0;
+}
+
+/*======================================================================
+  Start tracking printers
+*/
+int pool_start(void)
+{
+    if (opt_device) {
+        /* Only the given printer, reopened by path if lost */
+        pool_add(NULL);
+        return 0;
+    }
+    if (libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)) {
+        if (libusb_hotplug_register_callback(NULL,
+                    LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED |
+                    LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT,
+                    LIBUSB_HOTPLUG_ENUMERATE, KLG2_VID, KLG2_PID,
+                    LIBUSB_HOTPLUG_MATCH_ANY, pool_hotplug_cb, NULL,
+                    &pool_hotplug_handle)) {
+            fputs("Can't register hotplug callback\n", stderr);
+            return 1;
+        }
+        pool_hotplug = true;
+    }
+    return 0;
+}
+
+/*======================================================================
+  Release every printer
+*/
+void pool_stop(void)
+{
+    if (pool_hotplug)
+        libusb_hotplug_deregister_callback(NULL, pool_hotplug_handle);
+    int i;
+    for (i = 0; i < POOL_SIZE; ++i) {
+        if (pool[i].state == PRINTER_UNUSED)
+            continue;
+        if (pool[i].warm) {
+            pool_select(&pool[i]);
+            printer_cancel_job();
+        }
+        pool_close(&pool[i]);
+        if (pool[i].dev)
+            libusb_unref_device(pool[i].dev);
+        pool[i].state = PRINTER_UNUSED;
+    }
+}
+
+/*======================================================================
+  Scheduling statistics
+*/
+unsigned sched_jobs, sched_preempted, sched_missed;
+double sched_wait_sum, sched_wait_max;
+
+/*======================================================================
+  Account for a job starting
+*/
+void sched_start(struct job_t *job)
+{
+    if (job->started)
+        return;
+    job->started = now_ms();
+    double wait = job->started - job->arrived;
+    sched_wait_sum += wait;
+    if (wait > sched_wait_max)
+        sched_wait_max = wait;
+    ++sched_jobs;
+}
+
+/*======================================================================
+  Account for a job done
+*/
+void sched_done(struct job_t *job)
+{
+    double late = now_ms() - job->deadline;
+    if (job->deadline && late > 0) {
+        ++sched_missed;
+        fprintf(stderr, "Job %u missed its deadline by %.0f ms\n",
+                job->id, late);
+    }
+}
+
+/*======================================================================
+  Print a job on the current printer, skipping the handshake if it was
+  done in advance with the same settings
+*/
+int print_job(struct job_t *job, struct printer_t *p)
+{
+    int rc = 0;
+    if (p->warm && prewarm_fresh(p) && settings_equal(&p->warm_set, &job->set)) {
+        ++prewarm_hits;
+        p->warm = false;
+        p->warm_at = 0;
+    } else {
+        if (p->warm) {
+            ++prewarm_misses;
+            rc = prewarm_drop(p);
+        }
+        if (!rc)
+            rc = printer_setup(&job->set);
+    }
+    if (!rc && job->rle)
+        rc = printer_send_rle(job->rle, job->offset);
+    else if (!rc)
+        rc = printer_send_raster(job->pattern + job->offset,
+                job->pattern_size - job->offset);
+
+    /* The standard program does this even in the success case */
+    printer_cancel_job();
+    return rc;
+}
+
+/*======================================================================
+  Network input of the long-running mode: PBM streams are accepted on a
+  TCP port (raw, like the usual port 9100 of printers) and on a local
+  socket. Each connection is a source; connections from the same
+  address (or the same user, on the local socket) share a client
+*/
+#define LISTEN_MAX 8
+#define CONN_MAX 256
+
+int listen_fds[LISTEN_MAX];
+_Bool listen_shm[LISTEN_MAX];   /* Shared memory submission socket */
+unsigned listen_count;
+unsigned listen_paused;         /* Connections when out of descriptors */
+double listen_paused_at;
+_Bool listen_warned;
+
+/*======================================================================
+  Listen on a TCP port, given as [host:]port; an IPv6 host goes in
+  brackets
+*/
+int loop_listen_tcp(const char *spec)
+{
+    char host[256];
+    const char *port = strrchr(spec, ':');
+    const char *end = spec[0] == '[' ? strchr(spec, ']') : NULL;
+    if (end && end[1] == ':') {
+        snprintf(host, sizeof host, "%.*s", (int)(end - spec - 1), spec + 1);
+        port = end + 2;
+    } else if (port) {
+        snprintf(host, sizeof host, "%.*s", (int)(port - spec), spec);
+        ++port;
+    } else {
+        port = spec;
+    }
+
+    struct addrinfo hints = {
+        .ai_family = AF_UNSPEC,
+        .ai_socktype = SOCK_STREAM,
+        .ai_flags = AI_PASSIVE
+    }, *res, *ai;
+    int rc = getaddrinfo(port != spec ? host : NULL, port, &hints, &res);
+    if (rc) {
+        fprintf(stderr, "%s: %s\n", spec, gai_strerror(rc));
+        return 1;
+    }
+    for (ai = res; ai && listen_count < LISTEN_MAX; ai = ai->ai_next) {
+        int fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (fd < 0)
+            continue;
+        int on = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof on);
+        if (ai->ai_family == AF_INET6)
+            setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &on, sizeof on);
+        if (bind(fd, ai->ai_addr, ai->ai_addrlen) || listen(fd, 16)) {
+            close(fd);
+            continue;
+        }
+        fcntl(fd, F_SETFL, O_NONBLOCK);
+        listen_shm[listen_count] = false;
+        listen_fds[listen_count++] = fd;
+    }
+    freeaddrinfo(res);
+    if (!listen_count) {
+        fprintf(stderr, "%s: can't listen\n", spec);
+        return 1;
+    }
+    return 0;
+}
+
+/*======================================================================
+  Listen on a local socket, for PBM streams or, if shm, for shared
+  memory descriptors
+*/
+int loop_listen_unix(const char *path, _Bool shm)
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(path) >= sizeof addr.sun_path || listen_count == LISTEN_MAX) {
+        fprintf(stderr, "%s: can't listen\n", path);
+        return 1;
+    }
+    strcpy(addr.sun_path, path);
+    unlink(path);
+    int fd = socket(AF_UNIX, shm ? SOCK_SEQPACKET : SOCK_STREAM, 0);
+    if (fd < 0 || bind(fd, (struct sockaddr *)&addr, sizeof addr) ||
+            listen(fd, 16)) {
+        perror(path);
+        if (fd >= 0)
+            close(fd);
+        return 1;
+    }
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+    listen_shm[listen_count] = shm;
+    listen_fds[listen_count++] = fd;
+    return 0;
+}
+
+/*======================================================================
+  Number of open inputs, stream sources and shared memory clients
+*/
+unsigned loop_connections(void)
+{
+    unsigned n = 0;
+    struct source_t *src;
+    struct shm_conn_t *conn;
+    for (src = sources; src; src = src->next)
+        ++n;
+    for (conn = shm_conns; conn; conn = conn->next)
+        ++n;
+    return n;
+}
+
+/*======================================================================
+  Take the pending connections of a listening socket, up to CONN_MAX.
+  Out of descriptors, the listeners are left alone until an input
+  closes, or for a second, lest their readiness spin the loop
+*/
+void loop_accept(int lfd, _Bool shm)
+{
+    struct sockaddr_storage addr;
+    socklen_t len;
+    int fd;
+    unsigned count = loop_connections();
+    for (; count < CONN_MAX; ++count) {
+        len = sizeof addr;
+        fd = accept(lfd, (struct sockaddr *)&addr, &len);
+        if (fd < 0) {
+            if (errno == EMFILE || errno == ENFILE) {
+                if (!listen_warned)
+                    fputs("Out of file descriptors, not accepting "
+                            "connections for now\n", stderr);
+                listen_warned = true;
+                listen_paused = count + 1;
+                listen_paused_at = now_ms();
+            }
+            break;
+        }
+        listen_warned = false;
+        char name[64] = "local";
+        if (addr.ss_family == AF_UNIX) {
+#ifdef SO_PEERCRED
+            struct ucred cred;
+            socklen_t clen = sizeof cred;
+            if (!getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &clen))
+                snprintf(name, sizeof name, "uid %u", (unsigned)cred.uid);
+#endif
+        } else {
+            getnameinfo((struct sockaddr *)&addr, len, name, sizeof name,
+                    NULL, 0, NI_NUMERICHOST);
+        }
+        struct client_t *c = client_get(name, 1, opt_quota_priority);
+        if (!c) {
+            close(fd);
+        } else if (shm) {
+            struct shm_conn_t *conn = calloc(1, sizeof *conn);
+            if (!conn) {
+                fputs("malloc failed\n", stderr);
+                close(fd);
+            } else {
+                fcntl(fd, F_SETFL, O_NONBLOCK);
+                conn->fd = fd;
+                conn->refs = 1;
+                conn->client = c;
+                ++c->refs;
+                conn->next = shm_conns;
+                shm_conns = conn;
+            }
+        } else if (!source_add(fd, c)) {
+            close(fd);
+        }
+    }
+}
+
+/*======================================================================
+  Drop a shared memory client; its jobs still queued keep their memory
+*/
+void shm_close(struct shm_conn_t *conn)
+{
+    struct shm_conn_t **pp = &shm_conns;
+    while (*pp != conn)
+        pp = &(*pp)->next;
+    *pp = conn->next;
+    close(conn->fd);
+    conn->fd = -1;
+    shm_conn_put(conn);
+}
+
+/*======================================================================
+  Map a memory file passed by a client. It must be sealed against
+  shrinking where seals exist, since reading past its end would kill
+  the process
+*/
+static int shm_map(struct shm_conn_t *conn, int fd)
+{
+    struct stat st;
+    if (fstat(fd, &st) || st.st_size <= 0) {
+        fputs("Shared memory: can't get the size\n", stderr);
+        return 1;
+    }
+#ifdef F_GET_SEALS
+    int seals = fcntl(fd, F_GET_SEALS);
+    if (seals < 0 || !(seals & F_SEAL_SHRINK)) {
+        fputs("Shared memory: not sealed against shrinking\n", stderr);
+        return 1;
+    }
+#endif
+    struct shm_map_t *map = calloc(1, sizeof *map);
+    if (!map) {
+        fputs("malloc failed\n", stderr);
+        return 1;
+    }
+    map->size = st.st_size;
+    map->base = mmap(NULL, map->size, PROT_READ, MAP_SHARED, fd, 0);
+    if (map->base == MAP_FAILED) {
+        perror("Shared memory");
+        free(map);
+        return 1;
+    }
+    map->refs = 1;
+    shm_map_put(conn->map);
+    conn->map = map;
+    return 0;
+}
+
+/*======================================================================
+  Turn a descriptor into a job. Columns are left in place; rows are
+  transposed at once and their memory handed back
+*/
+static struct job_t *shm_submit(struct shm_conn_t *conn,
+        const struct shm_desc_t *d, char *opts)
+{
+    const struct shm_map_t *map = conn->map;
+    unsigned height = d->height;
+    size_t stride = (d->width + 7) / 8;
+    size_t size;
+    if (d->format == SHM_COLUMNS) {
+        size = (size_t)d->width * (IMAGE_ROWS/8);
+    } else if (d->format == SHM_ROWS) {
+        size = stride * height;
+        if (height > IMAGE_ROWS) {
+            fputs("WARNING: Image truncated\n", stderr);
+            height = IMAGE_ROWS;
+        }
+    } else {
+        fprintf(stderr, "Shared memory: descriptor %u: bad format\n",
+                (unsigned)d->id);
+        return NULL;
+    }
+    if (!map || !d->width || d->offset > map->size ||
+            size > map->size - d->offset) {
+        fprintf(stderr, "Shared memory: descriptor %u: out of bounds\n",
+                (unsigned)d->id);
+        return NULL;
+    }
+    if (IMAGE_ROWS/8 * (size_t)d->width > opt_quota_bytes) {
+        fprintf(stderr, "Shared memory: descriptor %u: "
+                "image exceeds the quota\n", (unsigned)d->id);
+        return NULL;
+    }
+
+    struct job_t *job = job_new(conn->client);
+    if (!job)
+        return NULL;
+    char *tok;
+    for (tok = strtok(opts, " \t\r\n"); tok; tok = strtok(NULL, " \t\r\n")) {
+        if (job_option(job, tok))
+            fprintf(stderr, "Job %u: invalid option %s\n", job->id, tok);
+    }
+    job->pattern_size = IMAGE_ROWS/8 * d->width;
+    if (d->format == SHM_COLUMNS) {
+        job->pattern = map->base + d->offset;
+        job->shm = conn;
+        ++conn->refs;
+        job->map = conn->map;
+        ++job->map->refs;
+        job->shm_id = d->id;
+        return job;
+    }
+    job->pattern = calloc(1, job->pattern_size);
+    if (!job->pattern) {
+        fputs("malloc failed\n", stderr);
+        job_free(job);
+        return NULL;
+    }
+    transpose_rows(job->pattern, map->base + d->offset, stride, d->width,
+            height);
+    shm_reply(conn, d->id, 0);
+    return job;
+}
+
+/*======================================================================
+  Read the messages of a shared memory client
+*/
+void shm_read(struct shm_conn_t *conn)
+{
+    while (!client_full(conn->client)) {
+        union {
+            struct shm_desc_t desc;
+            char buf[sizeof(struct shm_desc_t) + 256];
+        } msg;
+        union {
+            struct cmsghdr hdr;
+            char buf[CMSG_SPACE(sizeof(int))];
+        } ctl;
+        struct iovec iov = { .iov_base = &msg, .iov_len = sizeof msg - 1 };
+        struct msghdr mh = {
+            .msg_iov = &iov,
+            .msg_iovlen = 1,
+            .msg_control = &ctl,
+            .msg_controllen = sizeof ctl
+        };
+        ssize_t n = recvmsg(conn->fd, &mh, MSG_DONTWAIT);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return;
+        if (n <= 0) {
+            shm_close(conn);
+            return;
+        }
+
+        struct cmsghdr *cm = CMSG_FIRSTHDR(&mh);
+        if (cm && cm->cmsg_level == SOL_SOCKET &&
+                cm->cmsg_type == SCM_RIGHTS) {
+            int fd;
+            memcpy(&fd, CMSG_DATA(cm), sizeof fd);
+            int rc = shm_map(conn, fd);
+            close(fd);
+            if (rc) {
+                shm_close(conn);
+                return;
+            }
+        }
+        if (n < sizeof msg.desc)
+            continue;
+        msg.buf[n] = '\0';
+        struct job_t *job = shm_submit(conn, &msg.desc,
+                msg.buf + sizeof msg.desc);
+        if (job)
+            queue_push(job);
+        else
+            shm_reply(conn, msg.desc.id, -1);
+    }
+}
+
+/*======================================================================
+  Stop the long-running mode on SIGINT and SIGTERM, after the job
+  being printed
+*/
+volatile sig_atomic_t loop_stop;
+
+static void loop_signal(int sig)
+{
+    loop_stop = 1;
+}
+
+/*======================================================================
+  Queue the complete jobs of the sources, within the client quotas, and
+  drop the sources that are done
+*/
+void loop_ingest(void)
+{
+    struct source_t *src, *next;
+    for (src = sources; src; src = next) {
+        next = src->next;
+        struct job_t *job;
+        while (src->client->jobs < opt_quota_jobs &&
+                (job = source_next_job(src)))
+            queue_push(job);
+        if (src->eof && !src->len)
+            source_remove(src);
+    }
+}
+
+/*======================================================================
+  Wait for input (from the sources under quota only, the others are
+  left to block their writers) and, if asked to, USB events
+*/
+int loop_poll(int timeout, _Bool usb)
+{
+    static struct pollfd *fds;
+    static struct source_t **polled;
+    static struct shm_conn_t **shm_polled;
+    static unsigned nalloc;
+
+    struct source_t *src;
+    struct shm_conn_t *conn;
+    unsigned n = 16 + listen_count;
+    for (src = sources; src; src = src->next)
+        ++n;
+    for (conn = shm_conns; conn; conn = conn->next)
+        ++n;
+    if (n > nalloc) {
+        free(fds);
+        free(polled);
+        free(shm_polled);
+        fds = calloc(n, sizeof *fds);
+        polled = calloc(n, sizeof *polled);
+        shm_polled = calloc(n, sizeof *shm_polled);
+        nalloc = n;
+        if (!fds || !polled || !shm_polled) {
+            fputs("malloc failed\n", stderr);
+            exit(1);
+        }
+    }
+
+    nfds_t nfds = 0, nsrc;
+    for (src = sources; src; src = src->next) {
+        if (source_wants_input(src)) {
+            fds[nfds].fd = src->fd;
+            fds[nfds].events = POLLIN;
+            polled[nfds++] = src;
+        }
+    }
+    nsrc = nfds;
+    unsigned i, nshm = 0;
+    for (conn = shm_conns; conn; conn = conn->next) {
+        if (!client_full(conn->client)) {
+            fds[nfds].fd = conn->fd;
+            fds[nfds++].events = POLLIN;
+            shm_polled[nshm++] = conn;
+        }
+    }
+    /* Connections beyond the limit wait in the backlog */
+    unsigned nlisten = listen_count, count = loop_connections();
+    if (listen_paused && (count + 1 < listen_paused ||
+                now_ms() - listen_paused_at >= 1000))
+        listen_paused = 0;
+    if (listen_paused || count >= CONN_MAX)
+        nlisten = 0;
+    if (listen_paused && (timeout < 0 || timeout > 1000))
+        timeout = 1000;
+    for (i = 0; i < nlisten; ++i) {
+        fds[nfds].fd = listen_fds[i];
+        fds[nfds++].events = POLLIN;
+    }
+    if (usb) {
+        const struct libusb_pollfd **usbfds = libusb_get_pollfds(NULL);
+        for (i = 0; usbfds && usbfds[i] && nfds < n; ++i) {
+            fds[nfds].fd = usbfds[i]->fd;
+            fds[nfds++].events = usbfds[i]->events;
+        }
+        libusb_free_pollfds(usbfds);
+    }
+    if (poll(fds, nfds, timeout) < 0 && errno != EINTR) {
+        perror("poll");
+        return 1;
+    }
+
+    for (i = 0; i < nsrc; ++i) {
+        if (fds[i].revents)
+            source_read(polled[i]);
+    }
+    for (i = 0; i < nshm; ++i) {
+        if (fds[nsrc + i].revents)
+            shm_read(shm_polled[i]);
+    }
+    for (i = 0; i < nlisten; ++i) {
+        if (fds[nsrc + nshm + i].revents)
+            loop_accept(listen_fds[i], listen_shm[i]);
+    }
+    if (usb) {
+        struct timeval zero = { 0, 0 };
+        libusb_handle_events_timeout_completed(NULL, &zero, NULL);
+    }
+    return 0;
+}
+
+/*======================================================================
+  Page boundary hook of the long-running mode: take in new jobs, and
+  end the current label if a more urgent one is waiting. The rest is
+  printed as a new label when its turn comes again
+*/
+struct job_t *loop_job;
+
+static int loop_page_hook(unsigned sent)
+{
+    loop_poll(0, false);
+    loop_ingest();
+
+    struct job_t *next = queue_peek();
+    if (next && job_outranks(next, loop_job)) {
+        loop_job->offset += sent;
+        return 1;
+    }
+    return 0;
+}
+
+/*======================================================================
+  Add an input of the long-running mode, given as
+  [weight[,priority]:]path
+*/
+int loop_add_input(const char *arg)
+{
+    unsigned weight = 1;
+    int top = opt_quota_priority;
+    const char *path = arg;
+    size_t n = strspn(arg, "0123456789");
+    if (n && arg[n] == ':') {
+        weight = atoi(arg);
+        path = arg + n + 1;
+    } else if (n && arg[n] == ',') {
+        char *end;
+        long v = strtol(arg + n + 1, &end, 10);
+        if (end > arg + n + 1 && *end == ':' && v >= INT_MIN &&
+                v <= INT_MAX) {
+            weight = atoi(arg);
+            top = v;
+            path = end + 1;
+        }
+    }
+
+    /* A FIFO is kept open for writing too, so it never reports end of
+       file when a writer is done */
+    struct stat st;
+    int fd = -1;
+    if (stat(path, &st) == 0)
+        fd = open(path, S_ISFIFO(st.st_mode) ? O_RDWR : O_RDONLY);
+    if (fd < 0) {
+        perror(path);
+        return 1;
+    }
+    struct client_t *c = client_get(path, weight, top);
+    return !c || !source_add(fd, c);
+}
+
+/*======================================================================
+  Long-running mode: print every image on the inputs (the standard
+  input if none is given) as a separate label, on whatever printer is
+  attached
+*/
+#define JOB_RETRIES 3
+
+int run_loop(int ninputs, char **inputs)
+{
+    int i;
+    for (i = 0; i < ninputs; ++i) {
+        if (loop_add_input(inputs[i]))
+            return 1;
+    }
+    if (opt_tcp && loop_listen_tcp(opt_tcp))
+        return 1;
+    if (opt_unix && loop_listen_unix(opt_unix, false))
+        return 1;
+    if (opt_shm && loop_listen_unix(opt_shm, true))
+        return 1;
+    if (!ninputs && !listen_count) {
+        struct client_t *c = client_get("stdin", 1, opt_quota_priority);
+        if (!c || !source_add(STDIN_FILENO, c))
+            return 1;
+    }
+
+    int rc = libusb_init(NULL);
+    if (rc < 0)
+        return rc;
+    if (pool_start()) {
+        libusb_exit(NULL);
+        return 1;
+    }
+    raster_page_hook = loop_page_hook;
+    raster_memory = true;
+
+    struct sigaction sa = { .sa_handler = loop_signal };
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    _Bool waiting = false;
+    while (!loop_stop) {
+        pool_service();
+        loop_ingest();
+
+        struct job_t *next = queue_peek();
+        if (next) {
+            struct printer_t *p = pool_get(&next->set);
+            if (p) {
+                struct job_t *job = queue_pop();
+                waiting = false;
+                prewarm_remember(&job->set);
+                sched_start(job);
+                loop_job = job;
+                unsigned offset = job->offset;
+                rc = print_job(job, p);
+                if (rc == 2) {
+                    ++sched_preempted;
+                    fprintf(stderr, "Job %u paused for job %u\n",
+                            job->id, queue_peek()->id);
+                    queue_return(job);
+                } else if (rc && usb_error && ++job->attempts < JOB_RETRIES) {
+                    fprintf(stderr, "Job %u interrupted, will be retried\n",
+                            job->id);
+                    job->offset = offset;
+                    queue_return(job);
+                } else {
+                    if (rc)
+                        fprintf(stderr, "Job %u failed\n", job->id);
+                    sched_done(job);
+                    job_free(job);
+                }
+                pool_put(p);
+                continue;
+            }
+            if (!waiting)
+                fputs("Waiting for a printer\n", stderr);
+            waiting = true;
+        } else if (!sources && !listen_count) {
+            break;
+        } else if (opt_prewarm) {
+            pool_prewarm();
+        }
+
+        if (loop_poll(pool_timeout(), true))
+            break;
+    }
+
+    while (job_queued)
+        job_free(queue_pop());
+    while (sources)
+        source_remove(sources);
+    while (shm_conns)
+        shm_close(shm_conns);
+    while (listen_count)
+        close(listen_fds[--listen_count]);
+    if (opt_unix)
+        unlink(opt_unix);
+    if (opt_shm)
+        unlink(opt_shm);
+    raster_page_hook = NULL;
+    if (sched_jobs)
+        fprintf(stderr, "%u jobs: queue wait avg %.0f max %.0f ms, "
+                "%u preempted, %u deadlines missed\n", sched_jobs,
+                sched_wait_sum / sched_jobs, sched_wait_max,
+                sched_preempted, sched_missed);
+    if (opt_prewarm)
+        fprintf(stderr, "Pre-warm: %u hits, %u misses\n",
+                prewarm_hits, prewarm_misses);
+    if (opt_raster_cache)
+        fprintf(stderr, "Raster cache: %u hits, %u misses\n",
+                raster_hits, raster_misses);
+    pool_stop();
+    libusb_exit(NULL);
+    return 0;
+}
+
+/*======================================================================
+  Bitmap fonts for printing text: BDF, PSF (version 1 and 2) or the
+  built-in 5x7 one. Glyphs are kept rotated, in the columns of 16 bytes
+  of the print pattern, and cached at the size and height they are
+  printed, so that drawing a string is only a copy of columns
+*/
+/* 5x7 font for ASCII 32-126, a byte for each column, top row in bit 0 */
+#define FONT_FIRST 32
+#define FONT_LAST 126
+#define FONT_W 5
+#define FONT_H 8
+
+static const uint8_t font5x7[][FONT_W] = {
+    { 0x00, 0x00, 0x00, 0x00, 0x00 }, { 0x00, 0x00, 0x5F, 0x00, 0x00 },
+    { 0x00, 0x07, 0x00, 0x07, 0x00 }, { 0x14, 0x7F, 0x14, 0x7F, 0x14 },
+    { 0x24, 0x2A, 0x7F, 0x2A, 0x12 }, { 0x23, 0x13, 0x08, 0x64, 0x62 },
+    { 0x36, 0x49, 0x55, 0x22, 0x50 }, { 0x00, 0x05, 0x03, 0x00, 0x00 },
+    { 0x00, 0x1C, 0x22, 0x41, 0x00 }, { 0x00, 0x41, 0x22, 0x1C, 0x00 },
+    { 0x08, 0x2A, 0x1C, 0x2A, 0x08 }, { 0x08, 0x08, 0x3E, 0x08, 0x08 },
+    { 0x00, 0x50, 0x30, 0x00, 0x00 }, { 0x08, 0x08, 0x08, 0x08, 0x08 },
+    { 0x00, 0x60, 0x60, 0x00, 0x00 }, { 0x20, 0x10, 0x08, 0x04, 0x02 },
+    { 0x3E, 0x51, 0x49, 0x45, 0x3E }, { 0x00, 0x42, 0x7F, 0x40, 0x00 },
+    { 0x42, 0x61, 0x51, 0x49, 0x46 }, { 0x21, 0x41, 0x45, 0x4B, 0x31 },
+    { 0x18, 0x14, 0x12, 0x7F, 0x10 }, { 0x27, 0x45, 0x45, 0x45, 0x39 },
+    { 0x3C, 0x4A, 0x49, 0x49, 0x30 }, { 0x01, 0x71, 0x09, 0x05, 0x03 },
+    { 0x36, 0x49, 0x49, 0x49, 0x36 }, { 0x06, 0x49, 0x49, 0x29, 0x1E },
+    { 0x00, 0x36, 0x36, 0x00, 0x00 }, { 0x00, 0x56, 0x36, 0x00, 0x00 },
+    { 0x08, 0x14, 0x22, 0x41, 0x00 }, { 0x14, 0x14, 0x14, 0x14, 0x14 },
+    { 0x00, 0x41, 0x22, 0x14, 0x08 }, { 0x02, 0x01, 0x51, 0x09, 0x06 },
+    { 0x32, 0x49, 0x79, 0x41, 0x3E }, { 0x7E, 0x11, 0x11, 0x11, 0x7E },
+    { 0x7F, 0x49, 0x49, 0x49, 0x36 }, { 0x3E, 0x41, 0x41, 0x41, 0x22 },
+    { 0x7F, 0x41, 0x41, 0x22, 0x1C }, { 0x7F, 0x49, 0x49, 0x49, 0x41 },
+    { 0x7F, 0x09, 0x09, 0x09, 0x01 }, { 0x3E, 0x41, 0x49, 0x49, 0x7A },
+    { 0x7F, 0x08, 0x08, 0x08, 0x7F }, { 0x00, 0x41, 0x7F, 0x41, 0x00 },
+    { 0x20, 0x40, 0x41, 0x3F, 0x01 }, { 0x7F, 0x08, 0x14, 0x22, 0x41 },
+    { 0x7F, 0x40, 0x40, 0x40, 0x40 }, { 0x7F, 0x02, 0x0C, 0x02, 0x7F },
+    { 0x7F, 0x04, 0x08, 0x10, 0x7F }, { 0x3E, 0x41, 0x41, 0x41, 0x3E },
+    { 0x7F, 0x09, 0x09, 0x09, 0x06 }, { 0x3E, 0x41, 0x51, 0x21, 0x5E },
+    { 0x7F, 0x09, 0x19, 0x29, 0x46 }, { 0x46, 0x49, 0x49, 0x49, 0x31 },
+    { 0x01, 0x01, 0x7F, 0x01, 0x01 }, { 0x3F, 0x40, 0x40, 0x40, 0x3F },
+    { 0x1F, 0x20, 0x40, 0x20, 0x1F }, { 0x3F, 0x40, 0x38, 0x40, 0x3F },
+    { 0x63, 0x14, 0x08, 0x14, 0x63 }, { 0x07, 0x08, 0x70, 0x08, 0x07 },
+    { 0x61, 0x51, 0x49, 0x45, 0x43 }, { 0x00, 0x7F, 0x41, 0x41, 0x00 },
+    { 0x02, 0x04, 0x08, 0x10, 0x20 }, { 0x00, 0x41, 0x41, 0x7F, 0x00 },
+    { 0x04, 0x02, 0x01, 0x02, 0x04 }, { 0x40, 0x40, 0x40, 0x40, 0x40 },
+    { 0x00, 0x01, 0x02, 0x04, 0x00 }, { 0x20, 0x54, 0x54, 0x54, 0x78 },
+    { 0x7F, 0x48, 0x44, 0x44, 0x38 }, { 0x38, 0x44, 0x44, 0x44, 0x20 },
+    { 0x38, 0x44, 0x44, 0x48, 0x7F }, { 0x38, 0x54, 0x54, 0x54, 0x18 },
+    { 0x08, 0x7E, 0x09, 0x01, 0x02 }, { 0x0C, 0x52, 0x52, 0x52, 0x3E },
+    { 0x7F, 0x08, 0x04, 0x04, 0x78 }, { 0x00, 0x44, 0x7D, 0x40, 0x00 },
+    { 0x20, 0x40, 0x44, 0x3D, 0x00 }, { 0x7F, 0x10, 0x28, 0x44, 0x00 },
+    { 0x00, 0x41, 0x7F, 0x40, 0x00 }, { 0x7C, 0x04, 0x18, 0x04, 0x78 },
+    { 0x7C, 0x08, 0x04, 0x04, 0x78 }, { 0x38, 0x44, 0x44, 0x44, 0x38 },
+    { 0x7C, 0x14, 0x14, 0x14, 0x08 }, { 0x08, 0x14, 0x14, 0x18, 0x7C },
+    { 0x7C, 0x08, 0x04, 0x04, 0x08 }, { 0x48, 0x54, 0x54, 0x54, 0x20 },
+    { 0x04, 0x3F, 0x44, 0x40, 0x20 }, { 0x3C, 0x40, 0x40, 0x20, 0x7C },
+    { 0x1C, 0x20, 0x40, 0x20, 0x1C }, { 0x3C, 0x40, 0x30, 0x40, 0x3C },
+    { 0x44, 0x28, 0x10, 0x28, 0x44 }, { 0x0C, 0x50, 0x50, 0x50, 0x3C },
+    { 0x44, 0x64, 0x54, 0x4C, 0x44 }, { 0x00, 0x08, 0x36, 0x41, 0x00 },
+    { 0x00, 0x00, 0x7F, 0x00, 0x00 }, { 0x00, 0x41, 0x36, 0x08, 0x00 },
+    { 0x08, 0x04, 0x08, 0x10, 0x08 }
+};
+
+struct fglyph_t {
+    unsigned advance;
+    unsigned width;
+    uint8_t *cols;              /* Top of the cell at row 0 */
+};
+
+struct font_t {
+    unsigned height;
+    unsigned count;
+    struct fglyph_t *glyphs;
+    uint16_t *map;              /* Code point to glyph index + 1 */
+    unsigned fallback;
+};
+
+/* Glyphs at a given scale, from a given row */
+struct gcache_t {
+    struct gcache_t *next;
+    const struct font_t *font;
+    unsigned scale;
+    int y;
+    uint8_t **cols;
+};
+
+struct font_t font;
+struct gcache_t *gcaches;
+const char *opt_font = NULL;
+const char *opt_text = NULL;
+
+#define FONT_MAP_SIZE 65536
+
+/*======================================================================
+  Add an empty glyph of the given size to the font
+*/
+static struct fglyph_t *font_add(struct font_t *f, unsigned width,
+        unsigned advance, long code)
+{
+    if (f->count == FONT_MAP_SIZE - 1)
+        return NULL;
+    struct fglyph_t *g = realloc(f->glyphs, (f->count + 1) * sizeof *g);
+    if (!g)
+        return NULL;
+    f->glyphs = g;
+    g += f->count;
+    g->width = width;
+    g->advance = advance;
+    g->cols = calloc(width + 1, IMAGE_ROWS/8);
+    if (!g->cols)
+        return NULL;
+    ++f->count;
+    if (code >= 0 && code < FONT_MAP_SIZE && !f->map[code])
+        f->map[code] = f->count;
+    return g;
+}
+
+static void glyph_set(struct fglyph_t *g, unsigned x, unsigned y)
+{
+    if (x < g->width && y < IMAGE_ROWS)
+        g->cols[x * (IMAGE_ROWS/8) + y/8] |= 1 << (y%8);
+}
+
+/*======================================================================
+  The built-in font
+*/
+int font_builtin(struct font_t *f)
+{
+    unsigned ch;
+    f->height = FONT_H;
+    for (ch = FONT_FIRST; ch <= FONT_LAST; ++ch) {
+        struct fglyph_t *g = font_add(f, FONT_W, FONT_W + 1, ch);
+        if (!g)
+            return 1;
+        unsigned x, y;
+        for (x = 0; x < FONT_W; ++x) {
+            for (y = 0; y < FONT_H; ++y) {
+                if (font5x7[ch - FONT_FIRST][x] & (1 << y))
+                    glyph_set(g, x, y);
+            }
+        }
+    }
+    return 0;
+}
+
+/*======================================================================
+  Decode an UTF-8 character, advancing the pointer
+*/
+static long utf8_next(const uint8_t **s, const uint8_t *end)
+{
+    const uint8_t *p = *s;
+    long cp = *p++;
+    unsigned more = cp >= 0xF0 ? 3 : cp >= 0xE0 ? 2 : cp >= 0xC0 ? 1 : 0;
+    if (more)
+        cp &= 0x3F >> more;
+    while (more-- && p < end && (*p & 0xC0) == 0x80)
+        cp = cp << 6 | (*p++ & 0x3F);
+    *s = p;
+    return cp;
+}
+
+/*======================================================================
+  Load a PSF font, version 1 or 2, with its Unicode table if any
+*/
+static int font_load_psf(struct font_t *f, const uint8_t *buf, size_t len)
+{
+    unsigned count, height, width, charsize, hdr;
+    _Bool table, psf2 = buf[0] == 0x72;
+    if (psf2) {
+        uint32_t v[8];
+        if (len < 32)
+            return 1;
+        memcpy(v, buf, sizeof v);
+        hdr = v[2];
+        table = v[3] & 1;
+        count = v[4];
+        charsize = v[5];
+        height = v[6];
+        width = v[7];
+    } else {
+        if (len < 4)
+            return 1;
+        hdr = 4;
+        table = buf[2] & 0x06;
+        count = buf[2] & 0x01 ? 512 : 256;
+        charsize = height = buf[3];
+        width = 8;
+    }
+    unsigned stride = (width + 7) / 8;
+    if (!height || height > IMAGE_ROWS || !width || width > 64 ||
+            charsize < stride * height || hdr > len ||
+            (len - hdr) / charsize < count)
+        return 1;
+
+    f->height = height;
+    unsigned i, x, y;
+    for (i = 0; i < count; ++i) {
+        const uint8_t *bits = buf + hdr + (size_t)i * charsize;
+        struct fglyph_t *g = font_add(f, width, width, table ? -1 : i);
+        if (!g)
+            return 1;
+        for (y = 0; y < height; ++y) {
+            for (x = 0; x < width; ++x) {
+                if ((bits[y * stride + x/8] << (x%8)) & 0x80)
+                    glyph_set(g, x, y);
+            }
+        }
+    }
+
+    if (table) {
+        const uint8_t *p = buf + hdr + (size_t)count * charsize;
+        const uint8_t *end = buf + len;
+        for (i = 0; i < count && p < end; ++i) {
+            _Bool seq = false;
+            if (psf2) {
+                while (p < end && *p != 0xFF) {
+                    if (*p == 0xFE) {
+                        seq = true;
+                        ++p;
+                        continue;
+                    }
+                    long cp = utf8_next(&p, end);
+                    if (!seq && cp < FONT_MAP_SIZE && !f->map[cp])
+                        f->map[cp] = i + 1;
+                }
+                ++p;
+            } else {
+                while (p + 1 < end) {
+                    unsigned cp = p[0] | p[1] << 8;
+                    p += 2;
+                    if (cp == 0xFFFF)
+                        break;
+                    if (cp == 0xFFFE)
+                        seq = true;
+                    else if (!seq && !f->map[cp])
+                        f->map[cp] = i + 1;
+                }
+            }
+        }
+    }
+    return 0;
+}
+
+/*======================================================================
+  Load a BDF font
+*/
+static int font_load_bdf(struct font_t *f, FILE *in)
+{
+    char line[256];
+    int ascent = -1, descent = -1, bbh = 0, bbyo = 0;
+    long code = -1;
+    int dwidth = 0, w = 0, h = 0, xo = 0, yo = 0, row = -1;
+    struct fglyph_t *g = NULL;
+
+    while (fgets(line, sizeof line, in)) {
+        int a, b, c, d;
+        if (row >= 0) {
+            if (strncmp(line, "ENDCHAR", 7) == 0) {
+                row = -1;
+                continue;
+            }
+            /* Rows from the top of the box, which sits yo above the
+               baseline */
+            int y = ascent - (yo + h) + row++;
+            unsigned long bits = strtoul(line, NULL, 16);
+            int nbits = strspn(line, "0123456789abcdefABCDEF") * 4;
+            int x;
+            for (x = 0; x < w && x < nbits; ++x) {
+                if (y >= 0 && y < (int)f->height &&
+                        (bits >> (nbits - 1 - x)) & 1)
+                    glyph_set(g, xo + x, y);
+            }
+        } else if (sscanf(line, "FONTBOUNDINGBOX %d %d %d %d",
+                    &a, &bbh, &c, &bbyo) == 4) {
+            continue;
+        } else if (sscanf(line, "FONT_ASCENT %d", &a) == 1) {
+            ascent = a;
+        } else if (sscanf(line, "FONT_DESCENT %d", &a) == 1) {
+            descent = a;
+        } else if (sscanf(line, "ENCODING %ld", &code) == 1) {
+            continue;
+        } else if (sscanf(line, "DWIDTH %d", &dwidth) == 1) {
+            continue;
+        } else if (sscanf(line, "BBX %d %d %d %d", &a, &b, &c, &d) == 4) {
+            w = a;
+            h = b;
+            xo = c < 0 ? 0 : c;
+            yo = d;
+        } else if (strncmp(line, "BITMAP", 6) == 0) {
+            if (ascent < 0 || descent < 0) {
+                ascent = bbh + bbyo;
+                descent = -bbyo;
+            }
+            f->height = ascent + descent;
+            if (!f->height || f->height > IMAGE_ROWS || w > 64)
+                return 1;
+            unsigned width = xo + w > dwidth ? xo + w : dwidth;
+            g = font_add(f, width, dwidth, code);
+            if (!g)
+                return 1;
+            row = 0;
+            code = -1;
+        }
+    }
+    return !f->count;
+}
+
+/*======================================================================
+  Load the font given with -f, or the built-in one
+*/
+int font_load(const char *path)
+{
+    font.map = calloc(FONT_MAP_SIZE, sizeof *font.map);
+    if (!font.map) {
+        fputs("malloc failed\n", stderr);
+        return 1;
+    }
+    int rc;
+    if (!path) {
+        rc = font_builtin(&font);
+    } else {
+        FILE *in = fopen(path, "rb");
+        if (!in) {
+            perror(path);
+            return 1;
+        }
+        uint8_t buf[4] = { 0 };
+        rc = fread(buf, 1, sizeof buf, in) < 2;
+        rewind(in);
+        if (!rc && ((buf[0] == 0x36 && buf[1] == 0x04) ||
+                    (buf[0] == 0x72 && buf[1] == 0xb5 &&
+                     buf[2] == 0x4a && buf[3] == 0x86))) {
+            size_t len = 0, size = 0;
+            uint8_t *data = NULL;
+            for (;;) {
+                if (len == size) {
+                    size = size ? size * 2 : 65536;
+                    uint8_t *p = realloc(data, size);
+                    if (!p)
+                        break;
+                    data = p;
+                }
+                size_t n = fread(data + len, 1, size - len, in);
+                if (!n)
+                    break;
+                len += n;
+            }
+            rc = !data || font_load_psf(&font, data, len);
+            free(data);
+        } else if (!rc) {
+            rc = font_load_bdf(&font, in);
+        }
+        fclose(in);
+        if (rc)
+            fprintf(stderr, "%s: not a usable BDF or PSF font\n", path);
+    }
+    font.fallback = font.map['?'] ? font.map['?'] - 1 : 0;
+    return rc;
+}
+
+/*======================================================================
+  A glyph scaled and moved down to row y, from the cache
+*/
+const uint8_t *gcache_glyph(struct gcache_t *gc, unsigned i)
+{
+    if (gc->cols[i])
+        return gc->cols[i];
+    const struct fglyph_t *g = &gc->font->glyphs[i];
+    unsigned width = g->width * gc->scale;
+    uint8_t *cols = calloc(width + 1, IMAGE_ROWS/8);
+    if (!cols)
+        return NULL;
+    unsigned x, y, s;
+    for (x = 0; x < g->width; ++x) {
+        const uint8_t *src = g->cols + x * (IMAGE_ROWS/8);
+        for (y = 0; y < gc->font->height; ++y) {
+            if (!(src[y/8] & (1 << (y%8))))
+                continue;
+            for (s = 0; s < gc->scale; ++s) {
+                int row = gc->y + (int)(y * gc->scale + s);
+                if (row < 0 || row >= IMAGE_ROWS)
+                    continue;
+                unsigned sx;
+                for (sx = 0; sx < gc->scale; ++sx)
+                    cols[(x * gc->scale + sx) * (IMAGE_ROWS/8) + row/8] |=
+                        1 << (row%8);
+            }
+        }
+    }
+    gc->cols[i] = cols;
+    return cols;
+}
+
+struct gcache_t *gcache_get(const struct font_t *f, unsigned scale, int y)
+{
+    struct gcache_t *gc;
+    for (gc = gcaches; gc; gc = gc->next) {
+        if (gc->font == f && gc->scale == scale && gc->y == y)
+            return gc;
+    }
+    gc = calloc(1, sizeof *gc);
+    if (!gc || !(gc->cols = calloc(f->count, sizeof *gc->cols))) {
+        free(gc);
+        return NULL;
+    }
+    gc->font = f;
+    gc->scale = scale;
+    gc->y = y;
+    gc->next = gcaches;
+    gcaches = gc;
+    return gc;
+}
+
+/*======================================================================
+  Glyph of a code point
+*/
+static unsigned font_glyph(const struct font_t *f, long cp)
+{
+    return cp >= 0 && cp < FONT_MAP_SIZE && f->map[cp] ?
+        f->map[cp] - 1 : f->fallback;
+}
+
+/*======================================================================
+  Render text (lines separated by newlines) to the pattern, magnified
+  as much as the printable height of the tape allows
+*/
+int text_image(const char *text)
+{
+    if (!font.count && font_load(opt_font))
+        return 1;
+
+    const uint8_t *s = (const uint8_t *)text, *end = s + strlen(text);
+    unsigned lines = 1, rows = tape_rows(opt_tape);
+    const uint8_t *p;
+    for (p = s; p < end; ++p)
+        lines += *p == '\n';
+    unsigned scale = rows / (lines * font.height);
+    if (!scale) {
+        fputs("WARNING: Text taller than the tape\n", stderr);
+        scale = 1;
+    }
+    int top = ((int)IMAGE_ROWS - (int)(lines * font.height * scale)) / 2;
+
+    /* Length: the longest line */
+    unsigned width = 0, x = 0;
+    for (p = s; p < end; ) {
+        if (*p == '\n') {
+            x = 0;
+            ++p;
+            continue;
+        }
+        const struct fglyph_t *g = &font.glyphs[font_glyph(&font,
+                utf8_next(&p, end))];
+        unsigned right = (x + g->width) * scale;
+        if (right > width)
+            width = right;
+        x += g->advance;
+    }
+    if (!width) {
+        fputs("Nothing to print\n", stderr);
+        return 1;
+    }
+
+    pattern_size = width * (IMAGE_ROWS/8);
+    pattern = calloc(1, pattern_size);
+    if (!pattern) {
+        fputs("malloc failed\n", stderr);
+        return 1;
+    }
+    image_w = width;
+
+    unsigned line = 0;
+    x = 0;
+    for (p = s; p < end; ) {
+        if (*p == '\n') {
+            ++line;
+            x = 0;
+            ++p;
+            continue;
+        }
+        unsigned i = font_glyph(&font, utf8_next(&p, end));
+        struct gcache_t *gc = gcache_get(&font, scale,
+                top + (int)(line * font.height * scale));
+        const uint8_t *cols = gc ? gcache_glyph(gc, i) : NULL;
+        if (!cols) {
+            fputs("malloc failed\n", stderr);
+            return 1;
+        }
+        const struct fglyph_t *g = &font.glyphs[i];
+        rop_blit(pattern, width, x, cols, g->width * scale, ROP_OR);
+        x += g->advance * scale;
+    }
+    return 0;
+}
+
+/*======================================================================
+  2D codes: QR (byte mode, versions up to 27, which fit the head at one
+  dot a module) and Data Matrix (ECC 200, square, up to 52x52). The
+  symbol matrices are cached by payload, so that a repeated payload
+  skips the encoding
+*/
+struct gf_t {
+    uint8_t exp[512];
+    uint8_t log[256];
+};
+
+static struct gf_t gf_qr, gf_dm;
+
+static void gf_init(struct gf_t *gf, unsigned poly)
+{
+    unsigned x = 1, i;
+    for (i = 0; i < 255; ++i) {
+        gf->exp[i] = gf->exp[i + 255] = x;
+        gf->log[x] = i;
+        x <<= 1;
+        if (x & 0x100)
+            x ^= poly;
+    }
+}
+
+static uint8_t gf_mul(const struct gf_t *gf, uint8_t a, uint8_t b)
+{
+    return a && b ? gf->exp[gf->log[a] + gf->log[b]] : 0;
+}
+
+/*======================================================================
+  Reed-Solomon check codewords; the generator roots are the powers of
+  alpha from first
+*/
+static void rs_encode(const struct gf_t *gf, unsigned first,
+        const uint8_t *data, unsigned n, uint8_t *ecc, unsigned necc)
+{
+    uint8_t gen[256] = { 1 };
+    unsigned i, j;
+    for (i = 0; i < necc; ++i) {
+        uint8_t root = gf->exp[(i + first) % 255];
+        for (j = i + 1; j > 0; --j)
+            gen[j] ^= gf_mul(gf, gen[j - 1], root);
+    }
+    memset(ecc, 0, necc);
+    for (i = 0; i < n; ++i) {
+        uint8_t coef = data[i] ^ ecc[0];
+        memmove(ecc, ecc + 1, necc - 1);
+        ecc[necc - 1] = 0;
+        for (j = 0; j < necc; ++j)
+            ecc[j] ^= gf_mul(gf, gen[j + 1], coef);
+    }
+}
+
+#define MATRIX_MAX 128
+#define QR_VERSION_MAX 27
+
+/* By level L, M, Q, H and version */
+static const int8_t qr_ecc_len[4][41] = {
+    { -1, 7, 10, 15, 20, 26, 18, 20, 24, 30, 18, 20, 24, 26, 30, 22, 24,
+      28, 30, 28, 28, 28, 28, 30, 30, 26, 28, 30, 30, 30, 30, 30, 30, 30,
+      30, 30, 30, 30, 30, 30, 30 },
+    { -1, 10, 16, 26, 18, 24, 16, 18, 22, 22, 26, 30, 22, 22, 24, 24, 28,
+      28, 26, 26, 26, 26, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+      28, 28, 28, 28, 28, 28, 28 },
+    { -1, 13, 22, 18, 26, 18, 24, 18, 22, 20, 24, 28, 26, 24, 20, 30, 24,
+      28, 28, 26, 30, 28, 30, 30, 30, 30, 28, 30, 30, 30, 30, 30, 30, 30,
+      30, 30, 30, 30, 30, 30, 30 },
+    { -1, 17, 28, 22, 16, 22, 28, 26, 26, 24, 28, 24, 28, 22, 24, 24, 30,
+      28, 28, 26, 28, 30, 24, 30, 30, 30, 30, 30, 30, 30, 30, 30, 30, 30,
+      30, 30, 30, 30, 30, 30, 30 }
+};
+
+static const int8_t qr_ecc_blocks[4][41] = {
+    { -1, 1, 1, 1, 1, 1, 2, 2, 2, 2, 4, 4, 4, 4, 4, 6, 6, 6, 6, 7, 8, 8,
+      9, 9, 10, 12, 12, 12, 13, 14, 15, 16, 17, 18, 19, 19, 20, 21, 22,
+      24, 25 },
+    { -1, 1, 1, 1, 2, 2, 4, 4, 4, 5, 5, 5, 8, 9, 9, 10, 10, 11, 13, 14,
+      16, 17, 17, 18, 20, 21, 23, 25, 26, 28, 29, 31, 33, 35, 37, 38, 40,
+      43, 45, 47, 49 },
+    { -1, 1, 1, 2, 2, 4, 4, 6, 6, 8, 8, 8, 10, 12, 16, 12, 17, 16, 18, 21,
+      20, 23, 23, 25, 27, 29, 34, 34, 35, 38, 40, 43, 45, 48, 51, 53, 56,
+      59, 62, 65, 68 },
+    { -1, 1, 1, 2, 4, 4, 4, 5, 6, 8, 8, 11, 11, 16, 16, 18, 16, 19, 21,
+      25, 25, 25, 34, 30, 32, 35, 37, 40, 42, 45, 48, 51, 54, 57, 60, 63,
+      66, 70, 74, 77, 81 }
+};
+
+/* Format information code of each level */
+static const uint8_t qr_ecl_bits[4] = { 1, 0, 3, 2 };
+
+struct qr_t {
+    unsigned size;
+    uint8_t *m;
+    uint8_t fn[MATRIX_MAX * MATRIX_MAX];   /* Function modules */
+};
+
+static unsigned qr_raw_modules(unsigned ver)
+{
+    unsigned raw = (16 * ver + 128) * ver + 64;
+    if (ver >= 2) {
+        unsigned n = ver / 7 + 2;
+        raw -= (25 * n - 10) * n - 55;
+        if (ver >= 7)
+            raw -= 36;
+    }
+    return raw;
+}
+
+static void qr_set(struct qr_t *q, unsigned x, unsigned y, _Bool dark)
+{
+    q->m[y * q->size + x] = dark;
+    q->fn[y * q->size + x] = 1;
+}
+
+static void qr_format(struct qr_t *q, int ecl, unsigned mask)
+{
+    unsigned data = qr_ecl_bits[ecl] << 3 | mask, rem = data, i;
+    for (i = 0; i < 10; ++i)
+        rem = (rem << 1) ^ ((rem >> 9) * 0x537);
+    unsigned bits = (data << 10 | rem) ^ 0x5412, n = q->size;
+#define BIT(i) ((bits >> (i)) & 1)
+    for (i = 0; i <= 5; ++i)
+        qr_set(q, 8, i, BIT(i));
+    qr_set(q, 8, 7, BIT(6));
+    qr_set(q, 8, 8, BIT(7));
+    qr_set(q, 7, 8, BIT(8));
+    for (i = 9; i < 15; ++i)
+        qr_set(q, 14 - i, 8, BIT(i));
+    for (i = 0; i < 8; ++i)
+        qr_set(q, n - 1 - i, 8, BIT(i));
+    for (i = 8; i < 15; ++i)
+        qr_set(q, 8, n - 15 + i, BIT(i));
+#undef BIT
+    qr_set(q, 8, n - 8, 1);
+}
+
+static void qr_function_patterns(struct qr_t *q, unsigned ver)
+{
+    unsigned n = q->size, i, j;
+    int dx, dy;
+    for (i = 0; i < n; ++i) {
+        qr_set(q, 6, i, i % 2 == 0);
+        qr_set(q, i, 6, i % 2 == 0);
+    }
+    const unsigned fx[3] = { 3, n - 4, 3 }, fy[3] = { 3, 3, n - 4 };
+    for (i = 0; i < 3; ++i) {
+        for (dy = -4; dy <= 4; ++dy) {
+            for (dx = -4; dx <= 4; ++dx) {
+                int x = fx[i] + dx, y = fy[i] + dy;
+                int d = abs(dx) > abs(dy) ? abs(dx) : abs(dy);
+                if (x >= 0 && x < (int)n && y >= 0 && y < (int)n)
+                    qr_set(q, x, y, d != 2 && d != 4);
+            }
+        }
+    }
+    if (ver >= 2) {
+        unsigned na = ver / 7 + 2;
+        unsigned step = (ver * 4 + na * 2 + 1) / (na * 2 - 2) * 2;
+        unsigned pos[7];
+        pos[0] = 6;
+        for (i = na - 1, j = n - 7; i >= 1; --i, j -= step)
+            pos[i] = j;
+        for (i = 0; i < na; ++i) {
+            for (j = 0; j < na; ++j) {
+                if ((i == 0 && j == 0) || (i == 0 && j == na - 1) ||
+                        (i == na - 1 && j == 0))
+                    continue;
+                for (dy = -2; dy <= 2; ++dy) {
+                    for (dx = -2; dx <= 2; ++dx) {
+                        int d = abs(dx) > abs(dy) ? abs(dx) : abs(dy);
+                        qr_set(q, pos[i] + dx, pos[j] + dy, d != 1);
+                    }
+                }
+            }
+        }
+    }
+    qr_format(q, 0, 0);
+    if (ver >= 7) {
+        unsigned rem = ver;
+        for (i = 0; i < 12; ++i)
+            rem = (rem << 1) ^ ((rem >> 11) * 0x1F25);
+        unsigned bits = ver << 12 | rem;
+        for (i = 0; i < 18; ++i) {
+            unsigned a = n - 11 + i % 3, b = i / 3;
+            qr_set(q, a, b, (bits >> i) & 1);
+            qr_set(q, b, a, (bits >> i) & 1);
+        }
+    }
+}
+
+static _Bool qr_mask_bit(unsigned mask, unsigned x, unsigned y)
+{
+    switch (mask) {
+    case 0: return (x + y) % 2 == 0;
+    case 1: return y % 2 == 0;
+    case 2: return x % 3 == 0;
+    case 3: return (x + y) % 3 == 0;
+    case 4: return (x / 3 + y / 2) % 2 == 0;
+    case 5: return x * y % 2 + x * y % 3 == 0;
+    case 6: return (x * y % 2 + x * y % 3) % 2 == 0;
+    default: return ((x + y) % 2 + x * y % 3) % 2 == 0;
+    }
+}
+
+static void qr_apply_mask(struct qr_t *q, unsigned mask)
+{
+    unsigned x, y;
+    for (y = 0; y < q->size; ++y) {
+        for (x = 0; x < q->size; ++x) {
+            if (!q->fn[y * q->size + x] && qr_mask_bit(mask, x, y))
+                q->m[y * q->size + x] ^= 1;
+        }
+    }
+}
+
+/*======================================================================
+  Penalty of a masked symbol: long runs, 2x2 blocks, finder-like
+  patterns and unbalanced dark modules
+*/
+static long qr_penalty(const struct qr_t *q)
+{
+    static const uint8_t finder[2][11] = {
+        { 1, 0, 1, 1, 1, 0, 1, 0, 0, 0, 0 },
+        { 0, 0, 0, 0, 1, 0, 1, 1, 1, 0, 1 }
+    };
+    unsigned n = q->size, i, j, k, dark = 0;
+    long score = 0;
+    int dir;
+    for (dir = 0; dir < 2; ++dir) {
+        for (i = 0; i < n; ++i) {
+#define AT(j) (dir ? q->m[(j) * n + i] : q->m[i * n + (j)])
+            unsigned run = 1;
+            for (j = 1; j <= n; ++j) {
+                if (j < n && AT(j) == AT(j - 1)) {
+                    ++run;
+                    continue;
+                }
+                if (run >= 5)
+                    score += 3 + run - 5;
+                run = 1;
+            }
+            for (j = 0; j + 11 <= n; ++j) {
+                unsigned f;
+                for (f = 0; f < 2; ++f) {
+                    for (k = 0; k < 11 && AT(j + k) == finder[f][k]; ++k)
+                        ;
+                    if (k == 11)
+                        score += 40;
+                }
+            }
+#undef AT
+        }
+    }
+    for (i = 0; i < n; ++i) {
+        for (j = 0; j < n; ++j) {
+            uint8_t c = q->m[i * n + j];
+            dark += c;
+            if (i + 1 < n && j + 1 < n && c == q->m[i * n + j + 1] &&
+                    c == q->m[(i + 1) * n + j] &&
+                    c == q->m[(i + 1) * n + j + 1])
+                score += 3;
+        }
+    }
+    long total = n * n;
+    long k20 = labs((long)dark * 20 - total * 10);
+    score += ((k20 + total - 1) / total - 1) * 10;
+    return score;
+}
+
+/*======================================================================
+  Encode a QR symbol in byte mode, in the smallest version that fits
+*/
+int qr_encode(const uint8_t *data, size_t len, int ecl, uint8_t *m,
+        unsigned *size)
+{
+    unsigned ver, capacity = 0;
+    for (ver = 1; ver <= QR_VERSION_MAX; ++ver) {
+        capacity = qr_raw_modules(ver) / 8 -
+            qr_ecc_len[ecl][ver] * qr_ecc_blocks[ecl][ver];
+        if (4 + (ver < 10 ? 8 : 16) + 8 * len <= capacity * 8)
+            break;
+    }
+    if (ver > QR_VERSION_MAX)
+        return 1;
+
+    /* Data codewords */
+    uint8_t cw[4096] = { 0 };
+    unsigned bit = 0, i, j;
+#define PUT(v, nbits) do { \
+        for (j = (nbits); j-- > 0; ++bit) \
+            cw[bit >> 3] |= (((v) >> j) & 1) << (7 - (bit & 7)); \
+    } while (0)
+    PUT(4, 4);
+    PUT(len, ver < 10 ? 8 : 16);
+    for (i = 0; i < len; ++i)
+        PUT(data[i], 8);
+    unsigned term = capacity * 8 - bit;
+    bit += term < 4 ? term : 4;
+    bit = (bit + 7) & ~7u;
+#undef PUT
+    for (i = bit / 8; i < capacity; ++i)
+        cw[i] = (i - bit / 8) & 1 ? 0x11 : 0xEC;
+
+    /* Blocks with their check codewords, interleaved */
+    unsigned nblocks = qr_ecc_blocks[ecl][ver];
+    unsigned necc = qr_ecc_len[ecl][ver];
+    unsigned raw = qr_raw_modules(ver) / 8;
+    unsigned nshort = nblocks - raw % nblocks;
+    unsigned short_len = raw / nblocks;
+    uint8_t blocks[81][160], out[4096];
+    unsigned k = 0, b;
+    for (b = 0; b < nblocks; ++b) {
+        unsigned dlen = short_len - necc + (b >= nshort);
+        memcpy(blocks[b], cw + k, dlen);
+        rs_encode(&gf_qr, 0, cw + k, dlen, blocks[b] + short_len + 1 - necc,
+                necc);
+        if (b < nshort)
+            blocks[b][dlen] = 0;
+        k += dlen;
+    }
+    k = 0;
+    for (i = 0; i <= short_len; ++i) {
+        for (b = 0; b < nblocks; ++b) {
+            if (i != short_len - necc || b >= nshort)
+                out[k++] = blocks[b][i];
+        }
+    }
+
+    /* Placement, in pairs of columns, up and down */
+    static struct qr_t q;
+    q.size = 4 * ver + 17;
+    q.m = m;
+    memset(m, 0, q.size * q.size);
+    memset(q.fn, 0, sizeof q.fn);
+    qr_function_patterns(&q, ver);
+    unsigned n = q.size, vert, idx = 0;
+    int right;
+    for (right = n - 1; right >= 1; right -= 2) {
+        if (right == 6)
+            right = 5;
+        for (vert = 0; vert < n; ++vert) {
+            for (j = 0; j < 2; ++j) {
+                unsigned x = right - j;
+                _Bool up = ((right + 1) & 2) == 0;
+                unsigned y = up ? n - 1 - vert : vert;
+                if (!q.fn[y * n + x] && idx < raw * 8) {
+                    m[y * n + x] = (out[idx >> 3] >> (7 - (idx & 7))) & 1;
+                    ++idx;
+                }
+            }
+        }
+    }
+
+    unsigned mask, best = 0;
+    long min = -1;
+    for (mask = 0; mask < 8; ++mask) {
+        qr_apply_mask(&q, mask);
+        qr_format(&q, ecl, mask);
+        long p = qr_penalty(&q);
+        if (min < 0 || p < min) {
+            min = p;
+            best = mask;
+        }
+        qr_apply_mask(&q, mask);
+    }
+    qr_apply_mask(&q, best);
+    qr_format(&q, ecl, best);
+    *size = n;
+    return 0;
+}
+
+/* Data Matrix square symbols that fit the head */
+static const struct {
+    uint8_t size;
+    uint8_t data;
+    uint8_t ecc;
+    uint8_t regions;            /* Along each side */
+    uint8_t blocks;
+} dm_sizes[] = {
+    { 10, 3, 5, 1, 1 }, { 12, 5, 7, 1, 1 }, { 14, 8, 10, 1, 1 },
+    { 16, 12, 12, 1, 1 }, { 18, 18, 14, 1, 1 }, { 20, 22, 18, 1, 1 },
+    { 22, 30, 20, 1, 1 }, { 24, 36, 24, 1, 1 }, { 26, 44, 28, 1, 1 },
+    { 32, 62, 36, 2, 1 }, { 36, 86, 42, 2, 1 }, { 40, 114, 48, 2, 1 },
+    { 44, 144, 56, 2, 1 }, { 48, 174, 68, 2, 1 }, { 52, 204, 84, 2, 2 }
+};
+
+/* Placement of the codeword bits in the mapping matrix */
+struct dm_place_t {
+    int nrow, ncol;
+    uint16_t *array;            /* 10 * codeword + bit, 1 dark */
+};
+
+static void dm_module(struct dm_place_t *p, int row, int col, int chr,
+        int bit)
+{
+    if (row < 0) {
+        row += p->nrow;
+        col += 4 - ((p->nrow + 4) % 8);
+    }
+    if (col < 0) {
+        col += p->ncol;
+        row += 4 - ((p->ncol + 4) % 8);
+    }
+    p->array[row * p->ncol + col] = 10 * chr + bit;
+}
+
+static void dm_utah(struct dm_place_t *p, int row, int col, int chr)
+{
+    dm_module(p, row - 2, col - 2, chr, 1);
+    dm_module(p, row - 2, col - 1, chr, 2);
+    dm_module(p, row - 1, col - 2, chr, 3);
+    dm_module(p, row - 1, col - 1, chr, 4);
+    dm_module(p, row - 1, col, chr, 5);
+    dm_module(p, row, col - 2, chr, 6);
+    dm_module(p, row, col - 1, chr, 7);
+    dm_module(p, row, col, chr, 8);
+}
+
+static void dm_corner(struct dm_place_t *p, int which, int chr)
+{
+    /* Row and column of the eight bits of the four corner cases */
+    static const int8_t c[4][8][2] = {
+        { { -1, 0 }, { -1, 1 }, { -1, 2 }, { 0, -2 }, { 0, -1 }, { 1, -1 },
+          { 2, -1 }, { 3, -1 } },
+        { { -3, 0 }, { -2, 0 }, { -1, 0 }, { 0, -4 }, { 0, -3 }, { 0, -2 },
+          { 0, -1 }, { 1, -1 } },
+        { { -3, 0 }, { -2, 0 }, { -1, 0 }, { 0, -2 }, { 0, -1 }, { 1, -1 },
+          { 2, -1 }, { 3, -1 } },
+        { { -1, 0 }, { -1, -1 }, { 0, -3 }, { 0, -2 }, { 0, -1 }, { 1, -3 },
+          { 1, -2 }, { 1, -1 } }
+    };
+    int i;
+    for (i = 0; i < 8; ++i) {
+        int r = c[which][i][0], col = c[which][i][1];
+        dm_module(p, r < 0 ? p->nrow + r : r, col < 0 ? p->ncol + col : col,
+                chr, i + 1);
+    }
+}
+
+static void dm_place(struct dm_place_t *p)
+{
+    int row = 4, col = 0, chr = 1;
+    int nrow = p->nrow, ncol = p->ncol;
+    do {
+        if (row == nrow && col == 0)
+            dm_corner(p, 0, chr++);
+        if (row == nrow - 2 && col == 0 && ncol % 4)
+            dm_corner(p, 1, chr++);
+        if (row == nrow - 2 && col == 0 && ncol % 8 == 4)
+            dm_corner(p, 2, chr++);
+        if (row == nrow + 4 && col == 2 && !(ncol % 8))
+            dm_corner(p, 3, chr++);
+        do {
+            if (row < nrow && col >= 0 && !p->array[row * ncol + col])
+                dm_utah(p, row, col, chr++);
+            row -= 2;
+            col += 2;
+        } while (row >= 0 && col < ncol);
+        row += 1;
+        col += 3;
+        do {
+            if (row >= 0 && col < ncol && !p->array[row * ncol + col])
+                dm_utah(p, row, col, chr++);
+            row += 2;
+            col -= 2;
+        } while (row < nrow && col >= 0);
+        row += 3;
+        col += 1;
+    } while (row < nrow || col < ncol);
+    /* Fixed pattern in the corner left untouched by some sizes */
+    if (!p->array[nrow * ncol - 1])
+        p->array[nrow * ncol - 1] = p->array[nrow * ncol - ncol - 2] = 1;
+}
+
+/*======================================================================
+  Encode a Data Matrix symbol in ASCII encodation (digit pairs
+  compacted), in the smallest square size that fits
+*/
+int dm_encode(const uint8_t *data, size_t len, uint8_t *m, unsigned *size)
+{
+    uint8_t cw[256 + 84 * 2];
+    unsigned n = 0, i;
+    for (i = 0; i < len; ++i) {
+        /* Upper half characters take the 235 shift too */
+        if (n + (data[i] < 128 ? 1 : 2) > 204)
+            break;
+        if (isdigit(data[i]) && i + 1 < len && isdigit(data[i + 1])) {
+            cw[n++] = 130 + (data[i] - '0') * 10 + data[i + 1] - '0';
+            ++i;
+        } else if (data[i] < 128) {
+            cw[n++] = data[i] + 1;
+        } else {
+            cw[n++] = 235;
+            cw[n++] = data[i] - 127;
+        }
+    }
+    unsigned s;
+    for (s = 0; s < sizeof dm_sizes / sizeof *dm_sizes; ++s) {
+        if (dm_sizes[s].data >= n)
+            break;
+    }
+    if (i < len || s == sizeof dm_sizes / sizeof *dm_sizes)
+        return 1;
+
+    unsigned ndata = dm_sizes[s].data, necc = dm_sizes[s].ecc;
+    unsigned nblocks = dm_sizes[s].blocks;
+    for (i = n; i < ndata; ++i) {
+        if (i == n) {
+            cw[i] = 129;
+        } else {
+            unsigned pad = 129 + (149 * (i + 1)) % 253 + 1;
+            cw[i] = pad > 254 ? pad - 254 : pad;
+        }
+    }
+    unsigned b;
+    for (b = 0; b < nblocks; ++b) {
+        uint8_t bd[256], be[128];
+        unsigned bn = 0, be_n = necc / nblocks;
+        for (i = b; i < ndata; i += nblocks)
+            bd[bn++] = cw[i];
+        rs_encode(&gf_dm, 1, bd, bn, be, be_n);
+        for (i = 0; i < be_n; ++i)
+            cw[ndata + i * nblocks + b] = be[i];
+    }
+
+    /* Codeword bits in the mapping matrix, then regions with their
+       finder and clock borders in the symbol */
+    unsigned sz = dm_sizes[s].size, reg = dm_sizes[s].regions;
+    unsigned rsz = sz / reg - 2;
+    static uint16_t array[MATRIX_MAX * MATRIX_MAX];
+    struct dm_place_t p = { rsz * reg, rsz * reg, array };
+    memset(array, 0, sizeof array);
+    dm_place(&p);
+
+    memset(m, 0, sz * sz);
+    unsigned r, c;
+    for (r = 0; r < sz; ++r) {
+        for (c = 0; c < sz; ++c) {
+            unsigned lr = r % (rsz + 2), lc = c % (rsz + 2);
+            _Bool dark;
+            if (lc == 0 || lr == rsz + 1) {
+                dark = 1;
+            } else if (lr == 0) {
+                dark = lc % 2 == 0;
+            } else if (lc == rsz + 1) {
+                dark = lr % 2 == 1;
+            } else {
+                unsigned v = array[((r / (rsz + 2)) * rsz + lr - 1) * p.ncol +
+                    (c / (rsz + 2)) * rsz + lc - 1];
+                dark = v == 1 || (v >= 10 &&
+                        ((cw[v / 10 - 1] >> (8 - v % 10)) & 1));
+            }
+            m[r * sz + c] = dark;
+        }
+    }
+    *size = sz;
+    return 0;
+}
+
+/*======================================================================
+  Symbol cache, by type and payload, least recently used out; shared
+  by the render threads
+*/
+struct mcache_t {
+    struct mcache_t *next;
+    int type;
+    char *data;
+    unsigned size;
+    uint8_t *m;
+};
+
+#define MCACHE_MAX 64
+
+struct mcache_t *mcache;
+unsigned mcache_count;
+unsigned long mcache_hits, mcache_misses;
+pthread_mutex_t mcache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*======================================================================
+  Get the matrix of a 2D symbol (type is the QR level 0-3 or 4 for Data
+  Matrix) into m
+*/
+int matrix_encode(int type, const char *data, uint8_t *m, unsigned *size)
+{
+    pthread_mutex_lock(&mcache_lock);
+    struct mcache_t **pp, *e;
+    for (pp = &mcache; (e = *pp); pp = &e->next) {
+        if (e->type == type && strcmp(e->data, data) == 0)
+            break;
+    }
+    int rc = 0;
+    if (e) {
+        *pp = e->next;
+        ++mcache_hits;
+    } else {
+        if (!gf_qr.exp[0]) {
+            gf_init(&gf_qr, 0x11D);
+            gf_init(&gf_dm, 0x12D);
+        }
+        ++mcache_misses;
+        rc = type < 4 ?
+            qr_encode((const uint8_t *)data, strlen(data), type, m, size) :
+            dm_encode((const uint8_t *)data, strlen(data), m, size);
+        if (!rc && (e = calloc(1, sizeof *e))) {
+            e->type = type;
+            e->size = *size;
+            e->data = strdup(data);
+            e->m = malloc(*size * *size);
+            if (!e->data || !e->m) {
+                free(e->data);
+                free(e->m);
+                free(e);
+                e = NULL;
+            } else {
+                memcpy(e->m, m, *size * *size);
+                ++mcache_count;
+            }
+        }
+    }
+    if (e) {
+        e->next = mcache;
+        mcache = e;
+        *size = e->size;
+        memcpy(m, e->m, e->size * e->size);
+        if (mcache_count > MCACHE_MAX) {
+            for (pp = &mcache; (*pp)->next; pp = &(*pp)->next)
+                ;
+            free((*pp)->data);
+            free((*pp)->m);
+            free(*pp);
+            *pp = NULL;
+            --mcache_count;
+        }
+    }
+    pthread_mutex_unlock(&mcache_lock);
+    return rc;
+}
+
+/*======================================================================
+  Barcodes. Along the tape every module is one or more whole columns,
+  so a 1D symbol is encoded as the widths of its bars and spaces (in
+  modules, starting with a bar) and drawn as runs of one column. A 2D
+  symbol is its matrix of modules, each a square of whole dots
+*/
+enum BARCODE_T {
+    BARCODE_CODE128,
+    BARCODE_EAN13,
+    BARCODE_CODE39,
+    BARCODE_QR,
+    BARCODE_DATAMATRIX
+};
+
+#define BARS_MAX 2048
+
+struct barcode_t {
+    enum BARCODE_T type;
+    unsigned module;            /* Dots */
+    unsigned count;
+    uint8_t runs[BARS_MAX];
+    int level;                  /* QR error correction, 0-3 for L-H */
+    unsigned size;              /* Modules along a side of a 2D symbol */
+    uint8_t matrix[MATRIX_MAX * MATRIX_MAX];
+};
+
+const char *opt_barcode = NULL;
+
+/* Bar/space widths of each symbol, start A/B/C as 103-105, then stop */
+static const char *const code128[] = {
+    "212222", "222122", "222221", "121223", "121322", "131222", "122213",
+    "122312", "132212", "221213", "221312", "231212", "112232", "122132",
+    "122231", "113222", "123122", "123221", "223211", "221132", "221231",
+    "213212", "223112", "312131", "311222", "321122", "321221", "312212",
+    "322112", "322211", "212123", "212321", "232121", "111323", "131123",
+    "131321", "112313", "132113", "132311", "211313", "231113", "231311",
+    "112133", "112331", "132131", "113123", "113321", "133121", "313121",
+    "211331", "231131", "213113", "213311", "213131", "311123", "311321",
+    "331121", "312113", "312311", "332111", "314111", "221411", "431111",
+    "111224", "111422", "121124", "121421", "141122", "141221", "112214",
+    "112412", "122114", "122411", "142112", "142211", "241211", "221114",
+    "413111", "241112", "134111", "111242", "121142", "121241", "114212",
+    "124112", "124211", "411212", "421112", "421211", "212141", "214121",
+    "412121", "111143", "111341", "131141", "114113", "114311", "411113",
+    "411311", "113141", "114131", "311141", "411131", "211412", "211214",
+    "211232", "2331112"
+};
+
+#define C128_CODE_C 99
+#define C128_CODE_B 100
+#define C128_CODE_A 101
+#define C128_START_A 103
+#define C128_STOP 106
+
+/* Left-hand odd parity digits (space first); even parity is mirrored */
+static const char *const ean_digits[] = {
+    "3211", "2221", "2122", "1411", "1132",
+    "1231", "1114", "1312", "1213", "3112"
+};
+
+/* Parity of the left digits, by the first digit: bit set for even */
+static const uint8_t ean_parity[] = {
+    0x00, 0x0B, 0x0D, 0x0E, 0x13, 0x19, 0x1C, 0x15, 0x16, 0x1A
+};
+
+/* Code 39: wide (w) and narrow elements, bar first */
+static const char code39_chars[] = "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ-. *$/+%";
+static const char *const code39[] = {
+    "nnnwwnwnn", "wnnwnnnnw", "nnwwnnnnw", "wnwwnnnnn", "nnnwwnnnw",
+    "wnnwwnnnn", "nnwwwnnnn", "nnnwnnwnw", "wnnwnnwnn", "nnwwnnwnn",
+    "wnnnnwnnw", "nnwnnwnnw", "wnwnnwnnn", "nnnnwwnnw", "wnnnwwnnn",
+    "nnwnwwnnn", "nnnnnwwnw", "wnnnnwwnn", "nnwnnwwnn", "nnnnwwwnn",
+    "wnnnnnnww", "nnwnnnnww", "wnwnnnnwn", "nnnnwnnww", "wnnnwnnwn",
+    "nnwnwnnwn", "nnnnnnwww", "wnnnnnwwn", "nnwnnnwwn", "nnnnwnwwn",
+    "wwnnnnnnw", "nwwnnnnnw", "wwwnnnnnn", "nwnnwnnnw", "wwnnwnnnn",
+    "nwwnwnnnn", "nwnnnnwnw", "wwnnnnwnn", "nwwnnnwnn", "nwnnwnwnn",
+    "nwnwnwnnn", "nwnwnnnwn", "nwnnnwnwn", "nnnwnwnwn"
+};
+
+static int bars_add(struct barcode_t *b, const char *widths)
+{
+    for (; *widths; ++widths) {
+        if (b->count == BARS_MAX)
+            return 1;
+        b->runs[b->count++] = *widths == 'w' ? 3 :
+            *widths == 'n' ? 1 : *widths - '0';
+    }
+    return 0;
+}
+
+/*======================================================================
+  Code 128, in set C for runs of four digits or more, set A for control
+  characters and set B otherwise
+*/
+static int barcode_code128(struct barcode_t *b, const char *data)
+{
+    int values[BARS_MAX / 6];
+    unsigned n = 0, i;
+    int set = -1;               /* 0 A, 1 B, 2 C */
+    const unsigned char *p = (const unsigned char *)data;
+    while (*p) {
+        unsigned digits = strspn((const char *)p, "0123456789");
+        int want;
+        if (digits >= 4 && !(digits & 1))
+            want = 2;
+        else if (set == 2 && digits >= 2)
+            want = 2;
+        else if (*p < 32)
+            want = 0;
+        else if (*p < 128)
+            want = set == 0 && *p < 96 ? 0 : 1;
+        else
+            return 1;
+        if (n + 3 > sizeof values / sizeof *values)
+            return 1;
+        if (want != set) {
+            values[n++] = set < 0 ? C128_START_A + want :
+                want == 0 ? C128_CODE_A : want == 1 ? C128_CODE_B :
+                C128_CODE_C;
+            set = want;
+        }
+        if (set == 2) {
+            values[n++] = (p[0] - '0') * 10 + p[1] - '0';
+            p += 2;
+        } else {
+            values[n++] = *p < 32 ? *p + 64 : *p - 32;
+            ++p;
+        }
+    }
+    if (!n)
+        return 1;
+    unsigned sum = values[0];
+    for (i = 1; i < n; ++i)
+        sum += i * values[i];
+    values[n++] = sum % 103;
+    values[n++] = C128_STOP;
+    for (i = 0; i < n; ++i) {
+        if (bars_add(b, code128[values[i]]))
+            return 1;
+    }
+    return 0;
+}
+
+/*======================================================================
+  EAN-13, from 12 digits (the check digit is added) or 13 (checked)
+*/
+static int barcode_ean13(struct barcode_t *b, const char *data)
+{
+    size_t len = strlen(data);
+    if ((len != 12 && len != 13) || strspn(data, "0123456789") != len)
+        return 1;
+    unsigned sum = 0, i;
+    for (i = 0; i < 12; ++i)
+        sum += (data[i] - '0') * (i & 1 ? 3 : 1);
+    char check = '0' + (10 - sum % 10) % 10;
+    if (len == 13 && data[12] != check) {
+        fputs("EAN-13 check digit mismatch\n", stderr);
+        return 1;
+    }
+
+    unsigned parity = ean_parity[data[0] - '0'];
+    bars_add(b, "111");
+    for (i = 1; i < 7; ++i) {
+        const char *w = ean_digits[data[i] - '0'];
+        if (parity & (0x20 >> (i - 1))) {
+            char rev[5] = { w[3], w[2], w[1], w[0], '\0' };
+            bars_add(b, rev);
+        } else {
+            bars_add(b, w);
+        }
+    }
+    bars_add(b, "11111");
+    for (i = 7; i < 13; ++i)
+        bars_add(b, ean_digits[(i < 12 ? data[i] : check) - '0']);
+    bars_add(b, "111");
+    return 0;
+}
+
+/*======================================================================
+  Code 39, with the start/stop characters added; lower case is taken
+  as upper case
+*/
+static int barcode_code39(struct barcode_t *b, const char *data)
+{
+    size_t len = strlen(data), i;
+    for (i = 0; i < len + 2; ++i) {
+        _Bool edge = i == 0 || i == len + 1;
+        char ch = edge ? '*' : toupper((unsigned char)data[i - 1]);
+        const char *pos = strchr(code39_chars, ch);
+        if (!pos || (ch == '*' && !edge) ||
+                bars_add(b, code39[pos - code39_chars]))
+            return 1;
+        /* Narrow gap between characters */
+        if (!(i == len + 1) && bars_add(b, "1"))
+            return 1;
+    }
+    return 0;
+}
+
+/*======================================================================
+  Encode a barcode given as type[,module]:data, to be drawn h rows high.
+  Without a module width, 2D symbols get the largest that fits
+*/
+int barcode_encode(struct barcode_t *b, const char *spec, unsigned h)
+{
+    const char *data = strchr(spec, ':');
+    size_t tlen = strcspn(spec, ",:");
+    if (!data) {
+        fprintf(stderr, "%s: barcode data missing\n", spec);
+        return 1;
+    }
+    ++data;
+    b->count = 0;
+    if (tlen == 7 && strncmp(spec, "code128", 7) == 0) {
+        b->type = BARCODE_CODE128;
+        b->module = 2;
+    } else if (tlen == 5 && strncmp(spec, "ean13", 5) == 0) {
+        b->type = BARCODE_EAN13;
+        b->module = 3;          /* 0.375 mm, the nominal is 0.33 */
+    } else if (tlen == 6 && strncmp(spec, "code39", 6) == 0) {
+        b->type = BARCODE_CODE39;
+        b->module = 2;
+    } else if ((tlen == 2 || (tlen == 4 && spec[2] == '-' &&
+                    strchr("lmqh", spec[3]))) &&
+            strncmp(spec, "qr", 2) == 0) {
+        b->type = BARCODE_QR;
+        b->level = tlen == 2 ? 1 : strchr("lmqh", spec[3]) - "lmqh";
+        b->module = 0;
+    } else if (tlen == 10 && strncmp(spec, "datamatrix", 10) == 0) {
+        b->type = BARCODE_DATAMATRIX;
+        b->module = 0;
+    } else {
+        fprintf(stderr, "%s: unknown barcode type\n", spec);
+        return 1;
+    }
+    if (spec[tlen] == ',') {
+        int m = atoi(spec + tlen + 1);
+        if (m < 1 || m > 16) {
+            fprintf(stderr, "%s: invalid module width\n", spec);
+            return 1;
+        }
+        b->module = m;
+    }
+
+    int rc;
+    if (b->type == BARCODE_QR || b->type == BARCODE_DATAMATRIX) {
+        rc = matrix_encode(b->type == BARCODE_QR ? b->level : 4, data,
+                b->matrix, &b->size);
+        if (!rc && !b->module)
+            b->module = h / b->size;
+        if (!rc && (!b->module || b->size * b->module > h)) {
+            fprintf(stderr, "%s: symbol too large for %u rows\n", spec, h);
+            return 1;
+        }
+    } else {
+        rc = b->type == BARCODE_CODE128 ? barcode_code128(b, data) :
+            b->type == BARCODE_EAN13 ? barcode_ean13(b, data) :
+            barcode_code39(b, data);
+    }
+    if (rc)
+        fprintf(stderr, "%s: can't encode\n", spec);
+    return rc;
+}
+
+/*======================================================================
+  Columns of a barcode, with its quiet zones
+*/
+static unsigned barcode_quiet(const struct barcode_t *b, _Bool right)
+{
+    return (b->type == BARCODE_EAN13 ? (right ? 7 : 11) :
+            b->type == BARCODE_QR ? 4 : b->type == BARCODE_DATAMATRIX ? 1 :
+            10) * b->module;
+}
+
+unsigned barcode_width(const struct barcode_t *b)
+{
+    unsigned w = 0, i;
+    if (b->type == BARCODE_QR || b->type == BARCODE_DATAMATRIX)
+        w = b->size;
+    for (i = 0; i < b->count; ++i)
+        w += b->runs[i];
+    return w * b->module + barcode_quiet(b, false) + barcode_quiet(b, true);
+}
+
+/*======================================================================
+  Draw a 2D symbol from column x, centred in rows y to y+h: each column
+  of modules is built once and copied to its columns of dots
+*/
+static void draw_matrix(uint8_t *pat, unsigned length, int x, int y,
+        unsigned h, const struct barcode_t *b)
+{
+    unsigned n = b->size, mx, my, k;
+    y += (h - n * b->module) / 2;
+    for (mx = 0; mx < n; ++mx) {
+        uint8_t col[IMAGE_ROWS/8] = { 0 };
+        for (my = 0; my < n; ++my) {
+            if (!b->matrix[my * n + mx])
+                continue;
+            int r = y + my * b->module;
+            for (k = 0; k < b->module; ++k, ++r) {
+                if (r >= 0 && r < IMAGE_ROWS)
+                    col[r/8] |= 1 << (r%8);
+            }
+        }
+        for (k = 0; k < b->module; ++k) {
+            int cx = x + mx * b->module + k;
+            if (cx < 0 || cx >= (int)length)
+                continue;
+            uint8_t *dst = pat + cx * (IMAGE_ROWS/8);
+            unsigned i;
+            for (i = 0; i < IMAGE_ROWS/8; ++i)
+                dst[i] |= col[i];
+        }
+    }
+}
+
+/*======================================================================
+  Draw a barcode from column x (its quiet zone), rows y to y+h
+*/
+void draw_barcode(uint8_t *pat, unsigned length, int x, int y, unsigned h,
+        const struct barcode_t *b)
+{
+    uint8_t bar[IMAGE_ROWS/8] = { 0 };
+    int r;
+    for (r = y < 0 ? 0 : y; r < y + (int)h && r < IMAGE_ROWS; ++r)
+        bar[r/8] |= 1 << (r%8);
+
+    x += barcode_quiet(b, false);
+    if (b->type == BARCODE_QR || b->type == BARCODE_DATAMATRIX) {
+        draw_matrix(pat, length, x, y, h, b);
+        return;
+    }
+    unsigned i;
+    for (i = 0; i < b->count; ++i) {
+        int end = x + b->runs[i] * b->module;
+        for (; !(i & 1) && x < end; ++x) {
+            if (x < 0 || x >= (int)length)
+                continue;
+            uint8_t *col = pat + x * (IMAGE_ROWS/8);
+            unsigned k;
+            for (k = 0; k < IMAGE_ROWS/8; ++k)
+                col[k] |= bar[k];
+        }
+        x = end;
+    }
+}
+
+/*======================================================================
+  The barcode given with -B as the label, as high as the tape allows
+*/
+int barcode_image(const char *spec)
+{
+    static struct barcode_t b;
+    unsigned rows = tape_rows(opt_tape);
+    if (barcode_encode(&b, spec, rows))
+        return 1;
+    image_w = barcode_width(&b);
+    pattern_size = image_w * (IMAGE_ROWS/8);
+    pattern = calloc(1, pattern_size);
+    if (!pattern) {
+        fputs("malloc failed\n", stderr);
+        return 1;
+    }
+    draw_barcode(pattern, image_w, 0, (IMAGE_ROWS - rows) / 2, rows, &b);
+    return 0;
+}
+
+/*======================================================================
+  The label of the one-shot and trigger modes: the barcode given with
+  -B, the text given with -X, or the image on the standard input
+*/
+int load_label(void)
+{
+    return opt_barcode ? barcode_image(opt_barcode) :
+        opt_text ? text_image(opt_text) : load_image_stdin();
+}
+
+/*======================================================================
+  Trigger mode: the label is decoded and framed in advance and the
+  printer kept handshaken, so that a trigger only has to stream the
+  raster. Every byte on a FIFO or a local datagram socket, or every
+  SIGUSR1, prints the label once
+*/
+volatile sig_atomic_t trigger_stop;
+int trigger_pipe[2] = { -1, -1 };
+
+/*======================================================================
+  Signal handlers: SIGUSR1 triggers, SIGINT and SIGTERM stop
+*/
+static void trigger_signal(int sig)
+{
+    if (sig == SIGUSR1) {
+        int saved = errno;
+        if (write(trigger_pipe[1], "", 1) < 0) {
+            /* Already plenty pending */
+        }
+        errno = saved;
+    } else {
+        trigger_stop = 1;
+    }
+}
+
+/*======================================================================
+  Open the trigger source
+*/
+int trigger_open(const char *spec)
+{
+    int fd = -1;
+    if (strcmp(spec, "signal") == 0) {
+        if (pipe(trigger_pipe))
+            return -1;
+        fcntl(trigger_pipe[1], F_SETFL, O_NONBLOCK);
+        fd = trigger_pipe[0];
+    } else if (strncmp(spec, "fifo:", 5) == 0) {
+        if (mkfifo(spec + 5, 0660) && errno != EEXIST) {
+            perror(spec + 5);
+            return -1;
+        }
+        /* Open for writing too, so it never reports end of file */
+        fd = open(spec + 5, O_RDWR);
+        if (fd < 0)
+            perror(spec + 5);
+    } else if (strncmp(spec, "unix:", 5) == 0) {
+        struct sockaddr_un addr = { .sun_family = AF_UNIX };
+        if (strlen(spec + 5) >= sizeof addr.sun_path) {
+            fputs("Trigger socket path too long\n", stderr);
+            return -1;
+        }
+        strcpy(addr.sun_path, spec + 5);
+        unlink(addr.sun_path);
+        fd = socket(AF_UNIX, SOCK_DGRAM, 0);
+        if (fd >= 0 && bind(fd, (struct sockaddr *)&addr, sizeof addr)) {
+            perror(spec + 5);
+            close(fd);
+            fd = -1;
+        }
+    } else {
+        fputs("Invalid trigger\n", stderr);
+    }
+    return fd;
+}
+
+/*======================================================================
+  Run the trigger mode
+*/
+int run_trigger(const char *spec)
+{
+    int rc = load_label();
+    if (rc)
+        return 1;
+
+    int fd = trigger_open(spec);
+    if (fd < 0)
+        return 1;
+
+    struct sigaction sa = { .sa_handler = trigger_signal };
+    sigaction(SIGUSR1, &sa, NULL);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    /* Framed for the transfer parameters of the printer */
+    if (printer_open())
+        return 1;
+    struct frame_t *frames;
+    unsigned nframes;
+    if (frames_build(pattern, pattern_size, &frames, &nframes))
+        return 1;
+    struct settings_t set;
+    settings_default(&set);
+
+    unsigned triggers = 0;
+    double first_sum = 0, ack_sum = 0, first_max = 0, ack_max = 0;
+    _Bool armed = false;
+    while (!trigger_stop) {
+        if (!armed) {
+            if (printer_check_status() || printer_reset() ||
+                    printer_setup(&set)) {
+                rc = 1;
+                break;
+            }
+            armed = true;
+        }
+
+        struct pollfd pfd = { .fd = fd, .events = POLLIN };
+        if (poll(&pfd, 1, -1) <= 0)
+            continue;
+        double t0 = now_ms();
+        uint8_t buf[64];
+        ssize_t n = read(fd, buf, sizeof buf);
+        while (n-- > 0 && !trigger_stop) {
+            double first = t0;
+            rc = frames_send(frames, nframes, &first);
+            double ack = now_ms();
+            printer_cancel_job();
+            armed = false;
+            if (rc)
+                break;
+
+            ++triggers;
+            first -= t0;
+            ack -= t0;
+            fprintf(stderr, "Trigger %u: first frame %.3f ms, "
+                    "print page ACK %.3f ms\n", triggers, first, ack);
+            first_sum += first;
+            ack_sum += ack;
+            if (first > first_max)
+                first_max = first;
+            if (ack > ack_max)
+                ack_max = ack;
+
+            /* Back to back triggers need the handshake again */
+            if (n > 0 && (printer_check_status() || printer_reset() ||
+                        printer_setup(&set))) {
+                rc = 1;
+                break;
+            }
+            t0 = now_ms();
+        }
+        if (rc)
+            break;
+    }
+    if (armed)
+        printer_cancel_job();
+    if (triggers)
+        fprintf(stderr, "%u triggers: first frame avg %.3f max %.3f ms, "
+                "print page ACK avg %.3f max %.3f ms\n", triggers,
+                first_sum / triggers, first_max, ack_sum / triggers, ack_max);
+
+    printer_close();
+    close(fd);
+    free(frames);
+    return rc;
+}
+
+/*======================================================================
+  Live mode: an endless label streamed on the standard input as raw
+  columns, 16 bytes each laid out as in the pattern, printed a page at
+  a time as they come. A page is sent when full, or shorter when the
+  first column waiting in it has waited for the deadline; the label
+  ends at the end of the stream, or on SIGINT or SIGTERM. The last
+  column is always held back, so that the label ends with a page of
+  its own followed by the raster end, as the standard program does
+*/
+#define LIVE_HELD (IMAGE_ROWS/8)
+
+int run_live(int deadline)
+{
+    static uint8_t page[8192];
+    unsigned len = 0;
+    double first = 0;
+
+    struct sigaction sa = { .sa_handler = trigger_signal };
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    if (printer_open())
+        return 1;
+    struct settings_t set;
+    settings_default(&set);
+
+    int rc = 0;
+    _Bool started = false, eof = false;
+    unsigned pages = 0;
+    unsigned long columns = 0;
+    double latency_sum = 0, latency_max = 0;
+    while (!rc && !eof && !trigger_stop) {
+        unsigned ready = len - len % (IMAGE_ROWS/8);
+        ready = ready > LIVE_HELD ? ready - LIVE_HELD : 0;
+        int timeout = -1;
+        if (ready) {
+            double left = first + deadline - now_ms();
+            timeout = left > 0 ? (int)left + 1 : 0;
+        }
+        if (len < sizeof page) {
+            struct pollfd pfd = { .fd = STDIN_FILENO, .events = POLLIN };
+            int n = poll(&pfd, 1, timeout);
+            if (n < 0 && errno != EINTR) {
+                perror("poll");
+                rc = 1;
+                break;
+            }
+            if (n > 0) {
+                ssize_t got = read(STDIN_FILENO, page + len,
+                        sizeof page - len);
+                if (got < 0 && errno != EINTR && errno != EAGAIN) {
+                    perror("read");
+                    rc = 1;
+                    break;
+                }
+                if (got == 0)
+                    eof = true;
+                if (got > 0) {
+                    /* The clock starts with the first column that can
+                       go, past the one held back */
+                    if (!ready && len + got >= LIVE_HELD + IMAGE_ROWS/8)
+                        first = now_ms();
+                    len += got;
+                }
+            }
+        }
+        ready = len - len % (IMAGE_ROWS/8);
+        ready = ready > LIVE_HELD ? ready - LIVE_HELD : 0;
+        if (!ready || eof || trigger_stop ||
+                (len < sizeof page && now_ms() < first + deadline))
+            continue;
+
+        if (!started) {
+            if (printer_check_status() || printer_reset() ||
+                    printer_setup(&set)) {
+                rc = 1;
+                break;
+            }
+            started = true;
+        }
+        rc = printer_send_page(page, ready);
+        double latency = now_ms() - first;
+        ++pages;
+        columns += ready / (IMAGE_ROWS/8);
+        latency_sum += latency;
+        if (latency > latency_max)
+            latency_max = latency;
+        if (dump_comm)
+            fprintf(stderr, "Page %u: %u columns, %.3f ms after the "
+                    "first\n", pages, ready / (IMAGE_ROWS/8), latency);
+        memmove(page, page + ready, len - ready);
+        len -= ready;
+    }
+
+    /* The rest, at least the column held back, as the last page */
+    unsigned ready = len - len % (IMAGE_ROWS/8);
+    if (!rc && ready) {
+        if (!started)
+            rc = printer_check_status() || printer_reset() ||
+                printer_setup(&set);
+        /* Only the held column: it could go once the stream ended */
+        if (ready == LIVE_HELD)
+            first = now_ms();
+        if (!rc) {
+            rc = printer_send_raster(page, ready);
+            double latency = now_ms() - first;
+            ++pages;
+            columns += ready / (IMAGE_ROWS/8);
+            latency_sum += latency;
+            if (latency > latency_max)
+                latency_max = latency;
+        }
+        started = true;
+    }
+    if (started)
+        printer_cancel_job();
+    if (pages)
+        fprintf(stderr, "%u pages, %lu columns: latency avg %.3f max %.3f "
+                "ms\n", pages, columns, latency_sum / pages, latency_max);
+
+    printer_close();
+    return rc;
+}
+
+/*======================================================================
+  Tuning mode: blank labels of the given length are printed with the
+  candidate transfer parameters, one parameter at a time, a change being
+  kept only if faster and without errors. The result is stored as the
+  printer profile; its timeout stays infinite, as a blank label says
+  nothing of how long a dark one takes
+*/
+#define TUNE_TIMEOUT 30000
+
+static const struct {
+    const char *name;
+    unsigned count;
+    unsigned values[3];
+} tune_axes[] = {
+    { "window", 3, { 1, 2, 3 } },
+    { "page", 2, { 4096, 2048 } },
+    { "block", 2, { 48, 32 } },
+    { "stall", 2, { 5, 100 } }
+};
+
+static unsigned *tune_field(struct transfer_t *t, unsigned axis)
+{
+    switch (axis) {
+    case 0: return &t->window;
+    case 1: return &t->page;
+    case 2: return &t->block;
+    default: return &t->stall;
+    }
+}
+
+/*======================================================================
+  Print the test label with the parameters; returns the raster bytes
+  per second, or a negative value on errors
+*/
+static double tune_trial(const struct transfer_t *t,
+        const struct settings_t *set, const uint8_t *raw, unsigned size)
+{
+    xfer = *t;
+    fprintf(stderr, "Block %2u, page %4u, window %u, stall %3u ms: ",
+            t->block, t->page, t->window, t->stall);
+    int rc = printer_check_status() || printer_reset() || printer_setup(set);
+    double start = now_ms();
+    rc = rc || printer_send_raster(raw, size);
+    double ms = now_ms() - start;
+    printer_cancel_job();
+    if (rc || usb_error) {
+        fputs("failed\n", stderr);
+        usb_error = false;
+        return -1;
+    }
+    double rate = size * 1000.0 / ms;
+    fprintf(stderr, "%.0f bytes/s, %u frames held back\n", rate,
+            pending.held);
+    return rate;
+}
+
+int run_tune(unsigned columns)
+{
+    if (printer_open())
+        return 1;
+    char serial[128];
+    if (device_serial(devhnd, serial, sizeof serial)) {
+        fputs("The printer has no serial number\n", stderr);
+        printer_close();
+        return 1;
+    }
+    unsigned size = columns * (IMAGE_ROWS/8);
+    uint8_t *raw = calloc(1, size);
+    if (!raw) {
+        fputs("malloc failed\n", stderr);
+        printer_close();
+        return 1;
+    }
+    /* USB errors end a trial, not the program */
+    opt_loop = true;
+
+    struct settings_t set;
+    settings_default(&set);
+    struct transfer_t best = TRANSFER_DEFAULT;
+    best.timeout = TUNE_TIMEOUT;
+    double best_rate = tune_trial(&best, &set, raw, size);
+    unsigned trials = 1, failed = best_rate < 0;
+    unsigned a, i;
+    for (a = 0; best_rate >= 0 && a < sizeof tune_axes / sizeof *tune_axes;
+            ++a) {
+        for (i = 0; i < tune_axes[a].count; ++i) {
+            struct transfer_t t = best;
+            *tune_field(&t, a) = tune_axes[a].values[i];
+            /* Only overlapping frames can be held back */
+            if (t.window == 0 && a == 3)
+                continue;
+            double rate = tune_trial(&t, &set, raw, size);
+            ++trials;
+            if (rate < 0) {
+                ++failed;
+            } else if (rate > best_rate * 1.02) {
+                best = t;
+                best_rate = rate;
+            }
+        }
+    }
+    free(raw);
+    printer_close();
+
+    fprintf(stderr, "%u of %u trials failed\n", failed, trials);
+    if (best_rate < 0) {
+        fputs("Not even the default parameters work\n", stderr);
+        return 1;
+    }
+    best.timeout = 0;
+    fprintf(stderr, "Profile of %s: block %u, page %u, window %u, "
+            "stall %u ms, timeout %u ms (%.0f bytes/s)\n", serial,
+            best.block, best.page, best.window, best.stall, best.timeout,
+            best_rate);
+    return transfer_store(serial, &best);
+}
+
+/*======================================================================
+  Latency probe: the status query is sent the given number of times and
+  the distribution of its round trip reported, optionally while threads
+  load the CPUs and the memory of the host
+*/
+#define PROBE_LOAD_BYTES (32 << 20)
+
+pthread_mutex_t probe_lock = PTHREAD_MUTEX_INITIALIZER;
+_Bool probe_stop;
+
+static void *probe_load(void *arg)
+{
+    uint8_t *buf = malloc(PROBE_LOAD_BYTES);
+    if (!buf)
+        return NULL;
+    unsigned pass = 0;
+    for (;;) {
+        pthread_mutex_lock(&probe_lock);
+        _Bool stop = probe_stop;
+        pthread_mutex_unlock(&probe_lock);
+        if (stop)
+            break;
+        memset(buf, pass++, PROBE_LOAD_BYTES / 2);
+        memcpy(buf + PROBE_LOAD_BYTES / 2, buf, PROBE_LOAD_BYTES / 2);
+    }
+    free(buf);
+    return NULL;
+}
+
+static int probe_compare(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+int run_probe(unsigned count, unsigned nload)
+{
+    double *rtt = calloc(count, sizeof *rtt);
+    pthread_t *threads = calloc(nload + 1, sizeof *threads);
+    if (!rtt || !threads) {
+        fputs("malloc failed\n", stderr);
+        return 1;
+    }
+    if (printer_open())
+        return 1;
+
+    unsigned i, started;
+    for (started = 0; started < nload; ++started) {
+        if (pthread_create(&threads[started], NULL, probe_load, NULL)) {
+            fputs("Can't start the load threads\n", stderr);
+            break;
+        }
+    }
+
+    int rc = 0;
+    for (i = 0; i < count; ++i) {
+        double t = now_ms();
+        rc = printer_check_status();
+        rtt[i] = now_ms() - t;
+        if (rc)
+            break;
+    }
+
+    pthread_mutex_lock(&probe_lock);
+    probe_stop = true;
+    pthread_mutex_unlock(&probe_lock);
+    while (started)
+        pthread_join(threads[--started], NULL);
+    printer_close();
+
+    if (i) {
+        /* Jitter as the mean difference of consecutive round trips */
+        double sum = 0, jitter = 0;
+        unsigned j;
+        for (j = 0; j < i; ++j) {
+            sum += rtt[j];
+            if (j) {
+                double d = rtt[j] - rtt[j - 1];
+                jitter += d < 0 ? -d : d;
+            }
+        }
+        jitter = j > 1 ? jitter / (j - 1) : 0;
+        qsort(rtt, i, sizeof *rtt, probe_compare);
+        fprintf(stderr, "%u round trips%s: min %.3f p50 %.3f p99 %.3f "
+                "max %.3f ms, mean %.3f ms, jitter %.3f ms\n", i,
+                nload ? " under load" : "", rtt[0], rtt[i / 2],
+                rtt[(i * 99 + 99) / 100 - 1], rtt[i - 1], sum / i, jitter);
+    }
+    free(rtt);
+    free(threads);
+    return rc;
+}
+
+/*======================================================================
+  Mail-merge mode: a label layout filled with the records of a CSV
+  file, one label for each. Labels are rendered by worker threads
+  straight to the column pattern and printed in order in a single
+  printer session. The static items of the layout are drawn once, as
+  a base layer; the fields are drawn in strips kept by each worker, so
+  that only the characters that changed are drawn again
+*/
+
+enum ITEMTYPE_T {
+    ITEM_TEXT,
+    ITEM_BOX,
+    ITEM_IMAGE,
+    ITEM_BARCODE
+};
+
+struct item_t {
+    enum ITEMTYPE_T type;
+    int x, y;
+    unsigned w, h;              /* Box size, image length, bar height */
+    unsigned scale;             /* Text magnification */
+    char *text;                 /* With {field} references (barcodes:
+                                   type[,module]:data) */
+    uint8_t *pattern;           /* Image */
+    _Bool field;                /* Changes from label to label */
+};
+
+struct layout_t {
+    unsigned length;            /* Label length, 0 to fit the content */
+    unsigned count;
+    struct item_t *items;
+    uint8_t *base;              /* The static items, drawn */
+    unsigned base_len;
+    unsigned long labels;       /* Without CSV, how many */
+    unsigned long serial;       /* {serial}: first, increment, digits */
+    long serial_step;
+    unsigned serial_digits;
+};
+
+struct layout_t layout = { .serial_step = 1 };
+
+/* A CSV record: fields point into data */
+struct record_t {
+    char *data;
+    char **fields;
+    unsigned count;
+    unsigned long seq;
+};
+
+/* A field drawn alone, as last rendered by a worker */
+struct strip_t {
+    char *text;
+    uint8_t *pattern;
+    unsigned len;
+};
+
+/* The strips of a worker, one for each item */
+struct worker_t {
+    struct strip_t *strips;
+    struct barcode_t bars;
+    unsigned long glyphs;       /* Drawn */
+    unsigned long reused;       /* Not drawn again */
+};
+
+struct record_t csv_header;
+
+const char *opt_merge = NULL;
+unsigned opt_threads = 0;
+
+/*======================================================================
+  Load a label layout. One item for each line:
+    length COLUMNS
+    text X Y SCALE TEXT
+    box X Y WIDTH HEIGHT
+    image X PBMFILE
+    barcode X Y HEIGHT TYPE[,MODULE]:DATA
+    serial FIRST [STEP [DIGITS]]
+    count LABELS
+*/
+int layout_load(const char *path)
+{
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        perror(path);
+        return 1;
+    }
+    char line[1024];
+    unsigned lineno = 0;
+    int rc = 0;
+    while (!rc && fgets(line, sizeof line, f)) {
+        ++lineno;
+        line[strcspn(line, "\r\n")] = '\0';
+        char *p = line + strspn(line, " \t");
+        if (!*p || *p == '#')
+            continue;
+
+        struct item_t it = { .scale = 1 };
+        int n = 0;
+        if (sscanf(p, "length %u %n", &layout.length, &n) == 1 && n) {
+            continue;
+        } else if (sscanf(p, "count %lu %n", &layout.labels, &n) == 1 && n) {
+            continue;
+        } else if (sscanf(p, "serial %lu %n", &layout.serial, &n) == 1 &&
+                n) {
+            sscanf(p + n, "%ld %u", &layout.serial_step,
+                    &layout.serial_digits);
+            continue;
+        } else if (sscanf(p, "text %d %d %u %n", &it.x, &it.y,
+                    &it.scale, &n) == 3 && n && it.scale) {
+            it.type = ITEM_TEXT;
+            it.text = strdup(p + n);
+            it.field = it.text && strchr(it.text, '{');
+        } else if (sscanf(p, "box %d %d %u %u", &it.x, &it.y,
+                    &it.w, &it.h) == 4) {
+            it.type = ITEM_BOX;
+        } else if (sscanf(p, "barcode %d %d %u %n", &it.x, &it.y,
+                    &it.h, &n) == 3 && n) {
+            it.type = ITEM_BARCODE;
+            it.text = strdup(p + n);
+            it.field = it.text && strchr(it.text, '{');
+        } else if (sscanf(p, "image %d %n", &it.x, &n) == 1 && n) {
+            if (load_image_file(p + n)) {
+                fprintf(stderr, "%s:%u: can't load %s\n", path, lineno,
+                        p + n);
+                rc = 1;
+                break;
+            }
+            it.type = ITEM_IMAGE;
+            it.pattern = pattern;
+            it.w = image_w;
+            pattern = NULL;
+        } else {
+            fprintf(stderr, "%s:%u: invalid layout line\n", path, lineno);
+            rc = 1;
+            break;
+        }
+
+        struct item_t *items = realloc(layout.items,
+                (layout.count + 1) * sizeof *items);
+        if (!items || ((it.type == ITEM_TEXT || it.type == ITEM_BARCODE) &&
+                    !it.text)) {
+            fputs("malloc failed\n", stderr);
+            free(it.text);
+            rc = 1;
+            break;
+        }
+        layout.items = items;
+        layout.items[layout.count++] = it;
+    }
+    fclose(f);
+    return rc;
+}
+
+/*======================================================================
+  Read a CSV record (RFC 4180: quoted fields can hold commas, quotes
+  doubled and line breaks). Returns 1 at end of file
+*/
+int csv_read(FILE *f, struct record_t *rec)
+{
+    size_t len = 0, size = 256;
+    char *data = malloc(size);
+    size_t *starts = NULL;
+    unsigned count = 0, alloc = 0;
+    _Bool quoted = false, field_start = true;
+    int c;
+
+    if (!data) {
+        fputs("malloc failed\n", stderr);
+        return -1;
+    }
+    /* Blank lines are not records */
+    while ((c = getc(f)) == '\r' || c == '\n')
+        ;
+    ungetc(c, f);
+    while ((c = getc(f)) != EOF) {
+        if (field_start) {
+            if (count == alloc) {
+                alloc = alloc ? alloc * 2 : 16;
+                size_t *s = realloc(starts, alloc * sizeof *starts);
+                if (!s)
+                    break;
+                starts = s;
+            }
+            starts[count++] = len;
+            field_start = false;
+            if (c == '"') {
+                quoted = true;
+                continue;
+            }
+        }
+        if (quoted) {
+            if (c == '"') {
+                c = getc(f);
+                if (c != '"') {
+                    quoted = false;
+                    if (c == EOF)
+                        break;
+                    ungetc(c, f);
+                    continue;
+                }
+            }
+        } else if (c == ',') {
+            c = '\0';
+            field_start = true;
+        } else if (c == '\r') {
+            continue;
+        } else if (c == '\n') {
+            break;
+        }
+        if (len + 2 > size) {
+            size *= 2;
+            char *d = realloc(data, size);
+            if (!d)
+                break;
+            data = d;
+        }
+        data[len++] = c;
+    }
+    if (c == EOF && !count) {
+        free(data);
+        free(starts);
+        return 1;
+    }
+    if (field_start && count) {
+        /* A trailing comma: one more empty field */
+        size_t *s = realloc(starts, (count + 1) * sizeof *starts);
+        if (s) {
+            starts = s;
+            starts[count++] = len;
+        }
+    }
+    data[len] = '\0';
+
+    rec->data = data;
+    rec->count = count;
+    rec->fields = malloc((count + 1) * sizeof *rec->fields);
+    if (!rec->fields) {
+        fputs("malloc failed\n", stderr);
+        free(data);
+        free(starts);
+        return -1;
+    }
+    unsigned i;
+    for (i = 0; i < count; ++i)
+        rec->fields[i] = data + starts[i];
+    free(starts);
+    return 0;
+}
+
+/*======================================================================
+  Release the fields of a record
+*/
+void csv_free(struct record_t *rec)
+{
+    free(rec->data);
+    free(rec->fields);
+    rec->data = NULL;
+    rec->fields = NULL;
+    rec->count = 0;
+}
+
+/*======================================================================
+  Value of a {field} reference: a column name from the header or a
+  column number from 1
+*/
+const char *merge_field(const struct record_t *rec, const char *name,
+        size_t len)
+{
+    unsigned i;
+    for (i = 0; i < csv_header.count; ++i) {
+        if (strlen(csv_header.fields[i]) == len &&
+                memcmp(csv_header.fields[i], name, len) == 0)
+            return i < rec->count ? rec->fields[i] : "";
+    }
+    char *end;
+    unsigned long n = strtoul(name, &end, 10);
+    if (end == name + len && n >= 1 && n <= rec->count)
+        return rec->fields[n - 1];
+    return "";
+}
+
+/*======================================================================
+  Expand the {field} references of a text; {{ is a literal brace and
+  {serial} the serial number of the label
+*/
+char *merge_text(const struct record_t *rec, const char *text)
+{
+    size_t len = 0, size = strlen(text) + 64;
+    char *out = malloc(size);
+    char serial[32];
+    while (out && *text) {
+        const char *val = text;
+        size_t n = 1;
+        if (text[0] == '{' && text[1] == '{') {
+            text += 2;
+        } else if (strncmp(text, "{serial}", 8) == 0) {
+            snprintf(serial, sizeof serial, "%0*lu", layout.serial_digits,
+                    layout.serial + rec->seq * layout.serial_step);
+            val = serial;
+            n = strlen(val);
+            text += 8;
+        } else if (text[0] == '{' && strchr(text, '}')) {
+            const char *end = strchr(text, '}');
+            val = merge_field(rec, text + 1, end - text - 1);
+            n = strlen(val);
+            text = end + 1;
+        } else {
+            ++text;
+        }
+        if (len + n + 1 > size) {
+            size = (len + n + 1) * 2;
+            char *p = realloc(out, size);
+            if (!p) {
+                free(out);
+                return NULL;
+            }
+            out = p;
+        }
+        memcpy(out + len, val, n);
+        len += n;
+    }
+    if (out)
+        out[len] = '\0';
+    return out;
+}
+
+/*======================================================================
+  Drawing on a column pattern of the given length; everything is
+  clipped to it
+*/
+void draw_box(uint8_t *pat, unsigned length, int x, int y,
+        unsigned w, unsigned h)
+{
+    int x0 = x < 0 ? 0 : x, x1 = x + (int)w;
+    int y0 = y < 0 ? 0 : y, y1 = y + (int)h;
+    if (x1 > (int)length)
+        x1 = length;
+    if (y1 > IMAGE_ROWS)
+        y1 = IMAGE_ROWS;
+    int cx, cy;
+    for (cx = x0; cx < x1; ++cx) {
+        uint8_t *col = pat + cx * (IMAGE_ROWS/8);
+        for (cy = y0; cy < y1; ++cy)
+            col[cy/8] |= 1 << (cy%8);
+    }
+}
+
+unsigned text_width(const char *text, unsigned scale)
+{
+    size_t n = strlen(text);
+    return n ? (n * (FONT_W + 1) - 1) * scale : 0;
+}
+
+void draw_glyph(uint8_t *pat, unsigned length, int x, int y,
+        unsigned scale, unsigned ch)
+{
+    if (ch < FONT_FIRST || ch > FONT_LAST)
+        ch = '?';
+    const uint8_t *glyph = font5x7[ch - FONT_FIRST];
+    unsigned gx, gy;
+    for (gx = 0; gx < FONT_W; ++gx) {
+        for (gy = 0; gy < FONT_H; ++gy) {
+            if (glyph[gx] & (1 << gy))
+                draw_box(pat, length, x + gx * scale, y + gy * scale,
+                        scale, scale);
+        }
+    }
+}
+
+void draw_text(uint8_t *pat, unsigned length, int x, int y,
+        unsigned scale, const char *text)
+{
+    for (; *text; ++text, x += (FONT_W + 1) * scale)
+        draw_glyph(pat, length, x, y, scale, (unsigned char)*text);
+}
+
+/*======================================================================
+  Draw the static items of the layout once, as the base of every label
+*/
+int layout_base(void)
+{
+    static struct barcode_t bars;
+    unsigned length = layout.length, i;
+    for (i = 0; i < layout.count; ++i) {
+        struct item_t *it = &layout.items[i];
+        if (it->type == ITEM_BARCODE && !it->field) {
+            if (barcode_encode(&bars, it->text, it->h))
+                return 1;
+            it->w = barcode_width(&bars);
+        }
+    }
+    for (i = 0; !layout.length && i < layout.count; ++i) {
+        const struct item_t *it = &layout.items[i];
+        int end = it->x + (int)(it->type == ITEM_TEXT ?
+                text_width(it->text, it->scale) : it->w);
+        if (!it->field && end > (int)length)
+            length = end;
+    }
+    layout.base_len = length;
+    layout.base = calloc(length + 1, IMAGE_ROWS/8);
+    if (!layout.base) {
+        fputs("malloc failed\n", stderr);
+        return 1;
+    }
+    for (i = 0; i < layout.count; ++i) {
+        const struct item_t *it = &layout.items[i];
+        if (it->field)
+            continue;
+        if (it->type == ITEM_TEXT) {
+            draw_text(layout.base, length, it->x, it->y, it->scale, it->text);
+        } else if (it->type == ITEM_BOX) {
+            draw_box(layout.base, length, it->x, it->y, it->w, it->h);
+        } else if (it->type == ITEM_BARCODE) {
+            barcode_encode(&bars, it->text, it->h);
+            draw_barcode(layout.base, length, it->x, it->y, it->h, &bars);
+        } else {
+            rop_blit(layout.base, length, it->x, it->pattern, it->w, ROP_OR);
+        }
+    }
+    return 0;
+}
+
+/*======================================================================
+  Bring the strip of a field up to date with its new text: only the
+  characters that differ from the last one drawn are drawn again, and
+  a barcode only if its data changed
+*/
+int strip_update(struct worker_t *w, struct strip_t *st,
+        const struct item_t *it, char *text)
+{
+    if (it->type == ITEM_BARCODE) {
+        /* Drawn again only if changed */
+        if (st->text && strcmp(st->text, text) == 0) {
+            free(text);
+            return 0;
+        }
+        /* Kept only once drawn, so that bad data fails every time */
+        free(st->text);
+        free(st->pattern);
+        st->text = NULL;
+        st->len = 0;
+        st->pattern = NULL;
+        if (barcode_encode(&w->bars, text, it->h)) {
+            free(text);
+            return 1;
+        }
+        unsigned len = barcode_width(&w->bars);
+        st->pattern = calloc(len + 1, IMAGE_ROWS/8);
+        if (!st->pattern) {
+            fputs("malloc failed\n", stderr);
+            free(text);
+            return 1;
+        }
+        st->len = len;
+        draw_barcode(st->pattern, st->len, 0, it->y, it->h, &w->bars);
+        st->text = text;
+        return 0;
+    }
+
+    size_t n = strlen(text), i;
+    unsigned cell = (FONT_W + 1) * it->scale;
+    if (!st->text || strlen(st->text) != n) {
+        free(st->pattern);
+        st->len = text_width(text, it->scale);
+        st->pattern = calloc(st->len + 1, IMAGE_ROWS/8);
+        if (!st->pattern) {
+            fputs("malloc failed\n", stderr);
+            st->len = 0;
+            free(st->text);
+            st->text = NULL;
+            free(text);
+            return 1;
+        }
+        draw_text(st->pattern, st->len, 0, it->y, it->scale, text);
+        w->glyphs += n;
+    } else {
+        for (i = 0; i < n; ++i) {
+            if (text[i] == st->text[i]) {
+                ++w->reused;
+                continue;
+            }
+            unsigned x = i * cell;
+            unsigned len = st->len - x < cell ? st->len - x : cell;
+            memset(st->pattern + x * (IMAGE_ROWS/8), 0,
+                    len * (IMAGE_ROWS/8));
+            draw_glyph(st->pattern, st->len, x, it->y, it->scale,
+                    (unsigned char)text[i]);
+            ++w->glyphs;
+        }
+    }
+    free(st->text);
+    st->text = text;
+    return 0;
+}
+
+/*======================================================================
+  Render the layout for a record: the base, with the fields over it.
+  The cause of a failure is reported here, the record by the caller
+*/
+int merge_render(struct worker_t *w, const struct record_t *rec,
+        uint8_t **pat, unsigned *size)
+{
+    unsigned length = layout.base_len, i;
+    for (i = 0; i < layout.count; ++i) {
+        const struct item_t *it = &layout.items[i];
+        if (!it->field)
+            continue;
+        char *text = merge_text(rec, it->text);
+        if (!text) {
+            fputs("malloc failed\n", stderr);
+            return 1;
+        }
+        if (strip_update(w, &w->strips[i], it, text))
+            return 1;
+        int end = it->x + (int)w->strips[i].len;
+        if (!layout.length && end > (int)length)
+            length = end;
+    }
+
+    uint8_t *p = NULL;
+    if (length) {
+        p = malloc(length * (IMAGE_ROWS/8));
+        if (!p) {
+            fputs("malloc failed\n", stderr);
+            return 1;
+        }
+        memcpy(p, layout.base, layout.base_len * (IMAGE_ROWS/8));
+        memset(p + layout.base_len * (IMAGE_ROWS/8), 0,
+                (length - layout.base_len) * (IMAGE_ROWS/8));
+    }
+    for (i = 0; p && i < layout.count; ++i) {
+        const struct item_t *it = &layout.items[i];
+        if (it->field)
+            rop_blit(p, length, it->x, w->strips[i].pattern,
+                    w->strips[i].len, ROP_OR);
+    }
+
+    *pat = p;
+    *size = length * (IMAGE_ROWS/8);
+    return 0;
+}
+
+/*======================================================================
+  Render pipeline: records go in a ring of slots, in order; workers
+  render any pending slot, the printing side takes them in order
+*/
+enum SLOTSTATE_T {
+    SLOT_FREE,
+    SLOT_PENDING,
+    SLOT_RENDERING,
+    SLOT_DONE
+};
+
+struct slot_t {
+    enum SLOTSTATE_T state;
+    unsigned long seq;
+    struct record_t rec;
+    uint8_t *pattern;
+    unsigned size;
+    int rc;
+};
+
+struct slot_t *merge_slots;
+unsigned merge_nslots;
+_Bool merge_end;
+pthread_mutex_t merge_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t merge_work = PTHREAD_COND_INITIALIZER;
+pthread_cond_t merge_done = PTHREAD_COND_INITIALIZER;
+
+static void *merge_worker(void *arg)
+{
+    struct worker_t *w = arg;
+    pthread_mutex_lock(&merge_lock);
+    for (;;) {
+        struct slot_t *s = NULL;
+        unsigned i;
+        for (i = 0; i < merge_nslots; ++i) {
+            struct slot_t *t = &merge_slots[i];
+            if (t->state == SLOT_PENDING && (!s || t->seq < s->seq))
+                s = t;
+        }
+        if (!s) {
+            if (merge_end)
+                break;
+            pthread_cond_wait(&merge_work, &merge_lock);
+            continue;
+        }
+        s->state = SLOT_RENDERING;
+        pthread_mutex_unlock(&merge_lock);
+
+        s->rc = merge_render(w, &s->rec, &s->pattern, &s->size);
+
+        pthread_mutex_lock(&merge_lock);
+        s->state = SLOT_DONE;
+        pthread_cond_broadcast(&merge_done);
+    }
+    pthread_mutex_unlock(&merge_lock);
+    return NULL;
+}
+
+/*======================================================================
+  Release the layout and the CSV header
+*/
+void layout_free(void)
+{
+    unsigned i;
+    for (i = 0; i < layout.count; ++i) {
+        free(layout.items[i].text);
+        free(layout.items[i].pattern);
+    }
+    free(layout.items);
+    free(layout.base);
+    layout.items = NULL;
+    layout.base = NULL;
+    layout.count = 0;
+    csv_free(&csv_header);
+}
+
+/*======================================================================
+  Run the mail-merge mode on a CSV file (the standard input if none)
+*/
+int run_merge(const char *layout_path, int nargs, char **args)
+{
+    if (layout_load(layout_path) || layout_base())
+        return 1;
+    FILE *f = NULL;
+    if (!layout.labels) {
+        f = stdin;
+        if (nargs > 0 && !(f = fopen(args[0], "r"))) {
+            perror(args[0]);
+            return 1;
+        }
+        if (csv_read(f, &csv_header)) {
+            fputs("CSV header missing\n", stderr);
+            return 1;
+        }
+    }
+
+    unsigned nthreads = opt_threads;
+    if (!nthreads) {
+        long n = sysconf(_SC_NPROCESSORS_ONLN);
+        nthreads = n > 0 ? n : 1;
+    }
+    merge_nslots = nthreads * 4;
+    merge_slots = calloc(merge_nslots, sizeof *merge_slots);
+    pthread_t *threads = calloc(nthreads, sizeof *threads);
+    struct worker_t *workers = calloc(nthreads, sizeof *workers);
+    if (!merge_slots || !threads || !workers) {
+        fputs("malloc failed\n", stderr);
+        return 1;
+    }
+    unsigned i;
+    for (i = 0; i < nthreads; ++i) {
+        workers[i].strips = calloc(layout.count + 1, sizeof(struct strip_t));
+        if (!workers[i].strips) {
+            fputs("malloc failed\n", stderr);
+            return 1;
+        }
+    }
+
+    if (printer_open())
         return 1;
+    unsigned started;
+    for (started = 0; started < nthreads; ++started) {
+        if (pthread_create(&threads[started], NULL, merge_worker,
+                    &workers[started])) {
+            fputs("Can't start the render threads\n", stderr);
+            break;
+        }
+    }
+    struct settings_t set;
+    settings_default(&set);
+
+    unsigned long fed = 0, printed = 0, skipped = 0;
+    _Bool eof = !started;
+    int rc = !started;
+    double t0 = now_ms();
+    for (;;) {
+        /* Only this side touches free slots */
+        while (!eof && fed - printed < merge_nslots) {
+            struct slot_t *s = &merge_slots[fed % merge_nslots];
+            if (layout.labels ? fed == layout.labels : csv_read(f, &s->rec)) {
+                eof = true;
+                break;
+            }
+            s->rec.seq = fed;
+            pthread_mutex_lock(&merge_lock);
+            s->seq = fed++;
+            s->state = SLOT_PENDING;
+            pthread_cond_signal(&merge_work);
+            pthread_mutex_unlock(&merge_lock);
+        }
+        if (printed == fed)
+            break;
+
+        struct slot_t *s = &merge_slots[printed % merge_nslots];
+        pthread_mutex_lock(&merge_lock);
+        while (s->state != SLOT_DONE)
+            pthread_cond_wait(&merge_done, &merge_lock);
+        pthread_mutex_unlock(&merge_lock);
+
+        if (s->rc || !s->pattern) {
+            fprintf(stderr, "Record %lu: %s, skipped\n", s->seq + 1,
+                    s->rc ? "can't render" : "empty label");
+            ++skipped;
+        } else if (!rc) {
+            rc = printer_check_status() || printer_reset() ||
+                printer_setup(&set) ||
+                printer_send_raster(s->pattern, s->size);
+            /* The standard program does this even in the success case */
+            printer_cancel_job();
+            if (rc) {
+                fprintf(stderr, "Record %lu: print failed\n", s->seq + 1);
+                eof = true;
+            }
+        }
+        free(s->pattern);
+        s->pattern = NULL;
+        csv_free(&s->rec);
+        s->state = SLOT_FREE;
+        ++printed;
+    }
+
+    pthread_mutex_lock(&merge_lock);
+    merge_end = true;
+    pthread_cond_broadcast(&merge_work);
+    pthread_mutex_unlock(&merge_lock);
+    unsigned long glyphs = 0, reused = 0;
+    for (i = 0; i < nthreads; ++i) {
+        if (i < started)
+            pthread_join(threads[i], NULL);
+        glyphs += workers[i].glyphs;
+        reused += workers[i].reused;
+        unsigned j;
+        for (j = 0; j < layout.count; ++j) {
+            free(workers[i].strips[j].text);
+            free(workers[i].strips[j].pattern);
+        }
+        free(workers[i].strips);
+    }
+
+    fprintf(stderr, "%lu records, %lu skipped, %.0f ms with %u threads\n",
+            printed, skipped, now_ms() - t0, started);
+    if (dump_comm) {
+        fprintf(stderr, "Fields: %lu characters drawn, %lu kept\n",
+                glyphs, reused);
+        if (mcache_hits + mcache_misses)
+            fprintf(stderr, "Symbols: %lu encoded, %lu from cache\n",
+                    mcache_misses, mcache_hits);
+    }
+    printer_close();
+    if (f && f != stdin)
+        fclose(f);
+    free(threads);
+    free(workers);
+    free(merge_slots);
+    layout_free();
+    return rc;
+}
+
+/*======================================================================
+  Option handling
+*/
+void handle_options(int argc, char **argv)
+{
+    int opt;
+    while ((opt = getopt(argc, argv, "hvFCHLAOm:t:c:d:D:W:T:l:i:u:p:q:P:U:S:R:M:j:X:f:B:g:s:r:")) != -1) {
+        switch (opt) {
+        case 'v':
+            dump_comm = true;
+            break;
+        case 'F':
+            opt_operation = OPERATION_FEED;
+            break;
+        case 'C':
+            opt_operation = OPERATION_CUT;
+            break;
+        case 'H':
+            opt_operation = OPERATION_HALFCUT;
+            break;
+        case 'L':
+            opt_loop = true;
+            break;
+        case 'A':
+            opt_trim = true;
+            break;
+        case 'm':
+            if (margin_code(atoi(optarg), &opt_margin)) {
+                fputs("Invalid margin setting\n", stderr);
+                exit(1);
+            }
+            break;
+        case 'c':
+            if (cutter_code(atoi(optarg), &opt_cutter)) {
+                fputs("Invalid cutter setting\n", stderr);
+                exit(1);
+            }
+            break;
+        case 'd':
+            if (density_code(atoi(optarg), &opt_density)) {
+                fputs("Invalid print density setting\n", stderr);
+                exit(1);
+            }
+            break;
+        case 'D':
+            opt_device = optarg;
+            break;
+        case 'W':
+            opt_prewarm = atoi(optarg);
+            break;
+        case 'T':
+            opt_trigger = optarg;
+            break;
+        case 'O':
+            opt_overlap = true;
+            break;
+        case 'p':
+            if (sscanf(optarg, "%u,%u", &opt_probe, &opt_probe_load) < 1 ||
+                    !opt_probe || opt_probe_load > 1024) {
+                fputs("Invalid probe count\n", stderr);
+                exit(1);
+            }
+            break;
+        case 'u':
+            opt_tune = atoi(optarg);
+            if (opt_tune < 1 || opt_tune > 65536) {
+                fputs("Invalid test label length\n", stderr);
+                exit(1);
+            }
+            break;
+        case 'i':
+            if (!strcmp(optarg, "full")) {
+                opt_setup = SETUP_FULL;
+            } else if (!strcmp(optarg, "minimal")) {
+                opt_setup = SETUP_MINIMAL;
+            } else {
+                fputs("Invalid setup profile\n", stderr);
+                exit(1);
+            }
+            break;
+        case 'l':
+            opt_live = atoi(optarg);
+            if (opt_live < 0) {
+                fputs("Invalid deadline\n", stderr);
+                exit(1);
+            }
+            break;
+        case 'P':
+            opt_tcp = optarg;
+            opt_loop = true;
+            break;
+        case 'U':
+            opt_unix = optarg;
+            opt_loop = true;
+            break;
+        case 'S':
+            opt_shm = optarg;
+            opt_loop = true;
+            break;
+        case 'q': {
+            size_t kbytes = opt_quota_bytes >> 10;
+            if (sscanf(optarg, "%u,%zu,%d", &opt_quota_jobs, &kbytes,
+                        &opt_quota_priority) < 1 ||
+                    !opt_quota_jobs || !kbytes) {
+                fputs("Invalid quota\n", stderr);
+                exit(1);
+            }
+            opt_quota_bytes = kbytes << 10;
+            break;
+        }
+        case 'M':
+            opt_merge = optarg;
+            break;
+        case 'X':
+            opt_text = optarg;
+            break;
+        case 'B':
+            opt_barcode = optarg;
+            break;
+        case 's':
+            if (strcmp(optarg, "nearest") == 0) {
+                opt_scale = SCALE_NEAREST;
+            } else if (strcmp(optarg, "box") == 0) {
+                opt_scale = SCALE_BOX;
+            } else if (strcmp(optarg, "area") == 0) {
+                opt_scale = SCALE_AREA;
+            } else {
+                fputs("Invalid scaling filter\n", stderr);
+                exit(1);
+            }
+            break;
+        case 'r': {
+            int deg = atoi(optarg);
+            if (deg % 90 || deg < 0 || deg > 270) {
+                fputs("Invalid rotation\n", stderr);
+                exit(1);
+            }
+            opt_rotate = deg / 90;
+            break;
+        }
+        case 'g': {
+            unsigned level = 128;
+            char junk;
+            if (strcmp(optarg, "fs") == 0) {
+                opt_dither = DITHER_FS;
+            } else if (strcmp(optarg, "ordered") == 0) {
+                opt_dither = DITHER_ORDERED;
+            } else if (strcmp(optarg, "threshold") == 0 ||
+                    (sscanf(optarg, "threshold,%u%c", &level, &junk) == 1 &&
+                     level <= 255)) {
+                opt_dither = DITHER_THRESHOLD;
+                opt_threshold = level;
+            } else {
+                fputs("Invalid dithering\n", stderr);
+                exit(1);
+            }
+            break;
+        }
+        case 'f':
+            opt_font = optarg;
+            break;
+        case 'j':
+            opt_threads = atoi(optarg);
+            break;
+        case 'R': {
+            char *end;
+            unsigned long mb = strtoul(optarg, &end, 10);
+            if (*end || mb > SIZE_MAX >> 20) {
+                fputs("Invalid raster cache size\n", stderr);
+                exit(1);
+            }
+            opt_raster_cache = (size_t)mb << 20;
+            break;
+        }
+        case 't':
+            if (tape_code(atoi(optarg), &opt_tape)) {
+                fputs("Invalid tape size\n", stderr);
+                exit(1);
+            }
+            break;
+
+        case 'h':
+        default:
+            fprintf(stderr, "Usage: %s [OPTION]... [-L [[WEIGHT[,PRIORITY]:]INPUT]...]\n"
+                    "       %s [OPTION]... -M LAYOUT [CSV]\n", argv[0], argv[0]);
+            fputs("Prints the PBM on the standard input\n", stderr);
+            fputs("  -F          Feed the tape an exit\n", stderr);
+            fputs("  -C          Cut the tape an exit\n", stderr);
+            fputs("  -H          Half-cut the tape an exit\n", stderr);
+            fputs("  -L          Keep running, printing each PBM on the input\n", stderr);
+            fputs("  -A          Trim the blank columns at both ends of images\n", stderr);
+            fputs("  -O          Upload each page while the last one is printed, and\n", stderr);
+            fputs("              send the setup commands back to back\n", stderr);
+            fputs("  -i profile  Setup handshake: full (default) or minimal\n", stderr);
+            fputs("  -p count[,threads] Time count status queries to the printer, with\n", stderr);
+            fputs("              threads loading the host meanwhile\n", stderr);
+            fputs("  -u columns  Tune the transfer to the printer, printing blank labels\n", stderr);
+            fputs("              of that length, and keep the result for its serial\n", stderr);
+            fputs("  -m margin   Margin (0 none, *1 small, 2 medium, 3 large)\n", stderr);
+            fputs("  -t tapesize Tape width in mm (6, 9, *12, 18, 24)\n", stderr);
+            fputs("  -c cutmode  Cut more (0 no cut, *1 half-cut, 2 full-cut)\n", stderr);
+            fputs("  -d density  Set print density (1-5, default 3)\n", stderr);
+            fputs("  -D device   Printer device node, bus-port path or fd:N\n", stderr);
+            fputs("  -W seconds  With -L, handshake in advance while idle\n", stderr);
+            fputs("  -T trigger  Print on each trigger (fifo:path, unix:path, signal)\n", stderr);
+            fputs("  -l ms       Print the raw columns streamed on the standard input,\n", stderr);
+            fputs("              at most ms after they are received\n", stderr);
+            fputs("  -q jobs[,KB[,priority]] With -L, queue quota and highest\n", stderr);
+            fputs("              job priority for each client\n", stderr);
+            fputs("  -P [host:]port Accept PBM streams on a TCP port (implies -L);\n", stderr);
+            fputs("              an IPv6 host goes in brackets, as [::1]:9100\n", stderr);
+            fputs("  -U path     Accept PBM streams on a local socket (implies -L)\n", stderr);
+            fputs("  -S path     Accept shared memory images on a local socket (implies -L)\n", stderr);
+            fputs("  -R MB       Size of the raster cache, 0 to disable (default 16)\n", stderr);
+            fputs("  -X text     Print the text instead of a PBM, as large as the tape allows\n", stderr);
+            fputs("  -f font     BDF or PSF font for -X (default built-in 5x7)\n", stderr);
+            fputs("  -B type[,module]:data  Print a barcode instead of a PBM: code128,\n", stderr);
+            fputs("              ean13, code39, qr (or qr-l, qr-m, qr-q, qr-h) or datamatrix,\n", stderr);
+            fputs("              module width in dots\n", stderr);
+            fputs("  -s filter   Scale images to the printable height of the tape, keeping\n", stderr);
+            fputs("              their aspect: nearest, box or area\n", stderr);
+            fputs("  -r degrees  Turn images clockwise by 90, 180 or 270 degrees\n", stderr);
+            fputs("  -g dither   Dithering of gray and scaled images: fs (default), ordered or\n", stderr);
+            fputs("              threshold[,level] with level from 0 to 255 (default 128)\n", stderr);
+            fputs("  -M layout   Print a label with the layout for each record of the CSV\n", stderr);
+            fputs("              file given (or on the standard input)\n", stderr);
+            fputs("  -j threads  With -M, render threads (default one for each CPU)\n", stderr);
+            fputs("  -v          Verbose (dump USB communications)\n", stderr);
+            fputs("  -h          Display this help and exit\n", stderr);
+            exit(1);
+        }
     }
+}
+
+/*======================================================================
+  Main
+*/
+int main(int argc, char **argv)
+{
+    handle_options(argc, argv);
+    if (opt_trigger && opt_operation == OPERATION_PRINT)
+        return run_trigger(opt_trigger);
+    if (opt_live >= 0 && opt_operation == OPERATION_PRINT)
+        return run_live(opt_live);
+    if (opt_tune && opt_operation == OPERATION_PRINT)
+        return run_tune(opt_tune);
+    if (opt_probe && opt_operation == OPERATION_PRINT)
+        return run_probe(opt_probe, opt_probe_load);
+    if (opt_merge && opt_operation == OPERATION_PRINT)
+        return run_merge(opt_merge, argc - optind, argv + optind);
+    if (opt_loop && opt_operation == OPERATION_PRINT)
+        return run_loop(argc - optind, argv + optind);
+
+    _Bool need_cancel = false;
+    _Bool tiled = false;
+    int rc = printer_open();
+    if (rc)
+        return 1;
 
     /* Sequenza standard */
     printer_check_status();
@@ -713,29 +7775,33 @@ int main(int argc, char **argv)
         printer_tape_halfcut();
         break;
     case OPERATION_PRINT:
-        /* Read and prepare the image to be printed */
-        rc = load_image(stdin);
-        if (rc)
-            return 1;
+        /* Read and prepare the image to be printed, or only its header
+           when it is a long banner to be read in tiles */
+        tiled = !opt_barcode && !opt_text &&
+            tiles_open(&banner_tiles, STDIN_FILENO);
+        if (tiled) {
+            if (dump_comm)
+                fprintf(stderr, "Banner: %u columns in %u tiles\n",
+                        banner_tiles.width,
+                        (banner_tiles.width + TILE_COLS - 1) / TILE_COLS);
+        } else {
+            rc = load_label();
+            if (dump_comm && opt_raster_cache)
+                fprintf(stderr, "Raster cache %s\n",
+                        raster_hits ? "hit" : "miss");
+            if (rc)
+                return 1;
+            if (dump_comm)
+                pattern_report();
+        }
 
+        struct settings_t set;
+        settings_default(&set);
         if (!need_cancel)
-            need_cancel = printer_prejob();
-        if (!need_cancel)
-            need_cancel = printer_check_tape(opt_tape);
-        if (!need_cancel)
-            need_cancel = printer_reset();
+            need_cancel = printer_setup(&set);
         if (!need_cancel)
-            need_cancel = printer_set_speed();
-        if (!need_cancel)
-            need_cancel = printer_set_margin(opt_margin);
-        if (!need_cancel)
-            need_cancel = printer_set_density(opt_density);
-        if (!need_cancel)
-            need_cancel = printer_set_cutter(opt_cutter);
-        if (!need_cancel)
-            need_cancel = printer_check_status();
-        if (!need_cancel)
-            need_cancel = printer_send_raster(pattern, pattern_size);
+            need_cancel = tiled ? printer_send_tiles(&banner_tiles) :
+                printer_send_raster(pattern, pattern_size);
 
         /* The standard program does this even in the success case */
         printer_cancel_job();
@@ -743,9 +7809,7 @@ int main(int argc, char **argv)
     }
 
     /* Cleanup */
-    libusb_release_interface(devhnd, KLG2_IFACE);
-    libusb_close(devhnd);
-    libusb_exit(NULL);
+    printer_close();
 
     return 0;
 }
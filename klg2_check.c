@@ -0,0 +1,1072 @@
+/*
+    KL-G2 Printer Utility - self tests
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/* The program is a single file: it is built in here, without its main */
+#define main klg2_main
+#include "klg2.c"
+#undef main
+
+unsigned checks, failures;
+
+#define CHECK(cond) check((cond), #cond, __LINE__)
+
+static void check(int ok, const char *what, int line)
+{
+    ++checks;
+    if (!ok) {
+        ++failures;
+        fprintf(stderr, "klg2_check.c:%d: failed: %s\n", line, what);
+    }
+}
+
+/* A reproducible pattern, with blank and repeated columns */
+static uint32_t seed = 1;
+
+static uint8_t random_byte(void)
+{
+    seed = seed * 1103515245 + 12345;
+    return seed >> 16;
+}
+
+static void pattern_fill(uint8_t *pat, unsigned len)
+{
+    unsigned x, k;
+    for (x = 0; x < len; ++x) {
+        uint8_t *c = COLUMN(pat, x);
+        unsigned kind = random_byte() % 4;
+        if (kind == 0 || x == 0)
+            memset(c, 0, IMAGE_ROWS/8);
+        else if (kind == 1)
+            memcpy(c, COLUMN(pat, x - 1), IMAGE_ROWS/8);
+        else
+            for (k = 0; k < IMAGE_ROWS/8; ++k)
+                c[k] = random_byte();
+    }
+}
+
+/*======================================================================
+  Frames of the trigger mode: exactly as many as counted, each block
+  within a page, every byte of the raster once and in order
+*/
+static void check_frames(void)
+{
+    static const unsigned blocks[] = { 60, 48, 32, 1 };
+    static const unsigned pages[] = { 8192, 4096, 2048, 16 };
+    static uint8_t raw[1700 * (IMAGE_ROWS/8)];
+    unsigned b, p, cols, i;
+    pattern_fill(raw, 1700);
+    for (b = 0; b < sizeof blocks / sizeof *blocks; ++b) {
+        for (p = 0; p < sizeof pages / sizeof *pages; ++p) {
+            xfer.block = blocks[b];
+            xfer.page = pages[p];
+            for (cols = 1; cols <= 1700; cols += cols < 520 ? 1 : 97) {
+                unsigned size = cols * (IMAGE_ROWS/8), n, at = 0, page = 0;
+                struct frame_t *frames;
+                if (frames_build(raw, size, &frames, &n)) {
+                    CHECK(!"frames_build");
+                    continue;
+                }
+                CHECK(n == frames_count(size));
+                _Bool ok = true;
+                for (i = 0; i < n && ok; ++i) {
+                    const struct frame_t *f = &frames[i];
+                    if (f->type == FRAME_BLOCK) {
+                        unsigned len = f->data[2];
+                        ok = len >= 1 && len <= xfer.block &&
+                            page + len <= xfer.page &&
+                            f->len == len + 4 && f->data[0] == PRINTER_STX &&
+                            !memcmp(f->data + 4, raw + at, len);
+                        at += len;
+                        page += len;
+                    } else if (f->type == FRAME_PRINT_PAGE) {
+                        ok = page > 0;
+                        page = 0;
+                    } else {
+                        ok = at == size;
+                    }
+                }
+                CHECK(ok);
+                CHECK(at == size);
+                CHECK(n >= 2 && frames[n - 1].type == FRAME_PRINT_PAGE &&
+                        frames[n - 2].type == FRAME_RASTER_END);
+                free(frames);
+            }
+        }
+    }
+    xfer = (struct transfer_t)TRANSFER_DEFAULT;
+}
+
+/*======================================================================
+  Trigger sources: a byte written to the FIFO, a datagram on the
+  socket or a SIGUSR1 each make one byte to read; SIGTERM stops
+*/
+static _Bool trigger_ready(int fd)
+{
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+    uint8_t buf[8];
+    return poll(&pfd, 1, 1000) == 1 && read(fd, buf, sizeof buf) == 1;
+}
+
+static void check_trigger(void)
+{
+    char dir[] = "/tmp/klg2_check.XXXXXX", spec[64];
+    CHECK(mkdtemp(dir) != NULL);
+
+    /* Opened twice: the FIFO is there already the second time */
+    snprintf(spec, sizeof spec, "fifo:%s/fifo", dir);
+    unsigned i;
+    for (i = 0; i < 2; ++i) {
+        int fd = trigger_open(spec);
+        CHECK(fd >= 0);
+        if (fd < 0)
+            break;
+        int wr = open(spec + 5, O_WRONLY | O_NONBLOCK);
+        CHECK(wr >= 0 && write(wr, "", 1) == 1);
+        CHECK(trigger_ready(fd));
+        if (wr >= 0)
+            close(wr);
+        close(fd);
+    }
+    unlink(spec + 5);
+
+    /* A stale socket file is replaced */
+    snprintf(spec, sizeof spec, "unix:%s/sock", dir);
+    for (i = 0; i < 2; ++i) {
+        int fd = trigger_open(spec);
+        CHECK(fd >= 0);
+        if (fd < 0)
+            break;
+        struct sockaddr_un addr = { .sun_family = AF_UNIX };
+        strcpy(addr.sun_path, spec + 5);
+        int wr = socket(AF_UNIX, SOCK_DGRAM, 0);
+        CHECK(wr >= 0 && sendto(wr, "", 1, 0, (struct sockaddr *)&addr,
+                    sizeof addr) == 1);
+        CHECK(trigger_ready(fd));
+        if (wr >= 0)
+            close(wr);
+        close(fd);
+    }
+    unlink(spec + 5);
+    rmdir(dir);
+
+    int fd = trigger_open("signal");
+    CHECK(fd >= 0);
+    if (fd >= 0) {
+        struct sigaction sa = { .sa_handler = trigger_signal }, old[2];
+        sigaction(SIGUSR1, &sa, &old[0]);
+        sigaction(SIGTERM, &sa, &old[1]);
+        raise(SIGUSR1);
+        CHECK(trigger_ready(fd));
+        CHECK(!trigger_stop);
+        raise(SIGTERM);
+        CHECK(trigger_stop);
+        sigaction(SIGUSR1, &old[0], NULL);
+        sigaction(SIGTERM, &old[1], NULL);
+        trigger_stop = 0;
+        close(trigger_pipe[0]);
+        close(trigger_pipe[1]);
+        trigger_pipe[0] = trigger_pipe[1] = -1;
+    }
+
+    CHECK(trigger_open("tcp:9100") < 0);
+    char path[160];
+    memset(path, 'x', sizeof path);
+    memcpy(path, "unix:/", 6);
+    path[sizeof path - 1] = '\0';
+    CHECK(trigger_open(path) < 0);
+}
+
+/*======================================================================
+  PBM and PGM headers: the size of the image as soon as it is known
+*/
+static void check_pnm(void)
+{
+    struct pnm_t h;
+    const char *p4 = "P4\n# comment\n10 3\n";
+    CHECK(pnm_parse((const uint8_t *)p4, strlen(p4), &h) ==
+            (long)strlen(p4) + 2 * 3);
+    CHECK(h.format == '4' && h.width == 10 && h.height == 3);
+    CHECK(h.offset == strlen(p4));
+    CHECK(pnm_parse((const uint8_t *)"P4 10", 5, &h) == 0);
+    CHECK(pnm_parse((const uint8_t *)"P", 1, &h) == 0);
+    CHECK(pnm_parse((const uint8_t *)"P6 1 1 255\n", 11, &h) == -1);
+    CHECK(pnm_parse((const uint8_t *)"P4 x 1\n", 7, &h) == -1);
+
+    const char *p5 = "P5 4 2 65535\n";
+    CHECK(pnm_parse((const uint8_t *)p5, strlen(p5), &h) ==
+            (long)strlen(p5) + 4 * 2 * 2);
+    CHECK(h.maxval == 65535);
+    CHECK(pnm_parse((const uint8_t *)"P5 4 2 0\n", 9, &h) == -1);
+
+    /* Plain: complete only with the last pixel */
+    const char *p1 = "P1 3 2\n1 0 1\n0 1";
+    CHECK(pnm_parse((const uint8_t *)p1, strlen(p1), &h) == 0);
+    const char *p1full = "P1 3 2\n1 0 1\n0 1 1\n";
+    CHECK(pnm_parse((const uint8_t *)p1full, strlen(p1full), &h) ==
+            (long)strlen(p1full) - 1);
+    CHECK(pnm_parse((const uint8_t *)"P1 1 1\n2\n", 9, &h) == -1);
+}
+
+/*======================================================================
+  The disk raster cache: the total recorded along with each store, and
+  the least recently used patterns removed once it crosses the limit
+*/
+static unsigned raster_dir_bytes(const char *dir, size_t *bytes)
+{
+    DIR *d = opendir(dir);
+    struct dirent *de;
+    unsigned count = 0;
+    *bytes = 0;
+    while (d && (de = readdir(d))) {
+        struct stat st;
+        if (strlen(de->d_name) == 32 &&
+                !fstatat(dirfd(d), de->d_name, &st, 0)) {
+            ++count;
+            *bytes += st.st_size;
+        }
+    }
+    if (d)
+        closedir(d);
+    return count;
+}
+
+static void check_raster_disk(void)
+{
+    char home[] = "/tmp/klg2_check.XXXXXX", dir[64], path[PATH_MAX];
+    CHECK(mkdtemp(home) != NULL);
+    setenv("XDG_CACHE_HOME", home, 1);
+    snprintf(dir, sizeof dir, "%s/" RASTER_DIR, home);
+
+    size_t file = sizeof(struct raster_file_t) + 100 * (IMAGE_ROWS/8);
+    size_t total, bytes;
+    struct raster_key_t keys[5];
+    unsigned i, count;
+    opt_raster_cache = 3 * file + 10;
+    for (i = 0; i < 5; ++i) {
+        image_w = 100;
+        pattern_size = 100 * (IMAGE_ROWS/8);
+        pattern = calloc(1, pattern_size);
+        CHECK(pattern != NULL);
+        if (!pattern)
+            break;
+        pattern[i] = i + 1;
+        raster_key(&keys[i], pattern, pattern_size);
+        raster_disk_store(&keys[i]);
+        free(pattern);
+        pattern = NULL;
+
+        count = raster_dir_bytes(dir, &bytes);
+        int fd = open(dir, O_RDONLY | O_DIRECTORY);
+        CHECK(fd >= 0 && !raster_disk_total(fd, &total) && total == bytes);
+        if (fd >= 0)
+            close(fd);
+        CHECK(count == (i < 3 ? i + 1 : 3));
+
+        /* A lost total is found again by listing */
+        if (i == 1) {
+            snprintf(path, sizeof path, "%s/" RASTER_TOTAL, dir);
+            CHECK(unlink(path) == 0);
+        }
+    }
+
+    /* Those still there load back */
+    unsigned loaded = 0;
+    for (i = 0; i < 5; ++i) {
+        if (!raster_disk_load(&keys[i])) {
+            ++loaded;
+            CHECK(pattern_size == 100 * (IMAGE_ROWS/8) &&
+                    pattern[i] == i + 1);
+            free(pattern);
+            pattern = NULL;
+        }
+    }
+    CHECK(loaded == 3);
+
+    DIR *d = opendir(dir);
+    struct dirent *de;
+    while (d && (de = readdir(d)))
+        unlinkat(dirfd(d), de->d_name, 0);
+    if (d)
+        closedir(d);
+    rmdir(dir);
+    rmdir(home);
+    unsetenv("XDG_CACHE_HOME");
+    opt_raster_cache = 16 << 20;
+}
+
+/*======================================================================
+  CSV records: quotes, doubled quotes, line breaks in fields, empty
+  trailing fields and blank lines
+*/
+static void check_csv(void)
+{
+    static const char text[] =
+        "id,desc,owner\r\n"
+        "\n"
+        "A1,\"Desk, \"\"big\"\"\",\n"
+        "A2,\"two\nlines\",Room 2";
+    FILE *f = fmemopen((void *)text, sizeof text - 1, "r");
+    struct record_t rec = { 0 };
+    CHECK(f != NULL);
+    if (!f)
+        return;
+    CHECK(csv_read(f, &rec) == 0);
+    CHECK(rec.count == 3 && !strcmp(rec.fields[2], "owner"));
+    csv_free(&rec);
+    CHECK(csv_read(f, &rec) == 0);
+    CHECK(rec.count == 3);
+    CHECK(rec.count == 3 && !strcmp(rec.fields[1], "Desk, \"big\""));
+    CHECK(rec.count == 3 && !strcmp(rec.fields[2], ""));
+    csv_free(&rec);
+    CHECK(csv_read(f, &rec) == 0);
+    CHECK(rec.count == 3 && !strcmp(rec.fields[1], "two\nlines"));
+    CHECK(rec.count == 3 && !strcmp(rec.fields[2], "Room 2"));
+    csv_free(&rec);
+    CHECK(csv_read(f, &rec) == 1);
+    fclose(f);
+}
+
+/*======================================================================
+  Fields of a layout text: by column name or number, {{ and {serial}
+*/
+static void check_merge_text(void)
+{
+    static const char text[] = "id,name\n7,Desk\n";
+    FILE *f = fmemopen((void *)text, sizeof text - 1, "r");
+    struct record_t rec = { 0 };
+    CHECK(f != NULL);
+    if (!f)
+        return;
+    CHECK(csv_read(f, &csv_header) == 0);
+    CHECK(csv_read(f, &rec) == 0);
+    fclose(f);
+
+    layout.serial = 100;
+    layout.serial_digits = 5;
+    rec.seq = 3;
+    char *s = merge_text(&rec, "{name} #{id} {{x} {2}/{3} {serial} {nope}");
+    CHECK(s && !strcmp(s, "Desk #7 {x} Desk/ 00103 "));
+    free(s);
+    layout.serial_step = -2;
+    s = merge_text(&rec, "{serial}{");
+    CHECK(s && !strcmp(s, "00094{"));
+    free(s);
+
+    layout.serial = 0;
+    layout.serial_step = 1;
+    layout.serial_digits = 0;
+    csv_free(&rec);
+    csv_free(&csv_header);
+}
+
+/*======================================================================
+  Rendering a layout: a field drawn again only where it changed, and
+  a barcode with bad data failing every time, not only the first
+*/
+static void check_merge_render(void)
+{
+    char path[] = "/tmp/klg2_check.XXXXXX";
+    int fd = mkstemp(path);
+    CHECK(fd >= 0);
+    if (fd < 0)
+        return;
+    static const char lines[] =
+        "text 0 100 1 {1}\n"
+        "barcode 0 0 64 ean13,1:{1}\n";
+    CHECK(write(fd, lines, sizeof lines - 1) == sizeof lines - 1);
+    close(fd);
+    CHECK(layout_load(path) == 0 && layout_base() == 0);
+    unlink(path);
+
+    static const char text[] = "123\n123\n4006381333931\n4006381333932\n";
+    FILE *f = fmemopen((void *)text, sizeof text - 1, "r");
+    struct record_t rec[4] = { { 0 } };
+    unsigned i;
+    for (i = 0; f && i < 4; ++i)
+        CHECK(csv_read(f, &rec[i]) == 0);
+    if (f)
+        fclose(f);
+
+    struct worker_t w = { 0 };
+    w.strips = calloc(layout.count + 1, sizeof *w.strips);
+    uint8_t *pat = NULL;
+    unsigned size = 0;
+    CHECK(w.strips != NULL);
+    if (w.strips && layout.count == 2) {
+        CHECK(merge_render(&w, &rec[0], &pat, &size) == 1);
+        CHECK(merge_render(&w, &rec[1], &pat, &size) == 1);
+        CHECK(merge_render(&w, &rec[2], &pat, &size) == 0);
+        CHECK(pat && size == (95 + 18) * (IMAGE_ROWS/8));
+        free(pat);
+        pat = NULL;
+        unsigned long glyphs = w.glyphs, reused = w.reused;
+        CHECK(merge_render(&w, &rec[2], &pat, &size) == 0);
+        CHECK(pat && w.glyphs == glyphs && w.reused == reused + 13);
+        free(pat);
+        pat = NULL;
+        /* The check digit differs, and only its glyph is drawn */
+        CHECK(merge_render(&w, &rec[3], &pat, &size) == 1);
+        CHECK(w.strips[0].text &&
+                !strcmp(w.strips[0].text, "4006381333932") &&
+                !w.strips[1].text);
+        CHECK(w.glyphs == glyphs + 1);
+    }
+    for (i = 0; w.strips && i < layout.count; ++i) {
+        free(w.strips[i].text);
+        free(w.strips[i].pattern);
+    }
+    free(w.strips);
+    for (i = 0; i < 4; ++i)
+        csv_free(&rec[i]);
+    layout_free();
+}
+
+/*======================================================================
+  Reed-Solomon against the published examples: the QR "HELLO WORLD"
+  1-M symbol and the Data Matrix "123456" 10x10 symbol
+*/
+static void check_rs(void)
+{
+    static const uint8_t qr_data[16] = {
+        32, 91, 11, 120, 209, 114, 220, 77, 67, 64, 236, 17, 236, 17, 236, 17
+    };
+    static const uint8_t qr_ecc[10] = {
+        196, 35, 39, 119, 235, 215, 231, 226, 93, 23
+    };
+    static const uint8_t dm_data[3] = { 142, 164, 186 };
+    static const uint8_t dm_ecc[5] = { 114, 25, 5, 88, 102 };
+    uint8_t ecc[10];
+    rs_encode(&gf_qr, 0, qr_data, sizeof qr_data, ecc, sizeof qr_ecc);
+    CHECK(!memcmp(ecc, qr_ecc, sizeof qr_ecc));
+    rs_encode(&gf_dm, 1, dm_data, sizeof dm_data, ecc, sizeof dm_ecc);
+    CHECK(!memcmp(ecc, dm_ecc, sizeof dm_ecc));
+}
+
+/*======================================================================
+  QR symbols: one known answer, checked with an independent decoder,
+  then the function patterns and format information of larger ones
+*/
+static _Bool qr_finder(const uint8_t *m, unsigned n, unsigned x0,
+        unsigned y0)
+{
+    unsigned x, y;
+    for (y = 0; y < 7; ++y) {
+        for (x = 0; x < 7; ++x) {
+            unsigned d = x < y ? x : y, e = 6 - (x > y ? x : y);
+            _Bool dark = (d < e ? d : e) != 1;
+            if (m[(y0 + y) * n + x0 + x] != dark)
+                return false;
+        }
+    }
+    return true;
+}
+
+static void check_qr_symbol(const char *data, int ecl)
+{
+    static uint8_t m[MATRIX_MAX * MATRIX_MAX];
+    static const unsigned ecl_bits[] = { 1, 0, 3, 2 };
+    unsigned n, i;
+    CHECK(qr_encode((const uint8_t *)data, strlen(data), ecl, m, &n) == 0);
+    CHECK(n >= 21 && (n - 17) % 4 == 0);
+    CHECK(qr_finder(m, n, 0, 0) && qr_finder(m, n, n - 7, 0) &&
+            qr_finder(m, n, 0, n - 7));
+    _Bool timing = true;
+    for (i = 8; i < n - 8; ++i)
+        timing = timing && m[6 * n + i] == !(i & 1) &&
+            m[i * n + 6] == !(i & 1);
+    CHECK(timing);
+    CHECK(m[(n - 8) * n + 8]);
+
+    /* Both copies of the format information, a valid BCH code word */
+    unsigned a = 0, b = 0;
+    for (i = 0; i < 6; ++i)
+        a |= m[i * n + 8] << i;
+    a |= m[7 * n + 8] << 6 | m[8 * n + 8] << 7 | m[8 * n + 7] << 8;
+    for (i = 9; i < 15; ++i)
+        a |= m[8 * n + 14 - i] << i;
+    for (i = 0; i < 8; ++i)
+        b |= m[8 * n + n - 1 - i] << i;
+    for (i = 8; i < 15; ++i)
+        b |= m[(n - 15 + i) * n + 8] << i;
+    CHECK(a == b);
+    a ^= 0x5412;
+    unsigned rem = a >> 10;
+    for (i = 0; i < 10; ++i)
+        rem = (rem << 1) ^ ((rem >> 9) * 0x537);
+    CHECK((a >> 10 << 10 | rem) == a);
+    CHECK(a >> 13 == ecl_bits[ecl]);
+}
+
+static void check_qr(void)
+{
+    /* "klg2" at level M, mask 0 */
+    static const char *const known[21] = {
+        "111111100110101111111", "100000101011001000001",
+        "101110100011001011101", "101110100110101011101",
+        "101110101101101011101", "100000100111001000001",
+        "111111101010101111111", "000000000100000000000",
+        "101010100010100010010", "000110011001010100111",
+        "100110100111011100111", "111100001101110110001",
+        "111110100101011100000", "000000001010001000011",
+        "111111100010100011011", "100000100110001001010",
+        "101110101110101011011", "101110100001010101010",
+        "101110101011011100001", "100000100111110111010",
+        "111111101011011100111"
+    };
+    static uint8_t m[MATRIX_MAX * MATRIX_MAX];
+    unsigned n, x, y;
+    CHECK(qr_encode((const uint8_t *)"klg2", 4, 1, m, &n) == 0);
+    CHECK(n == 21);
+    _Bool same = n == 21;
+    for (y = 0; same && y < n; ++y)
+        for (x = 0; x < n; ++x)
+            same = same && m[y * n + x] == (known[y][x] == '1');
+    CHECK(same);
+
+    char text[400];
+    memset(text, 'y', sizeof text);
+    text[150] = '\0';
+    check_qr_symbol("https://example.com/asset/A00001", 0);
+    check_qr_symbol("Hello, world! 0123456789", 2);
+    check_qr_symbol(text, 3);
+    text[370] = '\0';
+    check_qr_symbol(text, 0);
+}
+
+/*======================================================================
+  Data Matrix: the finder and clock borders, and the capacity of the
+  largest symbol, 204 codewords
+*/
+static void check_dm(void)
+{
+    static uint8_t m[MATRIX_MAX * MATRIX_MAX];
+    unsigned n, i;
+    CHECK(dm_encode((const uint8_t *)"123456", 6, m, &n) == 0);
+    CHECK(n == 10);
+    _Bool border = true;
+    for (i = 0; i < n; ++i)
+        border = border && m[i * n] && m[(n - 1) * n + i] &&
+            m[i] == !(i & 1) && m[i * n + n - 1] == (i & 1);
+    CHECK(border);
+
+    uint8_t data[410];
+    memset(data, 'a', sizeof data);
+    CHECK(dm_encode(data, 204, m, &n) == 0);
+    CHECK(dm_encode(data, 205, m, &n) != 0);
+    /* Digit pairs take one codeword, upper half characters two */
+    memset(data, '1', sizeof data);
+    CHECK(dm_encode(data, 408, m, &n) == 0);
+    memset(data, 'a', sizeof data);
+    data[202] = 0xE9;
+    CHECK(dm_encode(data, 203, m, &n) == 0);
+    data[202] = 'a';
+    data[203] = 0xE9;
+    CHECK(dm_encode(data, 204, m, &n) != 0);
+}
+
+/*======================================================================
+  Compact patterns read back from any offset, in blocks of any size
+*/
+static void check_rle(void)
+{
+    static uint8_t pat[600 * (IMAGE_ROWS/8)], out[600 * (IMAGE_ROWS/8)];
+    unsigned width = 600, size = width * (IMAGE_ROWS/8);
+    pattern_fill(pat, width);
+    memset(COLUMN(pat, 100), 0, 200 * (IMAGE_ROWS/8));
+    struct rle_t *r = rle_encode(pat, width);
+    CHECK(r != NULL);
+    if (!r)
+        return;
+    CHECK(r->width == width);
+    CHECK(rle_bytes(r) < size);
+
+    static const unsigned offsets[] = { 0, 7, 16, 1600, 1601, 3200, 9583 };
+    unsigned i, step;
+    for (i = 0; i < sizeof offsets / sizeof *offsets; ++i) {
+        for (step = 1; step <= 64; step += 21) {
+            struct raster_reader_t rd;
+            unsigned at = offsets[i], k;
+            raster_reader_rle(&rd, r, at);
+            for (; at < size; at += k) {
+                k = size - at < step ? size - at : step;
+                if (raster_read(&rd, out + at, k))
+                    break;
+            }
+            CHECK(at == size &&
+                    !memcmp(out + offsets[i], pat + offsets[i],
+                        size - offsets[i]));
+        }
+    }
+    rle_free(r);
+
+    /* Blank only */
+    memset(pat, 0, size);
+    r = rle_encode(pat, width);
+    CHECK(r && r->ncols == 0 && r->nruns == 1);
+    rle_free(r);
+}
+
+/*======================================================================
+  Wide raw PBM compacted a tile at a time: the same runs as the whole
+  pattern decoded and compacted at once, across the tile boundaries
+*/
+static void check_rle_pbm(void)
+{
+    static const unsigned sizes[][2] = {
+        { 513, 7 }, { 1027, 64 }, { 1536, 128 }, { 2000, 130 }
+    };
+    unsigned i, x, y;
+    for (i = 0; i < sizeof sizes / sizeof *sizes; ++i) {
+        unsigned w = sizes[i][0], h = sizes[i][1], stride = (w + 7) / 8;
+        char head[32];
+        int hl = snprintf(head, sizeof head, "P4\n%u %u\n", w, h);
+        size_t len = hl + (size_t)stride * h;
+        uint8_t *img = calloc(1, len);
+        CHECK(img != NULL);
+        if (!img)
+            continue;
+        memcpy(img, head, hl);
+        /* Blank stretches over the tile boundaries, repeated columns */
+        for (y = 0; y < h; ++y)
+            for (x = 0; x < stride; ++x)
+                if (x < 40 || (x > 100 && x < 200) || x % 7 == 0)
+                    img[hl + y * stride + x] = x < 40 ? random_byte() :
+                        x % 7 == 0 ? 0x81 : 0;
+
+        struct rle_t *r = rle_encode_pbm(img, len);
+        CHECK(r != NULL);
+        CHECK(load_image(img, len) == 0);
+        struct rle_t *want = pattern ? rle_encode(pattern, image_w) : NULL;
+        if (r && want) {
+            CHECK(r->width == want->width && r->nruns == want->nruns &&
+                    r->ncols == want->ncols);
+            CHECK(r->nruns == want->nruns && !memcmp(r->runs, want->runs,
+                        r->nruns * sizeof *r->runs));
+            CHECK(r->ncols == want->ncols && !memcmp(r->cols, want->cols,
+                        r->ncols * (size_t)(IMAGE_ROWS/8)));
+        }
+        rle_free(r);
+        rle_free(want);
+        free(pattern);
+        pattern = NULL;
+
+        /* Narrow, turned or trimmed images are decoded whole */
+        opt_rotate = 2;
+        CHECK(rle_encode_pbm(img, len) == NULL);
+        opt_rotate = 0;
+        CHECK(rle_encode_pbm(img, len - 1) == NULL);
+        free(img);
+    }
+    CHECK(rle_encode_pbm((const uint8_t *)"P4 8 1\n\xff", 8) == NULL);
+}
+
+/*======================================================================
+  Raster operations against a dot by dot reference
+*/
+static _Bool dot(const uint8_t *pat, unsigned x, unsigned row)
+{
+    return COLUMN(pat, x)[row / 8] >> (row % 8) & 1;
+}
+
+static void check_rop(void)
+{
+    enum { LEN = 37 };
+    static uint8_t a[LEN * (IMAGE_ROWS/8)], b[LEN * (IMAGE_ROWS/8)],
+           c[LEN * (IMAGE_ROWS/8)];
+    unsigned x, row, op;
+    int shift;
+    pattern_fill(a, LEN);
+    pattern_fill(b, LEN);
+
+    memcpy(c, a, sizeof c);
+    rop_mirror(c, LEN);
+    _Bool ok = true;
+    for (x = 0; x < LEN; ++x)
+        ok = ok && !memcmp(COLUMN(c, x), COLUMN(a, LEN - 1 - x),
+                IMAGE_ROWS/8);
+    CHECK(ok);
+
+    memcpy(c, a, sizeof c);
+    rop_flip(c, LEN);
+    ok = true;
+    for (x = 0; x < LEN; ++x)
+        for (row = 0; row < IMAGE_ROWS; ++row)
+            ok = ok && dot(c, x, row) == dot(a, x, IMAGE_ROWS - 1 - row);
+    CHECK(ok);
+
+    static const int shifts[] = { 0, 1, 7, 8, 63, 64, 65, 127, 128, 200 };
+    for (op = 0; op < sizeof shifts / sizeof *shifts * 2; ++op) {
+        shift = op & 1 ? -shifts[op / 2] : shifts[op / 2];
+        memcpy(c, a, sizeof c);
+        rop_shift(c, LEN, shift);
+        ok = true;
+        for (x = 0; x < LEN; ++x) {
+            for (row = 0; row < IMAGE_ROWS; ++row) {
+                int from = (int)row - shift;
+                _Bool want = from >= 0 && from < IMAGE_ROWS &&
+                    dot(a, x, from);
+                ok = ok && dot(c, x, row) == want;
+            }
+        }
+        CHECK(ok);
+    }
+
+    /* Each operation, clipped on both sides */
+    for (op = ROP_COPY; op <= ROP_XOR; ++op) {
+        for (shift = -5; shift <= 5; shift += 5) {
+            memcpy(c, a, sizeof c);
+            rop_blit(c, LEN, shift, b, LEN, op);
+            ok = true;
+            for (x = 0; x < LEN; ++x) {
+                int sx = (int)x - shift;
+                for (row = 0; row < IMAGE_ROWS; ++row) {
+                    _Bool d = dot(a, x, row), want = d;
+                    if (sx >= 0 && sx < LEN) {
+                        _Bool s = dot(b, sx, row);
+                        want = op == ROP_COPY ? s : op == ROP_OR ? d | s :
+                            op == ROP_AND ? d & s : d ^ s;
+                    }
+                    ok = ok && dot(c, x, row) == want;
+                }
+            }
+            CHECK(ok);
+        }
+    }
+
+    uint8_t counts[LEN];
+    rop_popcount(a, LEN, counts);
+    ok = true;
+    for (x = 0; x < LEN; ++x) {
+        unsigned n = 0;
+        for (row = 0; row < IMAGE_ROWS; ++row)
+            n += dot(a, x, row);
+        ok = ok && counts[x] == n;
+    }
+    CHECK(ok);
+
+    unsigned first;
+    memset(c, 0, sizeof c);
+    CHECK(rop_trim(c, LEN, &first) == 0);
+    COLUMN(c, 3)[0] = 1;
+    COLUMN(c, 30)[15] = 0x80;
+    CHECK(rop_trim(c, LEN, &first) == 28 && first == 3);
+}
+
+/*======================================================================
+  A PBM turned half a turn, through the raster operations: each dot
+  where it goes once turned, centred as it was
+*/
+static void check_half_turn(void)
+{
+    static const unsigned sizes[][2] = { { 19, 7 }, { 10, 8 }, { 3, 128 } };
+    unsigned i, x, y;
+    for (i = 0; i < sizeof sizes / sizeof *sizes; ++i) {
+        unsigned w = sizes[i][0], h = sizes[i][1], stride = (w + 7) / 8;
+        uint8_t img[16 + 2 * 128];
+        int hl = snprintf((char *)img, 16, "P4\n%u %u\n", w, h);
+        for (y = 0; y < stride * h; ++y)
+            img[hl + y] = random_byte();
+        opt_rotate = 2;
+        CHECK(load_image(img, hl + stride * h) == 0);
+        opt_rotate = 0;
+        if (!pattern)
+            continue;
+        unsigned pad = (IMAGE_ROWS - h) / 2;
+        _Bool ok = image_w == w;
+        for (x = 0; ok && x < w; ++x) {
+            for (y = 0; y < IMAGE_ROWS; ++y) {
+                unsigned sx = w - 1 - x, sy = h - 1 - (y - pad);
+                _Bool want = y >= pad && y < pad + h &&
+                    img[hl + sy * stride + sx / 8] << (sx % 8) & 0x80;
+                ok = ok && dot(pattern, x, y) == want;
+            }
+        }
+        CHECK(ok);
+        free(pattern);
+        pattern = NULL;
+    }
+}
+
+/*======================================================================
+  Barcodes: the widths of the published examples, and the size of the
+  2D symbols with their quiet zones
+*/
+static unsigned bars_modules(const struct barcode_t *b)
+{
+    unsigned n = 0, i;
+    for (i = 0; i < b->count; ++i)
+        n += b->runs[i];
+    return n;
+}
+
+static void check_barcode(void)
+{
+    static struct barcode_t b;
+    CHECK(barcode_encode(&b, "ean13:4006381333931", 64) == 0);
+    CHECK(b.count == 59 && bars_modules(&b) == 95);
+    CHECK(barcode_encode(&b, "ean13:400638133393", 64) == 0);
+    CHECK(b.count == 59);
+    CHECK(barcode_encode(&b, "ean13:4006381333932", 64) != 0);
+
+    /* Start B, 9 characters, check 88, stop */
+    CHECK(barcode_encode(&b, "code128:Wikipedia", 64) == 0);
+    CHECK(b.count == 11 * 6 + 7 && bars_modules(&b) == 11 * 11 + 13);
+    CHECK(b.count == 73 && !memcmp(b.runs + 60, "\4\2\1\2\1\1", 6));
+    /* Set C for the digits, two in each symbol */
+    CHECK(barcode_encode(&b, "code128:123456", 64) == 0);
+    CHECK(b.count == 5 * 6 + 7);
+
+    CHECK(barcode_encode(&b, "code39:abc", 64) == 0);
+    CHECK(bars_modules(&b) == 5 * 15 + 4);
+    CHECK(barcode_encode(&b, "code39:a*c", 64) != 0);
+
+    CHECK(barcode_encode(&b, "qr-h:klg2", 64) == 0);
+    CHECK(b.size == 21 && b.module == 3);
+    CHECK(barcode_width(&b) == (21 + 8) * 3);
+    CHECK(barcode_encode(&b, "datamatrix,2:123456", 64) == 0);
+    CHECK(b.size == 10 && barcode_width(&b) == 12 * 2);
+    CHECK(barcode_encode(&b, "qr,9:klg2", 64) != 0);
+    CHECK(barcode_encode(&b, "pdf417:x", 64) != 0);
+}
+
+/*======================================================================
+  The long-running mode on a localhost socket: a PBM sent to the TCP
+  listener becomes a queued job holding the same pattern as the image
+  loaded directly
+*/
+static int server_connect(int family)
+{
+    struct sockaddr_storage addr;
+    socklen_t len = sizeof addr;
+    unsigned i;
+    for (i = 0; i < listen_count; ++i) {
+        len = sizeof addr;
+        if (!getsockname(listen_fds[i], (struct sockaddr *)&addr, &len) &&
+                addr.ss_family == family)
+            break;
+    }
+    if (i == listen_count)
+        return -1;
+    int fd = socket(family, SOCK_STREAM, 0);
+    if (fd >= 0 && connect(fd, (struct sockaddr *)&addr, len)) {
+        close(fd);
+        fd = -1;
+    }
+    return fd;
+}
+
+static struct job_t *server_job(void)
+{
+    unsigned i;
+    for (i = 0; i < 100 && !queue_peek(); ++i) {
+        loop_poll(50, false);
+        loop_ingest();
+    }
+    return queue_pop();
+}
+
+static void check_server_image(int family, const uint8_t *img, size_t len,
+        const uint8_t *want, unsigned want_size)
+{
+    int fd = server_connect(family);
+    CHECK(fd >= 0);
+    if (fd < 0)
+        return;
+    CHECK(write(fd, img, len) == (ssize_t)len);
+    close(fd);
+
+    struct job_t *job = server_job();
+    CHECK(job != NULL);
+    if (!job)
+        return;
+    CHECK(job->pattern_size == want_size);
+    uint8_t *got = malloc(want_size);
+    if (got && job->pattern_size == want_size) {
+        struct raster_reader_t rd;
+        if (job->rle) {
+            raster_reader_rle(&rd, job->rle, 0);
+        } else {
+            memset(&rd, 0, sizeof rd);
+            rd.raw = job->pattern;
+        }
+        CHECK(raster_read(&rd, got, want_size) == 0);
+        CHECK(!memcmp(got, want, want_size));
+    }
+    free(got);
+    job_free(job);
+}
+
+static void check_server(void)
+{
+    /* A banner with long blank stretches, kept compact while queued */
+    unsigned w = 1000, h = 64, y;
+    char head[32];
+    int hl = snprintf(head, sizeof head, "P4\n%u %u\n", w, h);
+    size_t len = hl + (w + 7) / 8 * h;
+    uint8_t *img = calloc(1, len);
+    CHECK(img != NULL);
+    if (!img)
+        return;
+    memcpy(img, head, hl);
+    for (y = 0; y < h; ++y) {
+        uint8_t *row = img + hl + (w + 7) / 8 * y;
+        row[y / 8] = 0x80 >> (y % 8);
+        row[100 + y % 3] = 0xA5;
+    }
+
+    opt_raster_cache = 0;
+    CHECK(load_image_mem(img, len) == 0);
+    uint8_t *want = pattern;
+    unsigned want_size = pattern_size;
+    pattern = NULL;
+
+    CHECK(loop_listen_tcp("127.0.0.1:0") == 0);
+    if (want && listen_count) {
+        check_server_image(AF_INET, img, len, want, want_size);
+        /* Two images on one connection, with whitespace between */
+        int fd = server_connect(AF_INET);
+        CHECK(fd >= 0);
+        if (fd >= 0) {
+            CHECK(write(fd, img, len) == (ssize_t)len);
+            CHECK(write(fd, "\n", 1) == 1);
+            CHECK(write(fd, img, len) == (ssize_t)len);
+            close(fd);
+            struct job_t *job = server_job();
+            CHECK(job && job->pattern_size == want_size);
+            job_free(job);
+            job = server_job();
+            CHECK(job && job->pattern_size == want_size);
+            job_free(job);
+        }
+    }
+
+    /* An IPv6 host in brackets, where the loopback has IPv6 */
+    int fd6 = socket(AF_INET6, SOCK_STREAM, 0);
+    struct sockaddr_in6 lo6 = { .sin6_family = AF_INET6 };
+    lo6.sin6_addr = in6addr_loopback;
+    if (fd6 >= 0 && !bind(fd6, (struct sockaddr *)&lo6, sizeof lo6)) {
+        unsigned before = listen_count;
+        CHECK(loop_listen_tcp("[::1]:0") == 0);
+        CHECK(listen_count == before + 1);
+        if (want && listen_count > before)
+            check_server_image(AF_INET6, img, len, want, want_size);
+    }
+    if (fd6 >= 0)
+        close(fd6);
+
+    while (sources)
+        source_remove(sources);
+    while (listen_count)
+        close(listen_fds[--listen_count]);
+    free(want);
+    free(img);
+}
+
+/*======================================================================
+  Scheduling of the long-running mode: across clients the most urgent
+  job first, with the priority a client can ask for capped
+*/
+static struct job_t *queue_job(struct client_t *c, int priority,
+        double deadline)
+{
+    struct job_t *job = job_new(c);
+    if (job) {
+        job->priority = priority;
+        job->deadline = deadline ? job->arrived + deadline : 0;
+        job->pattern_size = 100 * (IMAGE_ROWS/8);
+        queue_push(job);
+    }
+    return job;
+}
+
+static void check_queue(void)
+{
+    CHECK(loop_add_input("3,-2:/dev/null") == 0);
+    CHECK(loop_add_input("4:/dev/zero") == 0);
+    CHECK(clients && clients->weight == 4 &&
+            clients->top_priority == INT_MAX);
+    CHECK(clients && clients->next && clients->next->weight == 3 &&
+            clients->next->top_priority == -2);
+    while (sources)
+        source_remove(sources);
+    CHECK(clients == NULL);
+
+    struct client_t *a = client_get("a", 1, INT_MAX);
+    struct client_t *b = client_get("b", 1, 2);
+    ++a->refs;
+    ++b->refs;
+
+    struct job_t *job = job_new(b);
+    char opt[] = "priority=9";
+    CHECK(job && job_option(job, opt) == 0 && job->priority == 2);
+    if (job)
+        job_free(job);
+
+    /* A deadline goes first at the same priority, whatever the order
+       of arrival and the service of its client */
+    struct job_t *a1 = queue_job(a, 1, 0);
+    struct job_t *b1 = queue_job(b, 1, 5000);
+    b->vtime = 1000;
+    CHECK(queue_peek() == b1);
+    /* The highest priority before any deadline */
+    struct job_t *a2 = queue_job(a, 2, 0);
+    CHECK(queue_peek() == a2);
+    job_free(queue_pop());
+    CHECK(queue_pop() == b1);
+    job_free(b1);
+
+    /* Equal jobs: the client with the least service for its weight */
+    struct job_t *b2 = queue_job(b, 1, 0);
+    a->vtime = b->vtime + 1;
+    CHECK(queue_peek() == b2);
+    a->vtime = b->vtime - 1;
+    CHECK(queue_peek() == a1);
+    while ((job = queue_pop()))
+        job_free(job);
+    CHECK(!a->jobs && !b->jobs && !job_queued);
+
+    client_put(a);
+    client_put(b);
+    CHECK(clients == NULL);
+    sched_vtime = 0;
+}
+
+int main(void)
+{
+    gf_init(&gf_qr, 0x11D);
+    gf_init(&gf_dm, 0x12D);
+    check_frames();
+    check_trigger();
+    check_pnm();
+    check_raster_disk();
+    check_csv();
+    check_merge_text();
+    check_merge_render();
+    check_rs();
+    check_qr();
+    check_dm();
+    check_rle();
+    check_rle_pbm();
+    check_rop();
+    check_half_turn();
+    check_barcode();
+    check_server();
+    check_queue();
+    printf("%u checks, %u failed\n", checks, failures);
+    return failures != 0;
+}